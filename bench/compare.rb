@@ -0,0 +1,36 @@
+##
+#  Compare two result files written by bench/suite.rb
+#
+#  Usage: ruby bench/compare.rb BASE.json NEW.json [THRESHOLD]
+#
+#  Prints the change in median latency of every measurement and exits
+#  with status 1 if any of them got slower by more than THRESHOLD percent
+#  (default 10)
+##
+
+require 'json'
+
+if ARGV.size < 2
+  $stderr.puts "usage: #{$0} BASE.json NEW.json [THRESHOLD]"
+  exit 2
+end
+
+base, new = ARGV[0, 2].map { |f| JSON.parse(File::read(f)) }
+threshold = (ARGV[2] || 10).to_f
+regressed = false
+
+puts "#{base['revision']} -> #{new['revision']}"
+new["results"].each do |kind, results|
+  puts kind
+  results.each do |name, r|
+    old = base["results"].fetch(kind, {})[name]
+    next unless old && old["p50_ns"] > 0
+    change = (r["p50_ns"] - old["p50_ns"]) * 100.0 / old["p50_ns"]
+    mark = change > threshold ? " REGRESSION" : ""
+    regressed ||= change > threshold
+    printf("  %-10s p50 %10.3fms -> %10.3fms  %+7.1f%%%s\n", name,
+           old["p50_ns"] / 1e6, r["p50_ns"] / 1e6, change, mark)
+  end
+end
+
+exit(regressed ? 1 : 0)
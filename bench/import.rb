@@ -0,0 +1,59 @@
+##
+#  Compare writing a generated /etc/hosts with one set per node against a
+#  single import, for several numbers of hosts. Since every host is a
+#  child of the same node, the time of both grows faster than the number
+#  of hosts; the time per host shows by how much.
+#
+#  Usage: ruby bench/import.rb [NHOSTS...]
+##
+
+require 'benchmark'
+require 'fileutils'
+require 'tmpdir'
+
+TOPDIR = File::expand_path(File::join(File::dirname(__FILE__), ".."))
+$:.unshift(File::join(TOPDIR, "lib"))
+$:.unshift(File::join(TOPDIR, "ext", "augeas"))
+
+require 'augeas'
+
+sizes = ARGV.empty? ? [1_000, 5_000, 10_000] : ARGV.map(&:to_i)
+
+def hosts_tree(nhosts)
+  Array.new(nhosts) do |i|
+    [(i + 1).to_s, nil, [["ipaddr", "10.#{i / 65536}.#{(i / 256) % 256}.#{i % 256}"],
+                         ["canonical", "host#{i}.example.com"],
+                         ["alias", "host#{i}"]]]
+  end
+end
+
+def report(name, nhosts, t)
+  printf("%-8s %8d %8.3fs %8.1fus/host\n", name, nhosts, t, t * 1e6 / nhosts)
+end
+
+Dir.mktmpdir("augeas-bench") do |root|
+  FileUtils::mkdir_p(File::join(root, "etc"))
+  File.write(File::join(root, "etc", "hosts"), "")
+
+  Augeas::create(:root => root, :lenses => { "Hosts" => "/etc/hosts" }) do |aug|
+    sizes.each do |nhosts|
+      tree = hosts_tree(nhosts)
+
+      aug.rm("/files/etc/hosts/*")
+      t = Benchmark.realtime do
+        tree.each do |label, _, children|
+          children.each do |name, value|
+            aug.set("/files/etc/hosts/#{label}/#{name}", value)
+          end
+        end
+      end
+      report("set", nhosts, t)
+
+      aug.rm("/files/etc/hosts/*")
+      t = Benchmark.realtime do
+        aug.import("/files/etc/hosts", tree, mode: :replace)
+      end
+      report("import", nhosts, t)
+    end
+  end
+end
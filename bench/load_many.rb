@@ -0,0 +1,51 @@
+##
+#  Compare opening handles for many roots one after the other against
+#  Augeas.load_many with increasing concurrency
+#
+#  Usage: ruby bench/load_many.rb [NROOTS] [NFILES]
+##
+
+require 'benchmark'
+require 'etc'
+require 'fileutils'
+require 'tmpdir'
+
+TOPDIR = File::expand_path(File::join(File::dirname(__FILE__), ".."))
+$:.unshift(File::join(TOPDIR, "lib"))
+$:.unshift(File::join(TOPDIR, "ext", "augeas"))
+
+require 'augeas'
+
+nroots = (ARGV[0] || 32).to_i
+nfiles = (ARGV[1] || 200).to_i
+
+Dir.mktmpdir("augeas-bench") do |dir|
+  roots = Array.new(nroots) do |r|
+    root = File::join(dir, "root#{r}")
+    FileUtils::mkdir_p(File::join(root, "etc"))
+    File.open(File::join(root, "etc", "hosts"), "w") do |f|
+      nfiles.times do |i|
+        f.puts "10.#{r}.#{i / 256}.#{i % 256}\thost#{i}.example.com host#{i}"
+      end
+    end
+    FileUtils::cp_r(File::join(TOPDIR, "tests", "root", "etc", "ssh"),
+                    File::join(root, "etc"))
+    root
+  end
+
+  t = Benchmark.realtime do
+    roots.each { |root| Augeas::create(:root => root).close }
+  end
+  printf("%-22s %8.3fs\n", "one after the other", t)
+
+  concurrency = 1
+  while concurrency <= Etc.nprocessors
+    augs = nil
+    t = Benchmark.realtime do
+      augs = Augeas::load_many(roots, :concurrency => concurrency)
+    end
+    augs.each { |aug| aug.close unless aug.is_a?(Exception) }
+    printf("%-22s %8.3fs\n", "load_many with #{concurrency}", t)
+    concurrency *= 2
+  end
+end
@@ -0,0 +1,65 @@
+##
+#  Compare loading and matching separate roots one after the other in the
+#  main Ractor against doing the same in one Ractor per root
+#
+#  Usage: ruby bench/ractors.rb [NRACTORS] [NHOSTS] [NMATCHES]
+##
+
+require 'benchmark'
+require 'fileutils'
+require 'tmpdir'
+
+TOPDIR = File::expand_path(File::join(File::dirname(__FILE__), ".."))
+$:.unshift(File::join(TOPDIR, "lib"))
+$:.unshift(File::join(TOPDIR, "ext", "augeas"))
+
+require 'augeas'
+
+Warning[:experimental] = false
+
+nractors = (ARGV[0] || 4).to_i
+nhosts = (ARGV[1] || 20_000).to_i
+nmatches = (ARGV[2] || 200).to_i
+
+# Open ROOT, load its /etc/hosts and run NMATCHES queries against it;
+# return the number of nodes found
+def work(root, nhosts, nmatches)
+  aug = Augeas::create(:root => root, :no_modl_autoload => true,
+                       :no_load => true)
+  aug.transform(:lens => "Hosts.lns", :incl => "/etc/hosts")
+  aug.load
+  found = 0
+  nmatches.times do |i|
+    found += aug.match("/files/etc/hosts/*[canonical = 'host#{i * 97 % nhosts}.example.com']").size
+  end
+  aug.close
+  found
+end
+
+Dir.mktmpdir("augeas-bench") do |dir|
+  roots = Array.new(nractors) do |r|
+    root = File::join(dir, "root#{r}")
+    FileUtils::mkdir_p(File::join(root, "etc"))
+    File.open(File::join(root, "etc", "hosts"), "w") do |f|
+      nhosts.times do |i|
+        f.puts "10.#{r}.#{i / 256}.#{i % 256}\thost#{i}.example.com host#{i}"
+      end
+    end
+    root.freeze
+  end
+
+  t = Benchmark.realtime do
+    roots.each { |root| work(root, nhosts, nmatches) }
+  end
+  printf("%-22s %8.3fs\n", "one after the other", t)
+
+  t = Benchmark.realtime do
+    ractors = roots.map do |root|
+      Ractor.new(root, nhosts, nmatches) do |root, nhosts, nmatches|
+        work(root, nhosts, nmatches)
+      end
+    end
+    ractors.each(&:take)
+  end
+  printf("%-22s %8.3fs\n", "#{nractors} Ractors", t)
+end
@@ -0,0 +1,46 @@
+##
+#  Compare Augeas#refresh against a full load on a tree with many files
+#
+#  Usage: ruby bench/refresh.rb [NFILES] [ROUNDS]
+##
+
+require 'benchmark'
+require 'fileutils'
+require 'tmpdir'
+
+TOPDIR = File::expand_path(File::join(File::dirname(__FILE__), ".."))
+$:.unshift(File::join(TOPDIR, "lib"))
+$:.unshift(File::join(TOPDIR, "ext", "augeas"))
+
+require 'augeas'
+
+nfiles = (ARGV[0] || 3000).to_i
+rounds = (ARGV[1] || 10).to_i
+
+Dir.mktmpdir("augeas-bench") do |root|
+  dir = File::join(root, "etc", "hosts.d")
+  FileUtils::mkdir_p(dir)
+  nfiles.times do |i|
+    File.open(File::join(dir, "host#{i}"), "w") do |f|
+      f.puts "10.#{i / 65536}.#{(i / 256) % 256}.#{i % 256}\thost#{i}.example.com host#{i}"
+    end
+  end
+
+  Augeas::create(:root => root, :no_load => true) do |aug|
+    aug.clear_transforms
+    aug.transform(:lens => "Hosts.lns", :incl => "/etc/hosts.d/*")
+    t = Benchmark.realtime { aug.load }
+    printf("initial load of %d files: %.3fs\n", nfiles, t)
+    aug.refresh
+
+    load_time = refresh_time = 0
+    rounds.times do |r|
+      File.open(File::join(dir, "host#{r}"), "a") { |f| f.puts "# round #{r}" }
+      load_time += Benchmark.realtime { aug.load }
+      File.open(File::join(dir, "host#{r}"), "a") { |f| f.puts "# again" }
+      refresh_time += Benchmark.realtime { aug.refresh }
+    end
+    printf("load after changing one file:    %.2fms\n", load_time * 1000 / rounds)
+    printf("refresh after changing one file: %.2fms\n", refresh_time * 1000 / rounds)
+  end
+end
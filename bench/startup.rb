@@ -0,0 +1,38 @@
+##
+#  Compare the time it takes to open a handle with the default lenses
+#  against opening one that compiles and loads only the lenses and files it
+#  needs
+#
+#  Usage: ruby bench/startup.rb [NRUNS]
+##
+
+require 'benchmark'
+require 'fileutils'
+require 'tmpdir'
+
+TOPDIR = File::expand_path(File::join(File::dirname(__FILE__), ".."))
+$:.unshift(File::join(TOPDIR, "lib"))
+$:.unshift(File::join(TOPDIR, "ext", "augeas"))
+
+require 'augeas'
+
+nruns = (ARGV[0] || 10).to_i
+
+Dir.mktmpdir("augeas-bench") do |root|
+  FileUtils::cp_r(File::join(TOPDIR, "tests", "root", "."), root)
+
+  runs = {
+    "default" => {},
+    "no_load" => { :no_load => true },
+    "lenses and files" => { :lenses => ["Hosts", "Sshd"],
+                            :files => ["/etc/hosts", "/etc/ssh/sshd_config"] },
+    "lenses with globs" => { :lenses => { "Hosts" => "/etc/hosts",
+                                          "Sshd" => "/etc/ssh/sshd_config" } }
+  }
+  runs.each do |name, opts|
+    t = Benchmark.realtime do
+      nruns.times { Augeas::create({ :root => root }.merge(opts)).close }
+    end
+    printf("%-18s %8.3fs per handle\n", name, t / nruns)
+  end
+end
@@ -0,0 +1,70 @@
+##
+#  Compare the memory and allocations of match, get and label results with
+#  and without interned strings on a large /etc/hosts
+#
+#  Usage: ruby bench/strings.rb [NHOSTS]
+##
+
+require 'benchmark'
+require 'fileutils'
+require 'objspace'
+require 'tmpdir'
+
+TOPDIR = File::expand_path(File::join(File::dirname(__FILE__), ".."))
+$:.unshift(File::join(TOPDIR, "lib"))
+$:.unshift(File::join(TOPDIR, "ext", "augeas"))
+
+require 'augeas'
+
+nhosts = (ARGV[0] || 50_000).to_i
+
+# Run the block and return its result, the time it took, the number of
+# objects it allocated and the bytes its result retains
+def measure
+  GC.start
+  allocated = GC.stat(:total_allocated_objects)
+  result = nil
+  t = Benchmark.realtime { result = yield }
+  allocated = GC.stat(:total_allocated_objects) - allocated
+  GC.start
+  seen = {}
+  bytes = ObjectSpace.memsize_of(result)
+  result.flatten.each do |str|
+    next if str.nil? || seen[str.object_id]
+    seen[str.object_id] = true
+    bytes += ObjectSpace.memsize_of(str)
+  end
+  [result, t, allocated, bytes]
+end
+
+Dir.mktmpdir("augeas-bench") do |root|
+  FileUtils::mkdir_p(File::join(root, "etc"))
+  File.open(File::join(root, "etc", "hosts"), "w") do |f|
+    nhosts.times do |i|
+      f.puts "10.#{i / 65536}.#{(i / 256) % 256}.#{i % 256}\thost#{i}.example.com host#{i} www"
+    end
+  end
+
+  aug = Augeas::create(:root => root, :no_modl_autoload => true,
+                       :no_load => true)
+  aug.transform(:lens => "Hosts.lns", :incl => "/etc/hosts")
+  aug.load
+
+  [false, true].each do |interned|
+    aug.interned_strings = interned
+    puts(interned ? "interned" : "plain")
+    paths = aug.match("/files/etc/hosts/*/*")
+    runs = {
+      "match" => lambda { aug.match("/files/etc/hosts/*/*") },
+      "label" => lambda { paths.map { |p| aug.label(p) } },
+      "get" => lambda { aug.match("/files/etc/hosts/*/alias").map { |p| aug.get(p) } },
+      "get_all" => lambda { aug.get_all("/files/etc/hosts/*/alias").to_a }
+    }
+    runs.each do |name, run|
+      _, t, allocated, bytes = measure(&run)
+      printf("  %-8s %8.3fs %10d objects allocated %12d bytes retained\n",
+             name, t, allocated, bytes)
+    end
+  end
+  aug.close
+end
@@ -0,0 +1,166 @@
+##
+#  Measure the throughput and latency of the bindings on synthetic roots
+#
+#  Usage: ruby bench/suite.rb [OUTPUT]
+#
+#  The size of the generated root can be changed with the environment
+#  variables BENCH_HOSTS (lines in /etc/hosts, default 100000),
+#  BENCH_FILES (number of sshd and inittab style files each, default 2000)
+#  and BENCH_ITERATIONS (calls per measurement, default 200). Results are
+#  written as JSON to OUTPUT, by default build/bench/<commit>.json; use
+#  bench/compare.rb to compare two such files.
+##
+
+require 'fileutils'
+require 'json'
+require 'rbconfig'
+
+TOPDIR = File::expand_path(File::join(File::dirname(__FILE__), ".."))
+$:.unshift(File::join(TOPDIR, "lib"))
+$:.unshift(File::join(TOPDIR, "ext", "augeas"))
+
+require 'augeas'
+
+HOSTS = (ENV["BENCH_HOSTS"] || 100_000).to_i
+FILES = (ENV["BENCH_FILES"] || 2000).to_i
+ITERATIONS = (ENV["BENCH_ITERATIONS"] || 200).to_i
+ROOT = File::join(TOPDIR, "build", "bench", "root")
+
+def now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+end
+
+# Generate the synthetic root, unless it exists with the same parameters
+def generate_root
+  stamp = File::join(ROOT, ".params")
+  params = "#{HOSTS} #{FILES}"
+  return if File::exist?(stamp) && File::read(stamp) == params
+
+  FileUtils::rm_rf(ROOT)
+  FileUtils::mkdir_p(File::join(ROOT, "etc", "sshd.d"))
+  FileUtils::mkdir_p(File::join(ROOT, "etc", "inittab.d"))
+
+  File.open(File::join(ROOT, "etc", "hosts"), "w") do |f|
+    f.puts "127.0.0.1\tlocalhost.localdomain localhost"
+    HOSTS.times do |i|
+      f.puts "10.#{i / 65536}.#{(i / 256) % 256}.#{i % 256}\thost#{i}.example.com host#{i}"
+    end
+  end
+  FILES.times do |i|
+    File.open(File::join(ROOT, "etc", "sshd.d", "sshd#{i}.conf"), "w") do |f|
+      f.puts "Port #{2000 + i}"
+      f.puts "ListenAddress 10.0.#{i / 256}.#{i % 256}"
+      f.puts "PermitRootLogin no"
+      f.puts "AllowUsers user#{i} admin"
+      f.puts "Subsystem sftp /usr/libexec/openssh/sftp-server"
+    end
+    File.open(File::join(ROOT, "etc", "inittab.d", "inittab#{i}"), "w") do |f|
+      f.puts "id:3:initdefault:"
+      f.puts "si::sysinit:/etc/rc.d/rc.sysinit"
+      7.times { |l| f.puts "l#{l}:#{l}:wait:/etc/rc.d/rc #{l}" }
+      f.puts "x#{i}:5:respawn:/etc/X11/prefdm -nodaemon"
+    end
+  end
+  File.open(stamp, "w") { |f| f.write(params) }
+end
+
+# Run the block ITERATIONS times, passing it the iteration, and return
+# throughput and latency statistics for it in ns
+def measure(iterations = ITERATIONS)
+  samples = Array.new(iterations) do |i|
+    start = now
+    yield i
+    now - start
+  end
+  samples.sort!
+  total = samples.inject(0) { |sum, t| sum + t }
+  {
+    "iterations" => iterations,
+    "ops_per_sec" => total > 0 ? iterations * 1e9 / total : nil,
+    "mean_ns" => total / iterations,
+    "min_ns" => samples.first,
+    "p50_ns" => samples[iterations / 2],
+    "p99_ns" => samples[(iterations * 99) / 100],
+    "max_ns" => samples.last
+  }
+end
+
+def transforms(aug)
+  aug.rm("/augeas/load/*")
+  aug.set("/augeas/load/Hosts/lens", "Hosts.lns")
+  aug.set("/augeas/load/Hosts/incl", "/etc/hosts")
+  aug.set("/augeas/load/Sshd/lens", "Sshd.lns")
+  aug.set("/augeas/load/Sshd/incl", "/etc/sshd.d/*")
+  aug.set("/augeas/load/Inittab/lens", "Inittab.lns")
+  aug.set("/augeas/load/Inittab/incl", "/etc/inittab.d/*")
+end
+
+# The benchmarks for one kind of handle; OPEN returns a handle that has
+# not loaded any files yet
+def run(open)
+  results = {}
+  results["init"] = measure(5) { open.call.close }
+
+  aug = open.call
+  transforms(aug)
+  results["load"] = measure(3) do
+    aug.rm("/augeas/files")
+    aug.load
+  end
+
+  results["match"] = measure do |i|
+    aug.match("/files/etc/hosts/*[canonical = 'host#{i * 97 % HOSTS}.example.com']")
+  end
+  results["match_all"] = measure(5) { aug.match("/files//*") }
+  results["get"] = measure(ITERATIONS * 10) do |i|
+    aug.get("/files/etc/sshd.d/sshd#{i % FILES}.conf/Port")
+  end
+  results["set"] = measure(ITERATIONS * 10) do |i|
+    aug.set("/files/etc/sshd.d/sshd#{i % FILES}.conf/PermitRootLogin",
+            i.even? ? "yes" : "no")
+  end
+  aug.save
+  results["save"] = measure do |i|
+    aug.set("/files/etc/sshd.d/sshd#{i % FILES}.conf/Port", (3000 + i).to_s)
+    aug.save
+  end
+  results["srun"] = measure do |i|
+    aug.srun("get /files/etc/inittab.d/inittab#{i % FILES}/id/runlevels\n" +
+             "set /files/etc/inittab.d/inittab#{i % FILES}/si/action sysinit\n")
+  end
+  aug.close
+  results
+end
+
+generate_root
+
+revision = `git -C #{TOPDIR} rev-parse --short HEAD 2>/dev/null`.strip
+revision = "unknown" if revision.empty?
+output = ARGV[0] || File::join(TOPDIR, "build", "bench", "#{revision}.json")
+flags = Augeas::NO_LOAD | Augeas::NO_MODL_AUTOLOAD
+
+report = {
+  "revision" => revision,
+  "time" => Time.now.utc.strftime("%Y-%m-%dT%H:%M:%SZ"),
+  "ruby" => RUBY_DESCRIPTION,
+  "params" => { "hosts" => HOSTS, "files" => FILES, "iterations" => ITERATIONS },
+  "results" => {
+    "Augeas" => run(lambda { Augeas::open(ROOT, nil, flags) }),
+    "Augeas::Facade" => run(lambda {
+      Augeas::create(:root => ROOT, :no_load => true, :no_modl_autoload => true)
+    })
+  }
+}
+Augeas::open(ROOT, nil, flags) { |aug| report["augeas"] = aug.get("/augeas/version") }
+
+FileUtils::mkdir_p(File::dirname(output))
+File.open(output, "w") { |f| f.puts JSON.pretty_generate(report) }
+
+report["results"].each do |kind, results|
+  puts kind
+  results.each do |name, r|
+    printf("  %-10s %12.1f ops/s  p50 %10.3fms  p99 %10.3fms\n", name,
+           r["ops_per_sec"] || 0, r["p50_ns"] / 1e6, r["p99_ns"] / 1e6)
+  end
+end
+puts "Results written to #{output}"
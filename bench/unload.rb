@@ -0,0 +1,43 @@
+##
+#  Load many generated hosts files and show the size of the tree and the
+#  time to look into one of them without a tree budget, and with one that
+#  only leaves room for a few files
+#
+#  Usage: ruby bench/unload.rb [NFILES] [NHOSTS]
+##
+
+require 'benchmark'
+require 'fileutils'
+require 'tmpdir'
+
+TOPDIR = File::expand_path(File::join(File::dirname(__FILE__), ".."))
+$:.unshift(File::join(TOPDIR, "lib"))
+$:.unshift(File::join(TOPDIR, "ext", "augeas"))
+
+require 'augeas'
+
+nfiles = (ARGV[0] || 200).to_i
+nhosts = (ARGV[1] || 100).to_i
+
+Dir.mktmpdir("augeas-bench") do |root|
+  dir = File::join(root, "etc", "hosts.d")
+  FileUtils::mkdir_p(dir)
+  hosts = Array.new(nhosts) { |i| "10.0.#{i / 256}.#{i % 256}\thost#{i}.example.com host#{i}\n" }.join
+  nfiles.times { |i| File.write(File::join(dir, "hosts#{i}"), hosts) }
+
+  lenses = { "Hosts" => "/etc/hosts.d/*" }
+  [nil, { :nodes => 8 * nhosts * 4 }].each do |budget|
+    Augeas::create(:root => root, :lenses => lenses,
+                   :tree_budget => budget) do |aug|
+      stats = aug.stats
+      t = Benchmark.realtime do
+        nfiles.times do |i|
+          aug.get("/files/etc/hosts.d/hosts#{i}/1/ipaddr")
+        end
+      end
+      printf("%-16s %8d nodes %10d bytes %4d unloaded %8.3fs\n",
+             budget ? "nodes=#{budget[:nodes]}" : "no budget",
+             stats[:nodes], stats[:bytes], aug.unloaded_files.size, t)
+    end
+  end
+end
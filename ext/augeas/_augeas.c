@@ -22,26 +22,730 @@
 #include "_augeas.h"
 
 #include <ruby.h>
+#include <ruby/util.h>
 #include <augeas.h>
+#include <libxml/tree.h>
+/* libxml2 built with ICU defines UChar, which Onigmo would redefine */
+#define ONIG_ESCAPE_UCHAR_COLLISION
+#include <ruby/encoding.h>
+#include <sys/stat.h>
+#include <fnmatch.h>
+#include <time.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+#include <ruby/fiber/scheduler.h>
+#endif
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+#include <ruby/ractor.h>
+#endif
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include <ruby/thread.h>
+#else
+/* Without the thread API, long calls simply run with the GVL held */
+static void *rb_thread_call_without_gvl(void *(*func)(void *), void *data1,
+                                        rb_unblock_function_t *ubf,
+                                        void *data2) {
+    return func(data1);
+}
+#endif
 
 static VALUE c_augeas;
 static VALUE c_facade;
 
-static augeas *aug_handle(VALUE s) {
-    augeas *aug;
+static const rb_data_type_t augeas_data_type;
+
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+/* Each Ractor that opens a handle gets a token in its local storage; a
+   handle remembers the token of the Ractor that created it */
+static rb_ractor_local_key_t ractor_key;
+
+static const struct rb_ractor_local_storage_type ractor_token_type = {
+    NULL, ruby_xfree
+};
+
+static void *current_ractor(void) {
+    void *token = rb_ractor_local_storage_ptr(ractor_key);
+
+    if (token == NULL) {
+        token = ALLOC(char);
+        rb_ractor_local_storage_ptr_set(ractor_key, token);
+    }
+    return token;
+}
+#endif
+
+static struct augeas_handle *get_handle(VALUE s) {
+    struct augeas_handle *h;
+
+    TypedData_Get_Struct(s, struct augeas_handle, &augeas_data_type, h);
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+    if (h->ractor != current_ractor())
+        rb_raise(rb_path2class("Ractor::IsolationError"),
+                 "Augeas handle used outside of the Ractor that created it");
+#endif
+    return h;
+}
+
+static long long monotonic_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-    Data_Get_Struct(s, struct augeas, aug);
-    if (aug == NULL) {
+/*
+ * Acquire the lock of the handle S and return its augeas handle. Every
+ * call into libaugeas must happen between aug_lock and aug_unlock so that
+ * two threads never use the same augeas handle at once.
+ *
+ * Nothing between aug_lock and aug_unlock may raise; convert arguments
+ * before taking the lock and build Ruby objects after releasing it.
+ * Pointers into the tree that libaugeas hands back stay valid after
+ * aug_unlock until the GVL is released, since no other thread can touch
+ * the handle before then.
+ */
+static augeas *aug_lock(VALUE s) {
+    struct augeas_handle *h = get_handle(s);
+
+    /* The block or IO of srun runs while the handle is locked */
+    if (rb_mutex_locked_p(h->lock)
+        && RTEST(rb_funcall(h->lock, rb_intern("owned?"), 0)))
+        rb_raise(rb_const_get(c_augeas, rb_intern("Error")),
+                 "Augeas handle used while this thread is in a call on it,"
+                 " like from the block or IO of srun");
+    rb_mutex_lock(h->lock);
+    if (h->aug == NULL) {
+        rb_mutex_unlock(h->lock);
         rb_raise(rb_eSystemCallError, "Failed to retrieve connection");
     }
-    return aug;
+    if (h->instrumenting)
+        h->inst_start = monotonic_ns();
+    return h->aug;
+}
+
+static void aug_unlock(VALUE s) {
+    struct augeas_handle *h = get_handle(s);
+
+    if (h->inst_start != 0) {
+        h->inst_ns += monotonic_ns() - h->inst_start;
+        h->inst_err = (h->aug == NULL) ? AUG_NOERROR : aug_error(h->aug);
+        h->inst_start = 0;
+    }
+    if (h->check_errors && h->aug != NULL) {
+        h->err_code = aug_error(h->aug);
+        if (h->err_code != AUG_NOERROR) {
+            h->err_message = aug_error_message(h->aug);
+            h->err_details = aug_error_details(h->aug);
+        }
+    }
+    rb_mutex_unlock(h->lock);
+}
+
+/*
+ * Note that the last call on S may have changed the tree, which
+ * invalidates the results kept in the match cache. Call this after
+ * aug_unlock in every binding that changes the tree.
+ */
+static void tree_changed(VALUE s) {
+    get_handle(s)->generation++;
+}
+
+static void hash_set(VALUE hash, const char *sym, VALUE v) {
+    rb_hash_aset(hash, ID2SYM(rb_intern(sym)), v);
+}
+
+/*
+ * Build the exception for the error CODE, using the class that
+ * Augeas::ERRORS_HASH maps CODE to
+ */
+static VALUE error_exception(int code, const char *message,
+                             const char *details) {
+    VALUE errors = rb_const_get(c_augeas, rb_intern("ERRORS_HASH"));
+    VALUE klass = rb_hash_aref(errors, INT2NUM(code));
+
+    if (NIL_P(klass))
+        klass = rb_const_get(c_augeas, rb_intern("Error"));
+    return rb_exc_new_str(klass,
+                          rb_sprintf("%s %s",
+                                     message == NULL ? "" : message,
+                                     details == NULL ? "" : details));
+}
+
+/*
+ * Return the exception for the error that the last call on the Facade
+ * handle S ran into, and forget about that error. If there was none, a
+ * negative RESULT leads to Augeas::CommandExecutionError, since that is
+ * what augtool reports, too. Return Qnil if the call succeeded.
+ */
+static VALUE facade_exception(VALUE s, VALUE result) {
+    struct augeas_handle *h = get_handle(s);
+
+    if (h->err_code != AUG_NOERROR) {
+        int code = h->err_code;
+
+        h->err_code = AUG_NOERROR;
+        return error_exception(code, h->err_message, h->err_details);
+    }
+    if (FIXNUM_P(result) && FIX2LONG(result) < 0) {
+        VALUE klass = rb_const_get(c_augeas,
+                                   rb_intern("CommandExecutionError"));
+        return rb_exc_new_str(klass,
+                              rb_sprintf("Command failed. Return code was %ld.",
+                                         FIX2LONG(result)));
+    }
+    return Qnil;
+}
+
+/*
+ * Raise the error that the last call on the Facade handle S ran into, if
+ * there was one. Otherwise, return RESULT.
+ */
+static VALUE facade_check(VALUE s, VALUE result) {
+    VALUE exc = facade_exception(s, result);
+
+    if (!NIL_P(exc))
+        rb_exc_raise(exc);
+    return result;
+}
+
+/*
+ * Turn STR, a label, value or path from the tree of H, into a Ruby
+ * string: a new binary string, or a frozen, deduplicated UTF-8 string if
+ * H returns interned strings
+ */
+static VALUE tree_str(struct augeas_handle *h, const char *str) {
+    if (h->interned) {
+#ifdef HAVE_RB_ENC_INTERNED_STR
+        return rb_enc_interned_str(str, strlen(str), rb_utf8_encoding());
+#else
+        return rb_funcall(rb_utf8_str_new_cstr(str), rb_intern("-@"), 0);
+#endif
+    }
+    return rb_str_new(str, strlen(str));
+}
+
+/* A call into libaugeas that runs without the GVL */
+struct blocking_call {
+    augeas *aug;
+    int   (*func)(augeas *aug, void *data);
+    void   *data;
+    int     result;
+    int     offload;
+};
+
+static void *blocking_call_run(void *arg) {
+    struct blocking_call *call = arg;
+
+    call->result = call->func(call->aug, call->data);
+    return NULL;
+}
+
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+/* A function that offload_call runs on a separate thread */
+struct offload_args {
+    void *(*func)(void *);
+    void   *data;
+    void   *result;
+};
+
+static VALUE offload_thread(void *arg) {
+    struct offload_args *args = arg;
+
+    args->result = rb_thread_call_without_gvl(args->func, args->data,
+                                              NULL, NULL);
+    return Qnil;
+}
+
+static VALUE offload_join(VALUE thread) {
+    return rb_funcall(thread, rb_intern("join"), 0);
+}
+
+/*
+ * Run ARGS->func on a new thread and wait for it with Thread#join, which
+ * hands control to the Fiber scheduler so that other fibers keep
+ * running. The function may use a handle until it returns; even if the
+ * fiber is interrupted, keep waiting for it and raise afterwards.
+ */
+static void offload_call(struct offload_args *args) {
+    VALUE thread = rb_thread_create(offload_thread, args);
+    VALUE err = Qnil;
+    int state = 0, st;
+
+    for (;;) {
+        rb_protect(offload_join, thread, &st);
+        if (st == 0)
+            break;
+        if (state == 0) {
+            state = st;
+            err = rb_errinfo();
+        }
+        rb_set_errinfo(Qnil);
+    }
+    if (state != 0) {
+        rb_set_errinfo(err);
+        rb_jump_tag(state);
+    }
+}
+#endif
+
+/*
+ * Run FUNC with DATA without the GVL and return its result. When called
+ * from a non-blocking fiber, FUNC runs on a separate thread while the
+ * Fiber scheduler runs other fibers, unless OFFLOAD is 0.
+ */
+static void *call_without_gvl(void *(*func)(void *), void *data,
+                              int offload) {
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+    if (offload && !NIL_P(rb_fiber_scheduler_current())) {
+        struct offload_args args;
+
+        args.func = func;
+        args.data = data;
+        args.result = NULL;
+        offload_call(&args);
+        return args.result;
+    }
+#endif
+    return rb_thread_call_without_gvl(func, data, NULL, NULL);
+}
+
+static VALUE blocking_call_body(VALUE arg) {
+    struct blocking_call *call = (struct blocking_call *) arg;
+
+    call_without_gvl(blocking_call_run, call, call->offload);
+    return Qnil;
+}
+
+static VALUE blocking_call_ensure(VALUE s) {
+    aug_unlock(s);
+    return Qnil;
+}
+
+/*
+ * Run FUNC on the augeas handle of S while holding the handle's lock but
+ * not the GVL, so that other Ruby threads keep running during long
+ * operations like aug_load. FUNC must not touch any Ruby objects; strings
+ * it uses should come from frozen copies of the arguments. OFFLOAD is
+ * passed on to call_without_gvl.
+ */
+static int aug_call(VALUE s, int (*func)(augeas *aug, void *data),
+                    void *data, int offload) {
+    struct blocking_call call;
+
+    call.aug = aug_lock(s);
+    call.func = func;
+    call.data = data;
+    call.result = -1;
+    call.offload = offload;
+    rb_ensure(blocking_call_body, (VALUE) &call, blocking_call_ensure, s);
+
+    return call.result;
+}
+
+static int aug_blocking(VALUE s, int (*func)(augeas *aug, void *data),
+                        void *data) {
+    return aug_call(s, func, data, 0);
+}
+
+/*
+ * The same as aug_blocking, but let the Fiber scheduler run other fibers
+ * while FUNC runs. Starting the thread that takes over the call costs
+ * more than most calls take, so this is only worth it for calls that
+ * read or write files, like load, save and srun.
+ */
+static int aug_offload(VALUE s, int (*func)(augeas *aug, void *data),
+                       void *data) {
+    return aug_call(s, func, data, 1);
+}
+
+/* Rough size of a node in the Augeas tree, struct tree, including malloc
+   overhead; its label and value come on top of that */
+#define TREE_NODE_BYTES 80
+
+/* Name of the variable tree_size uses to walk the nodes it looks at */
+#define TREE_SIZE_VAR "__ruby_augeas_tree_size"
+
+/*
+ * Estimate the memory used by the nodes matching the path expression
+ * EXPR, not counting their descendants. Store the number of nodes in
+ * *NODES and return the estimate in bytes, or -1 if EXPR could not be
+ * evaluated. Must be called with the lock of the handle held; the
+ * variable it uses is gone again when it returns, so it does not change
+ * the tree as far as the match cache is concerned.
+ */
+static long tree_size(augeas *aug, const char *expr, long *nodes) {
+    long bytes = 0;
+    int cnt, i;
+#ifdef HAVE_AUG_NS_PATH
+    if (aug_defvar(aug, TREE_SIZE_VAR, expr) < 0)
+        return -1;
+    cnt = aug_ns_count(aug, TREE_SIZE_VAR);
+    for (i = 0; i < cnt; i++) {
+        const char *label = NULL, *value = NULL;
+
+        aug_ns_label(aug, TREE_SIZE_VAR, i, &label, NULL);
+        aug_ns_value(aug, TREE_SIZE_VAR, i, &value);
+        bytes += TREE_NODE_BYTES;
+        bytes += (label == NULL) ? 0 : strlen(label) + 1;
+        bytes += (value == NULL) ? 0 : strlen(value) + 1;
+    }
+    aug_defvar(aug, TREE_SIZE_VAR, NULL);
+#else
+    char **matches = NULL;
+
+    cnt = aug_match(aug, expr, &matches);
+    if (cnt < 0)
+        return -1;
+    for (i = 0; i < cnt; i++) {
+        const char *label = NULL, *value = NULL;
+
+        aug_label(aug, matches[i], &label);
+        aug_get(aug, matches[i], &value);
+        bytes += TREE_NODE_BYTES;
+        bytes += (label == NULL) ? 0 : strlen(label) + 1;
+        bytes += (value == NULL) ? 0 : strlen(value) + 1;
+        free(matches[i]);
+    }
+    free(matches);
+#endif
+    *nodes = cnt;
+    return bytes;
+}
+
+static void augeas_mark(void *p) {
+    struct augeas_handle *h = p;
+
+    rb_gc_mark(h->lock);
+    rb_gc_mark(h->match_cache);
+}
+
+/* The stat data refresh compares to decide whether a file changed */
+struct file_stamp {
+    time_t mtime;
+    long   mtime_nsec;
+    off_t  size;
+    ino_t  ino;
+};
+
+static int stamp_free_i(st_data_t key, st_data_t value, st_data_t arg) {
+    xfree((char *) key);
+    xfree((struct file_stamp *) value);
+    return ST_DELETE;
+}
+
+/* Forget the stamps of all files, e.g. after a full load */
+static void stamps_clear(struct augeas_handle *h) {
+    if (h->stamps != NULL) {
+        st_foreach(h->stamps, stamp_free_i, 0);
+        st_free_table(h->stamps);
+        h->stamps = NULL;
+    }
+}
+
+/* Forget the stamp of the file NAME */
+static void stamps_forget(struct augeas_handle *h, const char *name) {
+    st_data_t key = (st_data_t) name, value;
+
+    if (h->stamps != NULL && st_delete(h->stamps, &key, &value)) {
+        xfree((char *) key);
+        xfree((struct file_stamp *) value);
+    }
+}
+
+/*
+ * The names of the files that calls changed, collected while holding the
+ * lock of a handle and added to its dirty table with dirty_merge after
+ * releasing it
+ */
+struct dirty_list {
+    char **names;
+    int    len;
+    int    size;
+    int    nomem;
+    int    unknown;    /* changed nodes under /files outside any file */
+};
+
+#define DIRTY_LIST_INIT { NULL, 0, 0, 0, 0 }
+
+/*
+ * Return the length of the part of the path expression PATH that spells
+ * out the names of nodes, up to the first predicate, wildcard or similar,
+ * or -1 if PATH may lead anywhere: when it is relative, or when the rest
+ * of it may leave that part, with "..", an axis, a union, a variable or
+ * another path into /files
+ */
+static long path_literal_len(const char *path) {
+    static const char *const escapes[] = { "..", "::", "|", "$", "/files" };
+    long i;
+    size_t j;
+
+    if (path[0] != '/')
+        return -1;
+    for (i = 1; path[i] != '\0'; i++) {
+        char c = path[i];
+
+        if (strchr("*[]()|$\\:", c) != NULL || ISSPACE(c))
+            break;
+        if (c == '/' && path[i - 1] == '/')
+            break;
+        if (c == '.' && path[i - 1] == '/')
+            break;
+    }
+    for (j = 0; j < sizeof(escapes) / sizeof(escapes[0]); j++) {
+        if (strstr(path + i, escapes[j]) != NULL)
+            return -1;
+    }
+    return i;
+}
+
+/*
+ * Add the file containing the nodes under the first LEN characters of
+ * PATH to LIST. The file is the shortest prefix NAME of them that Augeas
+ * has metadata for under /augeas/files/NAME. Return whether there is
+ * such a file
+ */
+static int dirty_add_file(augeas *aug, const char *path, size_t len,
+                          struct dirty_list *list) {
+    size_t i;
+    char *meta;
+    int j;
+
+    for (j = 0; j < list->len; j++) {
+        size_t n = strlen(list->names[j]);
+
+        if (len >= n + 6 && strncmp(path + 6, list->names[j], n) == 0
+            && (len == n + 6 || path[n + 6] == '/'))
+            return 1;
+    }
+
+    meta = malloc(len + strlen("/augeas") + strlen("/path") + 1);
+    if (meta == NULL) {
+        list->nomem = 1;
+        return 1;
+    }
+    for (i = 7; i <= len; i++) {
+        if ((i < len && path[i] != '/') || path[i - 1] == '\\')
+            continue;
+        memcpy(meta, "/augeas", 7);
+        memcpy(meta + 7, path, i);
+        strcpy(meta + 7 + i, "/path");
+        if (aug_get(aug, meta, NULL) == 1) {
+            if (list->len == list->size) {
+                int size = list->size == 0 ? 8 : 2 * list->size;
+                char **names = realloc(list->names, size * sizeof(*names));
+
+                if (names == NULL) {
+                    list->nomem = 1;
+                    break;
+                }
+                list->names = names;
+                list->size = size;
+            }
+            list->names[list->len] = strndup(path + 6, i - 6);
+            if (list->names[list->len] == NULL)
+                list->nomem = 1;
+            else
+                list->len += 1;
+            break;
+        }
+    }
+    free(meta);
+    return i <= len;
+}
+
+/*
+ * Add the file containing the node PATH, as returned by aug_match, to
+ * LIST. Nodes under /files that are not part of a loaded file, like the
+ * tree of a new file, make LIST unknown.
+ */
+static void dirty_add_node(augeas *aug, const char *path,
+                           struct dirty_list *list) {
+    if (strncmp(path, "/files/", 7) != 0) {
+        if (strcmp(path, "/files") == 0)
+            list->unknown = 1;
+        return;
+    }
+    if (!dirty_add_file(aug, path, strlen(path), list))
+        list->unknown = 1;
+}
+
+/*
+ * Add the files containing the nodes matching PATH to LIST, and return
+ * whether any were found. When PATH spells out the name of a file, like
+ * "/files/etc/hosts/1/alias[last()+1]" does, that file is found without
+ * matching PATH, which also finds nodes that PATH no longer matches
+ */
+static int dirty_collect(augeas *aug, const char *path,
+                         struct dirty_list *list) {
+    char **matches = NULL;
+    long len;
+    int cnt, i;
+
+    if (path == NULL)
+        return 0;
+    len = path_literal_len(path);
+    if (len > 7 && strncmp(path, "/files/", 7) == 0) {
+        /* Only whole names count: "/files/etc/ho*" names no file */
+        if (path[len] != '\0' && path[len] != '/' && path[len] != '[')
+            while (path[len] != '/')
+                len -= 1;
+        while (len > 7 && path[len - 1] == '/')
+            len -= 1;
+        if (len > 7 && dirty_add_file(aug, path, len, list))
+            return 1;
+    }
+    cnt = aug_match(aug, path, &matches);
+    for (i = 0; i < cnt; i++) {
+        dirty_add_node(aug, matches[i], list);
+        free(matches[i]);
+    }
+    free(matches);
+    return cnt > 0;
+}
+
+/*
+ * Forget the files added to LIST after it had LEN of them, for calls
+ * that turned out not to change anything
+ */
+static void dirty_truncate(struct dirty_list *list, int len) {
+    while (list->len > len)
+        free(list->names[--list->len]);
+}
+
+static int dirty_free_i(st_data_t key, st_data_t value, st_data_t arg) {
+    xfree((char *) key);
+    return ST_DELETE;
+}
+
+/* Forget about all unsaved changes, e.g. after a save or load */
+static void dirty_clear(struct augeas_handle *h) {
+    if (h->dirty != NULL) {
+        st_foreach(h->dirty, dirty_free_i, 0);
+        st_free_table(h->dirty);
+        h->dirty = NULL;
+    }
+    h->dirty_unknown = 0;
+}
+
+/* Forget about the unsaved changes to the file NAME */
+static void dirty_forget(struct augeas_handle *h, const char *name) {
+    st_data_t key = (st_data_t) name;
+
+    if (h->dirty != NULL && st_delete(h->dirty, &key, NULL))
+        xfree((char *) key);
+}
+
+/* Add the files in LIST to the dirty table of S and free LIST */
+static void dirty_merge(VALUE s, struct dirty_list *list) {
+    struct augeas_handle *h = get_handle(s);
+    int i;
+
+    for (i = 0; i < list->len; i++) {
+        if (h->dirty == NULL)
+            h->dirty = st_init_strtable();
+        if (!st_lookup(h->dirty, (st_data_t) list->names[i], NULL))
+            st_insert(h->dirty, (st_data_t) ruby_strdup(list->names[i]), 0);
+        free(list->names[i]);
+    }
+    free(list->names);
+    if (list->unknown)
+        h->dirty_unknown = 1;
+    if (list->nomem)
+        rb_memerror();
+}
+
+/* What unload and the tree budget know about one file */
+struct resident_file {
+    long          bytes;     /* estimated size of its subtree, or -1 */
+    long          nodes;
+    unsigned long used;      /* resident_clock when it was last used */
+    int           unloaded;
+    int           seen;
+};
+
+static int resident_free_i(st_data_t key, st_data_t value, st_data_t arg) {
+    xfree((char *) key);
+    xfree((struct resident_file *) value);
+    return ST_DELETE;
+}
+
+/* Forget the sorted index of the files, after the set of files changed */
+static void resident_index_forget(struct augeas_handle *h) {
+    xfree((char **) h->resident_index);
+    h->resident_index = NULL;
+    h->resident_index_len = 0;
+}
+
+/* Forget about all files, e.g. after a full load parsed them all again */
+static void resident_clear(struct augeas_handle *h) {
+    resident_index_forget(h);
+    if (h->resident != NULL) {
+        st_foreach(h->resident, resident_free_i, 0);
+        st_free_table(h->resident);
+        h->resident = NULL;
+    }
+}
+
+#ifdef HAVE_AUG_LOAD_FILE
+/* Note that the file NAME was parsed again by other means than restore */
+static void resident_reloaded(struct augeas_handle *h, const char *name) {
+    st_data_t value;
+
+    if (h->resident != NULL
+        && st_lookup(h->resident, (st_data_t) name, &value)) {
+        ((struct resident_file *) value)->unloaded = 0;
+        ((struct resident_file *) value)->bytes = -1;
+    }
 }
+#endif
 
-static void augeas_free(augeas *aug) {
-    if (aug != NULL)
-        aug_close(aug);
+static long budget_update(VALUE s, const char *file);
+
+static void augeas_free(void *p) {
+    struct augeas_handle *h = p;
+
+    if (h->aug != NULL)
+        aug_close(h->aug);
+    stamps_clear(h);
+    dirty_clear(h);
+    resident_clear(h);
+    xfree(h);
+}
+
+/*
+ * The memory used by the handle, including the estimate of the size of
+ * its tree from the last call to stats; looking at the tree here is not
+ * possible, since another thread might be using it, and walking all of
+ * it after every load would make loading slower for everybody
+ */
+static size_t augeas_memsize(const void *p) {
+    const struct augeas_handle *h = p;
+    size_t size = sizeof(*h);
+
+    if (h->stamps != NULL)
+        size += st_memsize(h->stamps)
+            + h->stamps->num_entries * sizeof(struct file_stamp);
+    if (h->dirty != NULL)
+        size += st_memsize(h->dirty);
+    if (h->resident != NULL)
+        size += st_memsize(h->resident)
+            + h->resident->num_entries * sizeof(struct resident_file)
+            + h->resident_index_len * sizeof(char *);
+    if (h->aug != NULL)
+        size += h->tree_bytes;
+    return size;
 }
 
+static const rb_data_type_t augeas_data_type = {
+    "augeas",
+    { augeas_mark, augeas_free, augeas_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
 /*
  * call-seq:
  *   get(PATH) -> String
@@ -49,16 +753,17 @@ static void augeas_free(augeas *aug) {
  * Lookup the value associated with PATH
  */
 VALUE augeas_get(VALUE s, VALUE path) {
-    augeas *aug = aug_handle(s);
     const char *cpath = StringValueCStr(path);
     const char *value = NULL;
+    augeas *aug = aug_lock(s);
 
     int r = aug_get(aug, cpath, &value);
+    aug_unlock(s);
     /* There used to be a bug in Augeas that would make it not properly set
      * VALUE to NULL when PATH was invalid. We check RETVAL, too, to avoid
      * running into that */
     if (r == 1 && value != NULL) {
-        return rb_str_new(value, strlen(value)) ;
+        return tree_str(get_handle(s), value);
     } else {
         return Qnil;
     }
@@ -71,14 +776,16 @@ VALUE augeas_get(VALUE s, VALUE path) {
  * Lookup the value associated with PATH
  */
 VALUE facade_get(VALUE s, VALUE path) {
-    augeas *aug = aug_handle(s);
     const char *cpath = StringValueCStr(path);
     const char *value = NULL;
+    augeas *aug = aug_lock(s);
 
     int retval = aug_get(aug, cpath, &value);
+    aug_unlock(s);
+    facade_check(s, Qnil);
 
     if (retval == 1 && value != NULL) {
-        return rb_str_new(value, strlen(value));
+        return tree_str(get_handle(s), value);
     } else {
         return Qnil;
     }
@@ -91,19 +798,40 @@ VALUE facade_get(VALUE s, VALUE path) {
  * Return true if there is an entry for this path, false otherwise
  */
 VALUE augeas_exists(VALUE s, VALUE path) {
-    augeas *aug = aug_handle(s);
     const char *cpath = StringValueCStr(path);
+    augeas *aug = aug_lock(s);
     int ret = aug_get(aug, cpath, NULL);
 
+    aug_unlock(s);
+
     return (ret == 1) ? Qtrue : Qfalse;
 }
 
+/*
+ * call-seq:
+ *   exists(PATH) -> boolean
+ *
+ * Return true if there is an entry for this path, false otherwise
+ */
+VALUE facade_exists(VALUE s, VALUE path) {
+    return facade_check(s, augeas_exists(s, path));
+}
+
 static int set(VALUE s, VALUE path, VALUE value) {
-    augeas *aug = aug_handle(s);
     const char *cpath = StringValueCStr(path) ;
     const char *cvalue = StringValueCStrOrNull(value) ;
+    struct dirty_list dirty = DIRTY_LIST_INIT;
+    augeas *aug = aug_lock(s);
 
-    return aug_set(aug, cpath, cvalue) ;
+    int r = aug_set(aug, cpath, cvalue) ;
+    /* The node may have been created by an expression that no longer
+       matches it, like "alias[last()+1]" */
+    if (r == 0 && !dirty_collect(aug, cpath, &dirty))
+        dirty.unknown = 1;
+    aug_unlock(s);
+    tree_changed(s);
+    dirty_merge(s, &dirty);
+    return r;
 }
 
 /*
@@ -121,7 +849,7 @@ VALUE augeas_set(VALUE s, VALUE path, VALUE value) {
 }
 
 VALUE facade_set(VALUE s, VALUE path, VALUE value) {
-    return INT2FIX(set(s, path, value));
+    return facade_check(s, INT2FIX(set(s, path, value)));
 }
 
 /*
@@ -134,15 +862,33 @@ VALUE facade_set(VALUE s, VALUE path, VALUE value) {
  *  BASE will be modified.
  */
 VALUE augeas_setm(VALUE s, VALUE base, VALUE sub, VALUE value) {
-    augeas *aug = aug_handle(s);
     const char *cbase = StringValueCStr(base) ;
     const char *csub = StringValueCStrOrNull(sub) ;
     const char *cvalue = StringValueCStrOrNull(value) ;
+    struct dirty_list dirty = DIRTY_LIST_INIT;
+    augeas *aug = aug_lock(s);
 
     int callValue = aug_setm(aug, cbase, csub, cvalue) ;
+    if (callValue > 0)
+        dirty_collect(aug, cbase, &dirty);
+    aug_unlock(s);
+    tree_changed(s);
+    dirty_merge(s, &dirty);
     return INT2FIX(callValue);
 }
 
+/*
+ * call-seq:
+ *   setm(BASE, SUB, VALUE) -> int
+ *
+ * Set multiple nodes in one operation. Find or create a node matching SUB
+ * by interpreting SUB as a path expression relative to each node matching
+ * BASE. If SUB is '.', the nodes matching BASE will be modified.
+ */
+VALUE facade_setm(VALUE s, VALUE base, VALUE sub, VALUE value) {
+    return facade_check(s, augeas_setm(s, base, sub, value));
+}
+
 /*
  * call-seq:
  *   insert(PATH, LABEL, BEFORE) -> int
@@ -151,14 +897,32 @@ VALUE augeas_setm(VALUE s, VALUE base, VALUE sub, VALUE value) {
  * The boolean BEFORE determines if LABEL is inserted before or after PATH.
  */
 VALUE augeas_insert(VALUE s, VALUE path, VALUE label, VALUE before) {
-    augeas *aug = aug_handle(s);
     const char *cpath = StringValueCStr(path) ;
     const char *clabel = StringValueCStr(label) ;
+    struct dirty_list dirty = DIRTY_LIST_INIT;
+    augeas *aug = aug_lock(s);
 
     int callValue = aug_insert(aug, cpath, clabel, RTEST(before));
+    if (callValue == 0)
+        dirty_collect(aug, cpath, &dirty);
+    aug_unlock(s);
+    tree_changed(s);
+    dirty_merge(s, &dirty);
     return INT2FIX(callValue) ;
 }
 
+/*
+ * call-seq:
+ *   insert(PATH, LABEL, BEFORE) -> int
+ *
+ * Make LABEL a sibling of PATH by inserting it directly before or after
+ * PATH. The boolean BEFORE determines if LABEL is inserted before or
+ * after PATH.
+ */
+VALUE facade_insert(VALUE s, VALUE path, VALUE label, VALUE before) {
+    return facade_check(s, augeas_insert(s, path, label, before));
+}
+
 /*
  * call-seq:
  *   mv(SRC, DST) -> int
@@ -170,14 +934,42 @@ VALUE augeas_insert(VALUE s, VALUE path, VALUE label, VALUE before) {
  * created.
  */
 VALUE augeas_mv(VALUE s, VALUE src, VALUE dst) {
-    augeas *aug = aug_handle(s);
     const char *csrc = StringValueCStr(src);
     const char *cdst = StringValueCStr(dst);
-    int r = aug_mv(aug, csrc, cdst);
+    struct dirty_list dirty = DIRTY_LIST_INIT;
+    augeas *aug = aug_lock(s);
+    int r;
+
+    dirty_collect(aug, csrc, &dirty);
+    r = aug_mv(aug, csrc, cdst);
+    if (r == 0)
+        dirty_collect(aug, cdst, &dirty);
+    aug_unlock(s);
+    tree_changed(s);
+    dirty_merge(s, &dirty);
 
     return INT2FIX(r);
 }
 
+/*
+ * call-seq:
+ *   mv(SRC, DST) -> int
+ *
+ * Move node SRC to DST. SRC must match exactly one node in the tree. DST
+ * must either match exactly one node in the tree, or may not exist
+ * yet. If DST exists already, it and all its descendants are deleted. If
+ * DST does not exist yet, it and all its missing ancestors are created.
+ *
+ * Raises Augeas::NoMatchError if the SRC node does not exist
+ * Raises Augeas::MultipleMatchesError if there were multiple matches in
+ * SRC
+ * Raises Augeas::DescendantError if the DST node is a descendant of the
+ * SRC node.
+ */
+VALUE facade_mv(VALUE s, VALUE src, VALUE dst) {
+    return facade_check(s, augeas_mv(s, src, dst));
+}
+
 /*
  * call-seq:
  *   rm(PATH) -> int
@@ -185,376 +977,4137 @@ VALUE augeas_mv(VALUE s, VALUE src, VALUE dst) {
  * Remove path and all its children. Returns the number of entries removed
  */
 VALUE augeas_rm(VALUE s, VALUE path) {
-    augeas *aug = aug_handle(s);
     const char *cpath = StringValueCStr(path) ;
+    struct dirty_list dirty = DIRTY_LIST_INIT;
+    augeas *aug = aug_lock(s);
+    int callValue;
 
-    int callValue = aug_rm(aug, cpath) ;
+    dirty_collect(aug, cpath, &dirty);
+    callValue = aug_rm(aug, cpath) ;
+    if (callValue <= 0)
+        dirty_truncate(&dirty, 0);
+    aug_unlock(s);
+    tree_changed(s);
+    dirty_merge(s, &dirty);
     return INT2FIX(callValue) ;
 }
 
 /*
  * call-seq:
- *       match(PATH) -> an_array
+ *   rm(PATH) -> int
  *
- * Return all the paths that match the path expression PATH as an aray of
- * strings.
+ * Remove all nodes matching path expression PATH and all their
+ * children. Returns the number of entries removed.
+ * Raises Augeas::InvalidPathError when PATH is invalid.
  */
-VALUE augeas_match(VALUE s, VALUE p) {
-    augeas *aug = aug_handle(s);
-    const char *path = StringValueCStr(p);
-    VALUE result;
-    char **matches = NULL;
-    int cnt, i;
+VALUE facade_rm(VALUE s, VALUE path) {
+    return facade_check(s, augeas_rm(s, path));
+}
 
-    cnt = aug_match(aug, path, &matches) ;
-    if (cnt < 0)
-        rb_raise(rb_eSystemCallError, "Matching path expression '%s' failed",
-                 path);
+struct match_args {
+    const char *path;
+    char      **matches;
+};
 
-    result = rb_ary_new();
-    for (i = 0; i < cnt; i++) {
-        rb_ary_push(result, rb_str_new(matches[i], strlen(matches[i])));
-        free(matches[i]) ;
-    }
+static int match_blocking(augeas *aug, void *data) {
+    struct match_args *args = data;
+
+    return aug_match(aug, args->path, &args->matches);
+}
+
+/*
+ * Run aug_match for the path expression P without holding the GVL. Store
+ * the matches in *MATCHES and return their number, or -1 on error.
+ */
+static int match(VALUE s, VALUE p, char ***matches) {
+    VALUE path = rb_str_new_frozen(StringValue(p));
+    struct match_args args;
+    int cnt;
+
+    args.path = StringValueCStr(path);
+    args.matches = NULL;
+    cnt = aug_blocking(s, match_blocking, &args);
+    RB_GC_GUARD(path);
+
+    *matches = args.matches;
+    return cnt;
+}
+
+/* Turn the CNT MATCHES from aug_match on H into an array and free them */
+static VALUE matches_to_ary(struct augeas_handle *h, char **matches, int cnt) {
+    VALUE result;
+    int i;
+
+    result = rb_ary_new2(cnt);
+    for (i = 0; i < cnt; i++) {
+        rb_ary_push(result, tree_str(h, matches[i]));
+        free(matches[i]) ;
+    }
     free (matches) ;
 
-    return result ;
+    return result ;
+}
+
+/*
+ * Return a copy of the result of matching P that the match cache of H
+ * holds, or Qnil if there is none or the tree changed since it was
+ * stored
+ */
+static VALUE match_cache_lookup(struct augeas_handle *h, VALUE p) {
+    VALUE cached, result;
+    long i;
+
+    if (NIL_P(h->match_cache))
+        return Qnil;
+    if (h->match_cache_gen != h->generation) {
+        rb_hash_clear(h->match_cache);
+        h->match_cache_gen = h->generation;
+    }
+    cached = rb_hash_lookup(h->match_cache, p);
+    if (NIL_P(cached)) {
+        h->match_misses += 1;
+        return Qnil;
+    }
+    h->match_hits += 1;
+
+    /* Interned strings are frozen and can be handed out as they are */
+    if (h->interned)
+        return rb_ary_dup(cached);
+    result = rb_ary_new2(RARRAY_LEN(cached));
+    for (i = 0; i < RARRAY_LEN(cached); i++)
+        rb_ary_push(result, rb_str_dup(RARRAY_AREF(cached, i)));
+    return result;
+}
+
+/*
+ * Remember RESULT as the matches for P in the match cache of H, unless
+ * the tree changed since generation GEN, when the match was started
+ */
+static void match_cache_store(struct augeas_handle *h, unsigned long gen,
+                              VALUE p, VALUE result) {
+    VALUE cached;
+    long i;
+
+    if (NIL_P(h->match_cache) || h->generation != gen
+        || h->match_cache_gen != gen)
+        return;
+
+    cached = rb_ary_new2(RARRAY_LEN(result));
+    for (i = 0; i < RARRAY_LEN(result); i++)
+        rb_ary_push(cached, rb_str_new_frozen(RARRAY_AREF(result, i)));
+    rb_hash_aset(h->match_cache, p, rb_obj_freeze(cached));
+}
+
+/*
+ * Return the paths matching P as an array, taking them from the match
+ * cache when possible, or Qnil if aug_match failed
+ */
+static VALUE match_ary(VALUE s, VALUE p) {
+    struct augeas_handle *h = get_handle(s);
+    unsigned long gen = h->generation;
+    char **matches = NULL;
+    VALUE result;
+    int cnt;
+
+    StringValue(p);
+    result = match_cache_lookup(h, p);
+    if (!NIL_P(result))
+        return result;
+
+    cnt = match(s, p, &matches);
+    if (cnt < 0)
+        return Qnil;
+
+    result = matches_to_ary(h, matches, cnt);
+    match_cache_store(h, gen, p, result);
+    return result;
+}
+
+/*
+ * call-seq:
+ *       match(PATH) -> an_array
+ *
+ * Return all the paths that match the path expression PATH as an aray of
+ * strings.
+ */
+VALUE augeas_match(VALUE s, VALUE p) {
+    VALUE result = match_ary(s, p);
+
+    if (NIL_P(result))
+        rb_raise(rb_eSystemCallError, "Matching path expression '%s' failed",
+                 StringValueCStr(p));
+
+    return result;
+}
+
+/*
+ * call-seq:
+ *       match(PATH) -> an_array
+ *
+ * Return all the paths that match the path expression PATH as an aray of
+ * strings.
+ * Returns an empty array if no paths were found.
+ */
+VALUE facade_match(VALUE s, VALUE p) {
+    VALUE result = match_ary(s, p);
+
+    return facade_check(s, NIL_P(result) ? INT2FIX(-1) : result);
+}
+
+/*
+ * The matches each_match has not yielded yet. They are held by a Ruby
+ * object, so that they are freed with it when an external enumerator
+ * stops calling +next+ and never resumes the block
+ */
+struct each_match_args {
+    VALUE  s;
+    char **matches;
+    int    cnt;
+    int    next;
+};
+
+static void each_match_mark(void *p) {
+    struct each_match_args *args = p;
+
+    rb_gc_mark(args->s);
+}
+
+static void each_match_free(void *p) {
+    struct each_match_args *args = p;
+
+    while (args->next < args->cnt)
+        free(args->matches[args->next++]);
+    free(args->matches);
+    xfree(args);
+}
+
+static size_t each_match_memsize(const void *p) {
+    const struct each_match_args *args = p;
+
+    return sizeof(*args) + args->cnt * sizeof(char *);
+}
+
+static const rb_data_type_t each_match_data_type = {
+    "augeas/each_match",
+    { each_match_mark, each_match_free, each_match_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/*
+ * Yield the paths matching P one at a time, creating the string for each
+ * only when it is yielded. Return -1 if aug_match failed.
+ */
+static int each_match(VALUE s, VALUE p) {
+    struct each_match_args *args;
+    struct augeas_handle *h = get_handle(s);
+    VALUE holder;
+    char **matches;
+    int cnt;
+
+    holder = TypedData_Make_Struct(0, struct each_match_args,
+                                   &each_match_data_type, args);
+    args->s = s;
+    cnt = match(s, p, &matches);
+    if (cnt < 0)
+        return -1;
+    args->matches = matches;
+    args->cnt = cnt;
+
+    while (args->next < args->cnt) {
+        char *m = args->matches[args->next];
+        VALUE path = tree_str(h, m);
+
+        free(m);
+        args->matches[args->next++] = NULL;
+        rb_yield(path);
+    }
+    RB_GC_GUARD(holder);
+    return 0;
+}
+
+static VALUE each_match_enum(VALUE s, VALUE p) {
+    VALUE e = rb_enumeratorize(s, ID2SYM(rb_intern("each_match")), 1, &p);
+
+    return rb_funcall(e, rb_intern("lazy"), 0);
+}
+
+/*
+ * call-seq:
+ *       each_match(PATH) { |path| block } -> nil
+ *       each_match(PATH) -> a_lazy_enumerator
+ *
+ * Yield each path that matches the path expression PATH. Unlike +match+,
+ * this does not build an array of all matching paths; each path becomes a
+ * string only when it is yielded. Without a block, return an
+ * Enumerator::Lazy over the matching paths.
+ */
+VALUE augeas_each_match(VALUE s, VALUE p) {
+    if (!rb_block_given_p())
+        return each_match_enum(s, p);
+
+    if (each_match(s, p) < 0)
+        rb_raise(rb_eSystemCallError, "Matching path expression '%s' failed",
+                 StringValueCStr(p));
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *       each_match(PATH) { |path| block } -> nil
+ *       each_match(PATH) -> a_lazy_enumerator
+ *
+ * Yield each path that matches the path expression PATH without building
+ * an array of all of them. Without a block, return an Enumerator::Lazy
+ * over the matching paths.
+ */
+VALUE facade_each_match(VALUE s, VALUE p) {
+    if (!rb_block_given_p())
+        return each_match_enum(s, p);
+
+    facade_check(s, INT2FIX(each_match(s, p)));
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *       match_cache = BOOLEAN
+ *
+ * Enable or disable the match cache. While it is enabled, +match+
+ * remembers the paths each path expression matched and returns them
+ * again without evaluating the expression, until a call changes the
+ * tree. Disabling the cache drops all entries.
+ */
+VALUE augeas_set_match_cache(VALUE s, VALUE enable) {
+    struct augeas_handle *h = get_handle(s);
+
+    if (!RTEST(enable)) {
+        h->match_cache = Qnil;
+    } else if (NIL_P(h->match_cache)) {
+        h->match_cache = rb_hash_new();
+        h->match_cache_gen = h->generation;
+    }
+    return enable;
+}
+
+/*
+ * call-seq:
+ *       match_cache? -> boolean
+ *
+ * Return whether the match cache is enabled
+ */
+VALUE augeas_match_cache_p(VALUE s) {
+    return NIL_P(get_handle(s)->match_cache) ? Qfalse : Qtrue;
+}
+
+/*
+ * call-seq:
+ *       match_cache_stats -> a_hash
+ *
+ * Return a hash with the number of +match+ calls answered from the match
+ * cache as <tt>:hits</tt>, the number of calls that had to evaluate their
+ * path expression while the cache was enabled as <tt>:misses</tt>, and
+ * the number of expressions currently cached as <tt>:entries</tt>
+ */
+VALUE augeas_match_cache_stats(VALUE s) {
+    struct augeas_handle *h = get_handle(s);
+    VALUE result = rb_hash_new();
+    long entries = 0;
+
+    if (!NIL_P(h->match_cache) && h->match_cache_gen == h->generation)
+        entries = RHASH_SIZE(h->match_cache);
+    hash_set(result, "hits", ULONG2NUM(h->match_hits));
+    hash_set(result, "misses", ULONG2NUM(h->match_misses));
+    hash_set(result, "entries", LONG2NUM(entries));
+    return result;
+}
+
+/*
+ * call-seq:
+ *       interned_strings = BOOLEAN
+ *
+ * Choose whether +get+, +get_all+, +label+, +match+, +each_match+ and
+ * +spans+ return new binary strings, the default, or frozen UTF-8
+ * strings that are deduplicated across the process. With the latter, a
+ * label or value that occurs many times in the results is only kept in
+ * memory once. Changing this clears the match cache.
+ */
+VALUE augeas_set_interned_strings(VALUE s, VALUE enable) {
+    struct augeas_handle *h = get_handle(s);
+
+    h->interned = RTEST(enable);
+    if (!NIL_P(h->match_cache))
+        rb_hash_clear(h->match_cache);
+    return enable;
+}
+
+/*
+ * call-seq:
+ *       interned_strings? -> boolean
+ *
+ * Return whether the handle returns frozen, interned strings
+ */
+VALUE augeas_interned_strings_p(VALUE s) {
+    return get_handle(s)->interned ? Qtrue : Qfalse;
+}
+
+/* Name of the variable get_all uses to evaluate its path expression once */
+#define GET_ALL_VAR "__ruby_augeas_get_all"
+
+struct get_all_args {
+    const char  *path;
+    char       **paths;
+    const char **values;
+    int          nomem;
+};
+
+static int get_all_blocking(augeas *aug, void *data) {
+    struct get_all_args *args = data;
+    int cnt, i;
+
+#ifdef HAVE_AUG_NS_PATH
+    /* Evaluate PATH only once and walk the resulting nodeset, instead of
+       looking up every matching path again with aug_get */
+    if (aug_defvar(aug, GET_ALL_VAR, args->path) < 0)
+        return -1;
+    cnt = aug_ns_count(aug, GET_ALL_VAR);
+    if (cnt > 0) {
+        args->paths = calloc(cnt, sizeof(*args->paths));
+        args->values = calloc(cnt, sizeof(*args->values));
+        if (args->paths == NULL || args->values == NULL) {
+            args->nomem = 1;
+            cnt = -1;
+        }
+    }
+    for (i = 0; i < cnt; i++) {
+        aug_ns_path(aug, GET_ALL_VAR, i, &args->paths[i]);
+        aug_ns_value(aug, GET_ALL_VAR, i, &args->values[i]);
+    }
+    aug_defvar(aug, GET_ALL_VAR, NULL);
+#else
+    cnt = aug_match(aug, args->path, &args->paths);
+    if (cnt > 0) {
+        args->values = calloc(cnt, sizeof(*args->values));
+        if (args->values == NULL) {
+            args->nomem = 1;
+            return cnt;
+        }
+    }
+    for (i = 0; i < cnt; i++)
+        aug_get(aug, args->paths[i], &args->values[i]);
+#endif
+    return cnt;
+}
+
+/*
+ * Evaluate the path expression P and collect the path and value of each
+ * matching node. Return a hash of path => value, or Qnil if P could not
+ * be evaluated.
+ */
+static VALUE get_all(VALUE s, VALUE p) {
+    VALUE path = rb_str_new_frozen(StringValue(p));
+    VALUE result = Qnil;
+    struct get_all_args args;
+    int cnt, i;
+
+    args.path = StringValueCStr(path);
+    args.paths = NULL;
+    args.values = NULL;
+    args.nomem = 0;
+    /* The variable get_all defines is gone again before the lock is
+       released, so that nobody can see it and the tree is unchanged */
+    cnt = aug_blocking(s, get_all_blocking, &args);
+    RB_GC_GUARD(path);
+
+    if (cnt >= 0 && !args.nomem) {
+        struct augeas_handle *h = get_handle(s);
+
+        result = rb_hash_new();
+        for (i = 0; i < cnt; i++) {
+            const char *value = args.values[i];
+            rb_hash_aset(result, tree_str(h, args.paths[i]),
+                         value == NULL ? Qnil : tree_str(h, value));
+        }
+    }
+
+    if (args.paths != NULL) {
+        for (i = 0; i < cnt; i++)
+            free(args.paths[i]);
+        free(args.paths);
+    }
+    free(args.values);
+
+    if (args.nomem)
+        rb_memerror();
+    return result;
+}
+
+/*
+ * call-seq:
+ *       get_all(PATH) -> a_hash
+ *
+ * Return a hash mapping each path that matches the path expression PATH
+ * to its value, or to +nil+ for nodes without a value. This is the same
+ * as calling +get+ on every path returned by +match+, but happens in a
+ * single call.
+ */
+VALUE augeas_get_all(VALUE s, VALUE p) {
+    VALUE result = get_all(s, p);
+
+    if (NIL_P(result))
+        rb_raise(rb_eSystemCallError, "Matching path expression '%s' failed",
+                 StringValueCStr(p));
+    return result;
+}
+
+/*
+ * call-seq:
+ *       get_all(PATH) -> a_hash
+ *
+ * Return a hash mapping each path that matches the path expression PATH
+ * to its value.
+ * Returns an empty hash if no paths were found.
+ */
+VALUE facade_get_all(VALUE s, VALUE p) {
+    VALUE result = get_all(s, p);
+
+    return facade_check(s, NIL_P(result) ? INT2FIX(-1) : result);
+}
+
+struct save_args {
+    int    noop;
+    /* Whether to collect the names of the files that were written */
+    int    changed;
+    char **names;
+    int    len;
+    int    nomem;
+};
+
+static int save_blocking(augeas *aug, void *data) {
+    struct save_args *args = data;
+    const char *mode = NULL;
+    char **paths = NULL;
+    int r, cnt, i;
+
+    aug_get(aug, "/augeas/save", &mode);
+    args->noop = (mode != NULL && strcmp(mode, "noop") == 0);
+    r = aug_save(aug);
+    if (r < 0 || !args->changed)
+        return r;
+
+    /* Each file that was written has its path under /files here */
+    cnt = aug_match(aug, "/augeas/events/saved", &paths);
+    if (cnt > 0) {
+        args->names = calloc(cnt, sizeof(*args->names));
+        if (args->names == NULL)
+            args->nomem = 1;
+    }
+    for (i = 0; i < cnt; i++) {
+        const char *value = NULL;
+
+        if (args->names != NULL && aug_get(aug, paths[i], &value) == 1
+            && value != NULL) {
+            if (strncmp(value, "/files/", 7) == 0)
+                value += 6;
+            args->names[args->len] = strdup(value);
+            if (args->names[args->len] == NULL)
+                args->nomem = 1;
+            else
+                args->len += 1;
+        }
+        free(paths[i]);
+    }
+    free(paths);
+    return r;
+}
+
+/*
+ * Save the tree of S, and forget about unsaved changes if that worked.
+ * If CHANGED is not NULL, store the names of the files that were written
+ * there as an array
+ */
+static int save(VALUE s, VALUE *changed) {
+    struct save_args args;
+    int r, i;
+
+    memset(&args, 0, sizeof(args));
+    args.changed = changed != NULL;
+    r = aug_offload(s, save_blocking, &args);
+    tree_changed(s);
+    if (r == 0 && !args.noop)
+        dirty_clear(get_handle(s));
+    if (changed != NULL) {
+        *changed = rb_ary_new_capa(args.len);
+        for (i = 0; i < args.len; i++) {
+            rb_ary_push(*changed, rb_str_new_cstr(args.names[i]));
+            free(args.names[i]);
+        }
+    }
+    free(args.names);
+    if (args.nomem)
+        rb_memerror();
+    return r;
+}
+
+/* Whether the keyword arguments in ARGV ask save for the changed files */
+static int save_return_changed(int argc, VALUE *argv) {
+    VALUE opts, changed = Qundef;
+    ID kw = rb_intern("return_changed");
+
+    rb_scan_args(argc, argv, "0:", &opts);
+    if (!NIL_P(opts))
+        rb_get_kwargs(opts, &kw, 0, 1, &changed);
+    return changed != Qundef && RTEST(changed);
+}
+
+/*
+ * call-seq:
+ *       save() -> boolean
+ *       save(return_changed: true) -> an_array or false
+ *
+ * Write all pending changes to disk. With <tt>return_changed: true</tt>,
+ * return the names of the files that were written, relative to the
+ * root, like "/etc/hosts", instead of +true+
+ */
+VALUE augeas_save(int argc, VALUE *argv, VALUE s) {
+    VALUE changed;
+    int r;
+
+    if (!save_return_changed(argc, argv))
+        return (save(s, NULL) == 0) ? Qtrue : Qfalse;
+    r = save(s, &changed);
+    return (r == 0) ? changed : Qfalse;
+}
+
+/*
+ * call-seq:
+ *       augeas_save() -> int
+ *       augeas_save(return_changed: true) -> an_array
+ *
+ * Write all pending changes to disk, see Augeas#save
+ */
+VALUE facade_save(int argc, VALUE *argv, VALUE s) {
+    VALUE changed;
+    int r;
+
+    if (!save_return_changed(argc, argv))
+        return facade_check(s, INT2FIX(save(s, NULL)));
+    r = save(s, &changed);
+    facade_check(s, INT2FIX(r));
+    return changed;
+}
+
+/*
+ * call-seq:
+ *       dirty? -> boolean
+ *
+ * Return whether any file has changes that have not been saved yet. This
+ * does not render any file; the bindings note which files calls change
+ * as they happen. Since the commands run by +srun+ could change any file,
+ * the tree counts as dirty after +srun+ until the next +save+ or +load+,
+ * and so it does after changes under +/files+ outside of loaded files,
+ * like creating a new file.
+ */
+VALUE augeas_dirty_p(VALUE s) {
+    struct augeas_handle *h = get_handle(s);
+
+    if (h->dirty_unknown || (h->dirty != NULL && h->dirty->num_entries > 0))
+        return Qtrue;
+    return Qfalse;
+}
+
+static int dirty_files_i(st_data_t key, st_data_t value, st_data_t arg) {
+    rb_ary_push((VALUE) arg, rb_str_new2((const char *) key));
+    return ST_CONTINUE;
+}
+
+/*
+ * call-seq:
+ *       dirty_files -> an_array
+ *
+ * Return the names of the files with unsaved changes, relative to the
+ * root, like "/etc/hosts", in sorted order. Changes made with +srun+,
+ * to files that were not loaded, like new files, and through paths that
+ * name no file and no longer match the nodes they created are not
+ * included; +dirty?+ is true after them.
+ */
+VALUE augeas_dirty_files(VALUE s) {
+    struct augeas_handle *h = get_handle(s);
+    VALUE result = rb_ary_new();
+
+    if (h->dirty != NULL)
+        st_foreach(h->dirty, dirty_files_i, (st_data_t) result);
+    return rb_ary_sort_bang(result);
+}
+
+/*
+ * call-seq:
+ *       augeas_forget_changes(FILE) -> nil
+ *
+ * Forget that the file FILE, given relative to the root like "/etc/hosts",
+ * has unsaved changes. Used by Augeas::TreeCache for the trees it
+ * restores just as they are on disk
+ */
+VALUE augeas_forget_changes(VALUE s, VALUE file) {
+    dirty_forget(get_handle(s), StringValueCStr(file));
+    return Qnil;
+}
+
+static int load_blocking(augeas *aug, void *data) {
+    return aug_load(aug);
+}
+
+/*
+ * call-seq:
+ *       load() -> boolean
+ *
+ * Load files from disk according to the transforms under +/augeas/load+
+ */
+VALUE augeas_load(VALUE s) {
+    int callValue = aug_offload(s, load_blocking, NULL);
+    VALUE returnValue ;
+
+    stamps_clear(get_handle(s));
+    dirty_clear(get_handle(s));
+    tree_changed(s);
+    resident_clear(get_handle(s));
+    budget_update(s, NULL);
+
+    if (callValue == 0)
+        returnValue = Qtrue ;
+    else
+        returnValue = Qfalse ;
+
+    return returnValue ;
+}
+
+/*
+ * call-seq:
+ *       load() -> int
+ *
+ * Load files from disk according to the transforms under +/augeas/load+
+ */
+VALUE facade_load(VALUE s) {
+    int r = aug_offload(s, load_blocking, NULL);
+    VALUE exc;
+
+    stamps_clear(get_handle(s));
+    dirty_clear(get_handle(s));
+    tree_changed(s);
+    exc = facade_exception(s, INT2FIX(r));
+    resident_clear(get_handle(s));
+    budget_update(s, NULL);
+    if (!NIL_P(exc))
+        rb_exc_raise(exc);
+    return INT2FIX(r);
+}
+
+#ifdef HAVE_AUG_LOAD_FILE
+static int load_file_blocking(augeas *aug, void *data) {
+    return aug_load_file(aug, data);
+}
+
+static int load_file(VALUE s, VALUE file) {
+    VALUE ffile = rb_str_new_frozen(StringValue(file));
+    const char *cfile = StringValueCStr(ffile);
+    int r;
+
+    r = aug_offload(s, load_file_blocking, (void *) cfile);
+    stamps_forget(get_handle(s), cfile);
+    dirty_forget(get_handle(s), cfile);
+    resident_reloaded(get_handle(s), cfile);
+    tree_changed(s);
+    RB_GC_GUARD(ffile);
+
+    return r;
+}
+
+/*
+ * call-seq:
+ *       load_file(FILE) -> boolean
+ *
+ * Load the single file FILE, given relative to the root like
+ * "/etc/hosts", using the transform under +/augeas/load+ that covers it
+ */
+VALUE augeas_load_file(VALUE s, VALUE file) {
+    int r = load_file(s, file);
+
+    budget_update(s, StringValueCStr(file));
+    return (r == 0) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *       load_file(FILE) -> nil
+ *
+ * Load the single file FILE, given relative to the root like
+ * "/etc/hosts", using the transform under +/augeas/load+ that covers it
+ */
+VALUE facade_load_file(VALUE s, VALUE file) {
+    VALUE exc = facade_exception(s, INT2FIX(load_file(s, file)));
+
+    budget_update(s, StringValueCStr(file));
+    if (!NIL_P(exc))
+        rb_exc_raise(exc);
+    return Qnil;
+}
+#endif
+
+/* A loaded file as seen by refresh */
+struct refresh_file {
+    char             *name;      /* relative to the root, e.g. /etc/hosts */
+    long long         aug_mtime; /* from /augeas/files/NAME/mtime */
+    int               exists;
+    struct file_stamp stamp;
+    enum { KEEP, RELOAD, DROP } action;
+};
+
+struct refresh_args {
+    struct refresh_file *files;
+    int                  nfiles;
+    int                  nomem;
+};
+
+/* Return the malloc'd concatenation of A and B, or NULL */
+static char *str_concat(const char *a, const char *b) {
+    size_t la = strlen(a), lb = strlen(b);
+    char *result = malloc(la + lb + 1);
+
+    if (result != NULL) {
+        memcpy(result, a, la);
+        memcpy(result + la, b, lb + 1);
+    }
+    return result;
+}
+
+/* Find all loaded files and stat them */
+static int refresh_scan_blocking(augeas *aug, void *data) {
+    static const char *const prefix = "/augeas/files";
+    struct refresh_args *args = data;
+    const char *root = NULL;
+    char **matches = NULL;
+    int cnt, i;
+
+    if (aug_get(aug, "/augeas/root", &root) != 1 || root == NULL)
+        return -1;
+    cnt = aug_match(aug, "/augeas/files//*[mtime]", &matches);
+    if (cnt <= 0)
+        return cnt;
+
+    args->files = calloc(cnt, sizeof(*args->files));
+    if (args->files == NULL)
+        args->nomem = 1;
+
+    for (i = 0; i < cnt; i++) {
+        struct refresh_file *f;
+        const char *mtime = NULL;
+        char *mtime_path, *fs_path;
+        struct stat st;
+
+        if (args->nomem || strncmp(matches[i], prefix, strlen(prefix)) != 0)
+            goto next;
+
+        f = args->files + args->nfiles;
+        mtime_path = str_concat(matches[i], "/mtime");
+        f->name = strdup(matches[i] + strlen(prefix));
+        fs_path = f->name == NULL ? NULL : str_concat(root, f->name + 1);
+        if (mtime_path == NULL || fs_path == NULL) {
+            args->nomem = 1;
+        } else {
+            args->nfiles += 1;
+            if (aug_get(aug, mtime_path, &mtime) == 1 && mtime != NULL)
+                f->aug_mtime = strtoll(mtime, NULL, 10);
+            if (stat(fs_path, &st) == 0) {
+                f->exists = 1;
+                f->stamp.mtime = st.st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+                f->stamp.mtime_nsec = st.st_mtim.tv_nsec;
+#endif
+                f->stamp.size = st.st_size;
+                f->stamp.ino = st.st_ino;
+            }
+        }
+        free(mtime_path);
+        free(fs_path);
+    next:
+        free(matches[i]);
+    }
+    free(matches);
+
+    return args->nomem ? -1 : 0;
+}
+
+/* Reload the files that changed and drop those that are gone */
+static int refresh_apply_blocking(augeas *aug, void *data) {
+    struct refresh_args *args = data;
+    int i, r = 0;
+#ifndef HAVE_AUG_LOAD_FILE
+    int reload = 0;
+#endif
+
+    for (i = 0; i < args->nfiles && r >= 0; i++) {
+        struct refresh_file *f = args->files + i;
+        char *meta = NULL, *tree = NULL;
+
+        if (f->action == KEEP)
+            continue;
+
+        meta = str_concat("/augeas/files", f->name);
+        tree = str_concat("/files", f->name);
+        if (meta == NULL || tree == NULL) {
+            r = -1;
+        } else if (f->action == DROP) {
+            if (aug_rm(aug, tree) < 0 || aug_rm(aug, meta) < 0)
+                r = -1;
+        } else {
+            char *mtime = str_concat(meta, "/mtime");
+
+            /* Without an mtime, Augeas does not consider the file current
+               and parses it again even if it changed within a second */
+            if (mtime == NULL || aug_rm(aug, mtime) < 0)
+                r = -1;
+#ifdef HAVE_AUG_LOAD_FILE
+            else if (aug_load_file(aug, f->name) < 0)
+                r = -1;
+#else
+            reload = 1;
+#endif
+            free(mtime);
+        }
+        free(meta);
+        free(tree);
+    }
+#ifndef HAVE_AUG_LOAD_FILE
+    if (r == 0 && reload)
+        r = aug_load(aug);
+#endif
+    return r;
+}
+
+static int stamp_equal(const struct file_stamp *a,
+                       const struct file_stamp *b) {
+    return a->mtime == b->mtime && a->mtime_nsec == b->mtime_nsec
+        && a->size == b->size && a->ino == b->ino;
+}
+
+/*
+ * Decide which of the files in ARGS need to be reloaded, and remember
+ * their current stamps in the table of H
+ */
+static void refresh_compare(struct augeas_handle *h,
+                            struct refresh_args *args) {
+    int i;
+
+    if (h->stamps == NULL)
+        h->stamps = st_init_strtable();
+
+    for (i = 0; i < args->nfiles; i++) {
+        struct refresh_file *f = args->files + i;
+        st_data_t old;
+
+        if (! f->exists) {
+            f->action = DROP;
+            stamps_forget(h, f->name);
+            continue;
+        }
+
+        if (st_lookup(h->stamps, (st_data_t) f->name, &old)) {
+            struct file_stamp *stamp = (struct file_stamp *) old;
+
+            f->action = stamp_equal(stamp, &f->stamp) ? KEEP : RELOAD;
+            *stamp = f->stamp;
+        } else {
+            /* The first time around, all we can go by is the mtime that
+               Augeas recorded when it loaded the file */
+            struct file_stamp *stamp = ALLOC(struct file_stamp);
+
+            f->action = (f->stamp.mtime == f->aug_mtime) ? KEEP : RELOAD;
+            *stamp = f->stamp;
+            st_insert(h->stamps, (st_data_t) ruby_strdup(f->name),
+                      (st_data_t) stamp);
+        }
+    }
+}
+
+static void refresh_args_free(struct refresh_args *args) {
+    int i;
+
+    for (i = 0; i < args->nfiles; i++)
+        free(args->files[i].name);
+    free(args->files);
+}
+
+/*
+ * Reload all files that changed on disk since they were loaded or last
+ * refreshed, and drop those that no longer exist. Return an array of the
+ * names of these files, or Qnil if that failed
+ */
+static VALUE refresh(VALUE s) {
+    struct refresh_args args;
+    VALUE result = Qnil, reloaded = Qnil;
+    int i, r;
+
+    memset(&args, 0, sizeof(args));
+    r = aug_offload(s, refresh_scan_blocking, &args);
+    if (r == 0) {
+        refresh_compare(get_handle(s), &args);
+        r = aug_offload(s, refresh_apply_blocking, &args);
+        tree_changed(s);
+    }
+    if (r == 0) {
+        result = rb_ary_new();
+        reloaded = rb_ary_new();
+        for (i = 0; i < args.nfiles; i++) {
+            if (args.files[i].action != KEEP) {
+                dirty_forget(get_handle(s), args.files[i].name);
+                rb_ary_push(result, rb_str_new2(args.files[i].name));
+            }
+            if (args.files[i].action == RELOAD) {
+#ifdef HAVE_AUG_LOAD_FILE
+                resident_reloaded(get_handle(s), args.files[i].name);
+#endif
+                rb_ary_push(reloaded, rb_str_new2(args.files[i].name));
+            }
+        }
+#ifndef HAVE_AUG_LOAD_FILE
+        /* aug_load also parsed the files with unsaved changes again */
+        if (RARRAY_LEN(result) > 0)
+            dirty_clear(get_handle(s));
+#endif
+    }
+    refresh_args_free(&args);
+
+    if (args.nomem)
+        rb_memerror();
+    /* Like load_file, keep the tree within its budget after each file */
+    if (!NIL_P(reloaded)) {
+        for (i = 0; i < RARRAY_LEN(reloaded); i++) {
+            VALUE file = RARRAY_AREF(reloaded, i);
+
+            budget_update(s, StringValueCStr(file));
+        }
+    }
+    return result;
+}
+
+/*
+ * call-seq:
+ *       refresh() -> an_array
+ *
+ * Parse the files that have been loaded again if they changed on disk
+ * since they were loaded, comparing their mtime, size and inode, and
+ * remove files from the tree that no longer exist. Unlike +load+, this
+ * only looks at files that are already loaded, and does not search for
+ * new files matching the transforms under +/augeas/load+.
+ *
+ * Returns the names of the files that were reloaded or removed, relative
+ * to the root, like "/etc/hosts", or +nil+ on failure.
+ */
+VALUE augeas_refresh(VALUE s) {
+    return refresh(s);
+}
+
+/*
+ * call-seq:
+ *       refresh() -> an_array
+ *
+ * Parse the files that have been loaded again if they changed on disk,
+ * and remove those that no longer exist; see Augeas#refresh. Returns the
+ * names of these files.
+ */
+VALUE facade_refresh(VALUE s) {
+    VALUE result = refresh(s);
+
+    return facade_check(s, NIL_P(result) ? INT2FIX(-1) : result);
+}
+
+/* What stats found out about one loaded file */
+struct stats_file {
+    char *name;
+    char *lens;
+    long  bytes;
+};
+
+struct stats_args {
+    long               nodes;
+    long               bytes;
+    struct stats_file *files;
+    int                nfiles;
+    int                nomem;
+};
+
+static int stats_blocking(augeas *aug, void *data) {
+    struct stats_args *args = data;
+    char **matches = NULL;
+    int cnt, i;
+
+    args->bytes = tree_size(aug, "//*", &args->nodes);
+    if (args->bytes < 0)
+        return -1;
+
+    cnt = aug_match(aug, "/augeas/files//*[path]", &matches);
+    if (cnt < 0)
+        return -1;
+    if (cnt > 0) {
+        args->files = calloc(cnt, sizeof(*args->files));
+        if (args->files == NULL)
+            args->nomem = 1;
+    }
+
+    for (i = 0; i < cnt; i++) {
+        const char *name = matches[i] + strlen("/augeas/files");
+        char *lens_path = NULL, *tree = NULL, *expr = NULL;
+
+        if (!args->nomem) {
+            struct stats_file *f = args->files + args->nfiles;
+            const char *lens = NULL;
+            long nodes;
+
+            lens_path = str_concat(matches[i], "/lens");
+            tree = str_concat("/files", name);
+            if (tree != NULL)
+                expr = str_concat(tree, "/descendant-or-self::*");
+            f->name = strdup(name);
+            if (lens_path != NULL && aug_get(aug, lens_path, &lens) == 1
+                && lens != NULL)
+                f->lens = strdup(lens);
+            if (lens_path == NULL || expr == NULL || f->name == NULL
+                || (lens != NULL && f->lens == NULL)) {
+                args->nomem = 1;
+            } else {
+                f->bytes = tree_size(aug, expr, &nodes);
+                if (f->bytes < 0)
+                    f->bytes = 0;
+            }
+            args->nfiles += 1;
+        }
+        free(lens_path);
+        free(tree);
+        free(expr);
+        free(matches[i]);
+    }
+    free(matches);
+    return 0;
+}
+
+/*
+ * Collect statistics about the tree of S as a hash, or return Qnil if
+ * that failed
+ */
+static VALUE stats(VALUE s) {
+    struct stats_args args;
+    VALUE result = Qnil;
+    int i, r;
+
+    memset(&args, 0, sizeof(args));
+    /* The variable tree_size defines is undefined again before the lock
+       is released, so the match cache stays valid */
+    r = aug_blocking(s, stats_blocking, &args);
+
+    if (r == 0 && !args.nomem) {
+        VALUE files = rb_hash_new();
+        VALUE modules = rb_hash_new();
+
+        get_handle(s)->tree_bytes = args.bytes;
+        for (i = 0; i < args.nfiles; i++) {
+            struct stats_file *f = args.files + i;
+
+            rb_hash_aset(files, rb_str_new2(f->name), LONG2NUM(f->bytes));
+            if (f->lens != NULL) {
+                /* Lenses are either @Module or Module.lens */
+                const char *module = f->lens + (f->lens[0] == '@');
+
+                rb_hash_aset(modules,
+                             rb_str_new(module, strcspn(module, ".")),
+                             Qtrue);
+            }
+        }
+        result = rb_hash_new();
+        hash_set(result, "nodes", LONG2NUM(args.nodes));
+        hash_set(result, "bytes", LONG2NUM(args.bytes));
+        hash_set(result, "files", INT2NUM(args.nfiles));
+        hash_set(result, "modules", LONG2NUM(RHASH_SIZE(modules)));
+        hash_set(result, "file_bytes", files);
+    }
+
+    for (i = 0; i < args.nfiles; i++) {
+        free(args.files[i].name);
+        free(args.files[i].lens);
+    }
+    free(args.files);
+
+    if (args.nomem)
+        rb_memerror();
+    return result;
+}
+
+/*
+ * call-seq:
+ *   stats() -> a_hash
+ *
+ * Return statistics about the tree: the number of nodes as
+ * <tt>:nodes</tt>, an estimate of the memory they use in bytes as
+ * <tt>:bytes</tt>, the number of loaded files as <tt>:files</tt>, the
+ * number of lens modules used to load them as <tt>:modules</tt> and, as
+ * <tt>:file_bytes</tt>, a hash mapping the name of each loaded file to
+ * the estimated size of its subtree. Returns +nil+ on failure.
+ *
+ * The estimate of the size of the whole tree is also what
+ * ObjectSpace.memsize_of reports for the handle; it is only updated by
+ * +stats+, so that loading does not have to walk the whole tree.
+ */
+VALUE augeas_stats(VALUE s) {
+    return stats(s);
+}
+
+/*
+ * call-seq:
+ *   stats() -> a_hash
+ *
+ * Return statistics about the tree, see Augeas#stats
+ */
+VALUE facade_stats(VALUE s) {
+    VALUE result = stats(s);
+
+    return facade_check(s, NIL_P(result) ? INT2FIX(-1) : result);
+}
+
+#ifdef HAVE_AUG_LOAD_FILE
+/* A list of file names, malloc'd so that it can be built and used without
+   the GVL, and the sizes of their subtrees */
+struct file_list {
+    char **names;
+    long  *bytes;
+    long  *nodes;
+    int    len;
+    int    nomem;
+};
+
+#define FILE_LIST_INIT { NULL, NULL, NULL, 0, 0 }
+
+static void file_list_free(struct file_list *list) {
+    int i;
+
+    for (i = 0; i < list->len; i++)
+        free(list->names[i]);
+    free(list->names);
+    free(list->bytes);
+    free(list->nodes);
+}
+
+static void file_list_add(struct file_list *list, const char *name) {
+    char **names;
+
+    if (list->nomem)
+        return;
+    names = realloc(list->names, (list->len + 1) * sizeof(*names));
+    if (names == NULL) {
+        list->nomem = 1;
+        return;
+    }
+    list->names = names;
+    list->names[list->len] = strdup(name);
+    if (list->names[list->len] == NULL)
+        list->nomem = 1;
+    else
+        list->len += 1;
+}
+
+/* Return the entry for the file NAME in the table of H, adding it if
+   there is none */
+static struct resident_file *resident_entry(struct augeas_handle *h,
+                                            const char *name) {
+    struct resident_file *f;
+    st_data_t value;
+
+    if (h->resident == NULL)
+        h->resident = st_init_strtable();
+    if (st_lookup(h->resident, (st_data_t) name, &value))
+        return (struct resident_file *) value;
+    f = ZALLOC(struct resident_file);
+    f->bytes = -1;
+    st_insert(h->resident, (st_data_t) ruby_strdup(name), (st_data_t) f);
+    resident_index_forget(h);
+    return f;
+}
+
+/*
+ * Whether the file NAME may have unsaved changes made through H. After
+ * changes that could not be traced to a file, like those of srun, that
+ * is every file
+ */
+static int resident_dirty(struct augeas_handle *h, const char *name) {
+    return h->dirty_unknown
+        || (h->dirty != NULL && st_lookup(h->dirty, (st_data_t) name, NULL));
+}
+
+/* List the files that are loaded */
+static int loaded_files_blocking(augeas *aug, void *data) {
+    static const char *const prefix = "/augeas/files";
+    struct file_list *list = data;
+    char **matches = NULL;
+    int cnt, i;
+
+    cnt = aug_match(aug, "/augeas/files//*[path]", &matches);
+    for (i = 0; i < cnt; i++) {
+        if (strncmp(matches[i], prefix, strlen(prefix)) == 0)
+            file_list_add(list, matches[i] + strlen(prefix));
+        free(matches[i]);
+    }
+    free(matches);
+    return (cnt < 0 || list->nomem) ? -1 : 0;
+}
+
+/*
+ * Estimate the size of the subtree of each file in the list, or set it
+ * to -1 if the file is not loaded
+ */
+static int measure_files_blocking(augeas *aug, void *data) {
+    struct file_list *list = data;
+    int i;
+
+    for (i = 0; i < list->len && !list->nomem; i++) {
+        char *tree = str_concat("/files", list->names[i]);
+        char *meta = str_concat("/augeas/files", list->names[i]);
+        char *path = meta == NULL ? NULL : str_concat(meta, "/path");
+        char *expr = tree == NULL ? NULL
+                                  : str_concat(tree, "/descendant-or-self::*");
+
+        if (expr == NULL || path == NULL) {
+            list->nomem = 1;
+        } else if (aug_get(aug, path, NULL) != 1) {
+            list->bytes[i] = list->nodes[i] = -1;
+        } else {
+            list->bytes[i] = tree_size(aug, expr, &list->nodes[i]);
+            if (list->bytes[i] < 0)
+                list->bytes[i] = list->nodes[i] = 0;
+        }
+        free(tree);
+        free(meta);
+        free(path);
+        free(expr);
+    }
+    return list->nomem ? -1 : 0;
+}
+
+/* Remove the tree and the metadata of each file in the list */
+static int drop_files_blocking(augeas *aug, void *data) {
+    struct file_list *list = data;
+    int i, r = 0;
+
+    for (i = 0; i < list->len && r == 0; i++) {
+        char *tree = str_concat("/files", list->names[i]);
+        char *meta = str_concat("/augeas/files", list->names[i]);
+
+        if (tree == NULL || meta == NULL
+            || aug_rm(aug, tree) < 0 || aug_rm(aug, meta) < 0)
+            r = -1;
+        free(tree);
+        free(meta);
+    }
+    return r;
+}
+
+/* Parse each file in the list again */
+static int reload_files_blocking(augeas *aug, void *data) {
+    struct file_list *list = data;
+    int i, r = 0;
+
+    /* A file that fails to parse gets an error under /augeas/files, just
+       like it would with load */
+    for (i = 0; i < list->len; i++) {
+        if (aug_load_file(aug, list->names[i]) < 0)
+            r = -1;
+    }
+    return r;
+}
+
+/*
+ * Drop the files in LIST from the tree of S and remember that they were
+ * unloaded. Return the result of the call into libaugeas
+ */
+static int resident_drop(VALUE s, struct file_list *list) {
+    struct augeas_handle *h = get_handle(s);
+    int i, r;
+
+    if (list->len == 0)
+        return 0;
+    r = aug_blocking(s, drop_files_blocking, list);
+    tree_changed(s);
+    for (i = 0; i < list->len; i++) {
+        struct resident_file *f = resident_entry(h, list->names[i]);
+
+        f->unloaded = 1;
+        f->bytes = -1;
+        stamps_forget(h, list->names[i]);
+    }
+    return r;
+}
+
+static int resident_unsee_i(st_data_t key, st_data_t value, st_data_t arg) {
+    ((struct resident_file *) value)->seen = 0;
+    return ST_CONTINUE;
+}
+
+/* Remove the entries of files that are neither loaded nor unloaded */
+static int resident_sync_i(st_data_t key, st_data_t value, st_data_t arg) {
+    struct resident_file *f = (struct resident_file *) value;
+
+    if (f->seen || f->unloaded)
+        return ST_CONTINUE;
+    return resident_free_i(key, value, arg);
+}
+
+struct budget_file {
+    const char           *name;
+    struct resident_file *file;
+};
+
+struct budget_collect {
+    struct budget_file *files;
+    long                len;
+    long                bytes;
+    long                nodes;
+};
+
+static int budget_collect_i(st_data_t key, st_data_t value, st_data_t arg) {
+    struct budget_collect *c = (struct budget_collect *) arg;
+    struct resident_file *f = (struct resident_file *) value;
+
+    /* Files loaded behind our back, e.g. by srun, have no size */
+    if (!f->unloaded && f->bytes >= 0) {
+        c->bytes += f->bytes;
+        c->nodes += f->nodes;
+        c->files[c->len].name = (const char *) key;
+        c->files[c->len].file = f;
+        c->len += 1;
+    }
+    return ST_CONTINUE;
+}
+
+/* Order files from the least to the most recently used */
+static int budget_file_cmp(const void *a, const void *b) {
+    const struct budget_file *fa = a, *fb = b;
+
+    if (fa->file->used != fb->file->used)
+        return fa->file->used < fb->file->used ? -1 : 1;
+    return strcmp(fa->name, fb->name);
+}
+
+static int budget_exceeded(struct augeas_handle *h, long bytes, long nodes) {
+    return (h->budget_bytes > 0 && bytes > h->budget_bytes)
+        || (h->budget_nodes > 0 && nodes > h->budget_nodes);
+}
+
+/*
+ * Measure the files in LIST, which were just parsed, and record their
+ * sizes in the table of S. Files that turned out not to be loaded are
+ * dropped from it. Return 0 on success
+ */
+static int budget_measure(VALUE s, struct file_list *list) {
+    struct augeas_handle *h = get_handle(s);
+    int i, r = -1;
+
+    if (list->len == 0)
+        return 0;
+    list->bytes = calloc(list->len, sizeof(long));
+    list->nodes = calloc(list->len, sizeof(long));
+    if (list->bytes == NULL || list->nodes == NULL) {
+        list->nomem = 1;
+        return -1;
+    }
+    r = aug_blocking(s, measure_files_blocking, list);
+    if (r < 0)
+        return r;
+    for (i = 0; i < list->len; i++) {
+        st_data_t key = (st_data_t) list->names[i], value;
+
+        if (list->bytes[i] >= 0) {
+            struct resident_file *f = resident_entry(h, list->names[i]);
+
+            f->unloaded = 0;
+            f->bytes = list->bytes[i];
+            f->nodes = list->nodes[i];
+        } else if (h->resident != NULL
+                   && st_delete(h->resident, &key, &value)) {
+            resident_free_i(key, value, 0);
+            resident_index_forget(h);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Bring the table of S up to date with all the files that are loaded,
+ * e.g. after a full load, and measure those whose size is not known.
+ * Return 0 on success
+ */
+static int budget_sync(VALUE s) {
+    struct augeas_handle *h = get_handle(s);
+    struct file_list loaded = FILE_LIST_INIT, measure = FILE_LIST_INIT;
+    long before;
+    int i, r, nomem;
+
+    r = aug_blocking(s, loaded_files_blocking, &loaded);
+    if (r == 0) {
+        if (h->resident != NULL)
+            st_foreach(h->resident, resident_unsee_i, 0);
+        for (i = 0; i < loaded.len; i++) {
+            struct resident_file *f = resident_entry(h, loaded.names[i]);
+
+            /* Loaded again by other means, like srun */
+            if (f->unloaded) {
+                f->unloaded = 0;
+                f->bytes = -1;
+            }
+            f->seen = 1;
+            if (f->bytes < 0)
+                file_list_add(&measure, loaded.names[i]);
+        }
+        if (h->resident != NULL) {
+            before = h->resident->num_entries;
+            st_foreach(h->resident, resident_sync_i, 0);
+            if (h->resident->num_entries != before)
+                resident_index_forget(h);
+        }
+    }
+    if (r == 0 && !measure.nomem)
+        r = budget_measure(s, &measure);
+
+    nomem = loaded.nomem || measure.nomem;
+    file_list_free(&loaded);
+    file_list_free(&measure);
+    if (nomem)
+        rb_memerror();
+    return r;
+}
+
+/*
+ * If S has a tree budget, unload the least recently used files until the
+ * loaded files fit into it. Files with unsaved changes and the files the
+ * latest call used are kept. Return the number of files unloaded, or -1
+ * on failure
+ */
+static long budget_enforce(VALUE s) {
+    struct augeas_handle *h = get_handle(s);
+    struct file_list victims = FILE_LIST_INIT;
+    struct budget_collect c;
+    VALUE tmp;
+    long i, n;
+    int r;
+
+    if (h->resident == NULL)
+        return 0;
+
+    c.files = ALLOCV_N(struct budget_file, tmp, h->resident->num_entries);
+    c.len = c.bytes = c.nodes = 0;
+    st_foreach(h->resident, budget_collect_i, (st_data_t) &c);
+    qsort(c.files, c.len, sizeof(*c.files), budget_file_cmp);
+    for (i = 0; i < c.len && budget_exceeded(h, c.bytes, c.nodes); i++) {
+        struct resident_file *f = c.files[i].file;
+
+        if ((f->used != 0 && f->used == h->resident_clock)
+            || resident_dirty(h, c.files[i].name))
+            continue;
+        c.bytes -= f->bytes;
+        c.nodes -= f->nodes;
+        file_list_add(&victims, c.files[i].name);
+    }
+    ALLOCV_END(tmp);
+
+    r = victims.nomem ? -1 : resident_drop(s, &victims);
+    n = victims.len;
+    file_list_free(&victims);
+    return r < 0 ? -1 : n;
+}
+
+/*
+ * After the file FILE, or all files if FILE is NULL, was loaded, measure
+ * what was loaded and keep the tree of S within its budget, if it has
+ * one. Return the number of files unloaded, or -1 on failure
+ */
+static long budget_update(VALUE s, const char *file) {
+    struct augeas_handle *h = get_handle(s);
+    struct file_list list = FILE_LIST_INIT;
+    int r, nomem;
+
+    if (h->budget_bytes <= 0 && h->budget_nodes <= 0)
+        return 0;
+    if (file == NULL) {
+        r = budget_sync(s);
+    } else {
+        file_list_add(&list, file);
+        r = list.nomem ? -1 : budget_measure(s, &list);
+        nomem = list.nomem;
+        file_list_free(&list);
+        if (nomem)
+            rb_memerror();
+    }
+    return r < 0 ? -1 : budget_enforce(s);
+}
+
+/*
+ * Whether the nodes named by the first LEN characters of a path
+ * expression, see path_literal_len, may lie in or above the tree of the
+ * file NAME. COMPLETE is false if the expression continues in the
+ * middle of a name, e.g. with a wildcard
+ */
+static int path_reaches(const char *path, long len, int complete,
+                        const char *name) {
+    static const char files[] = "/files";
+    long flen = sizeof(files) - 1, tlen = flen + strlen(name), i;
+
+    if (len < 0)
+        return 1;
+    for (i = 0; i < len && i < tlen; i++) {
+        char t = (i < flen) ? files[i] : name[i - flen];
+
+        if (path[i] != t)
+            return 0;
+    }
+    if (len > tlen)
+        return path[tlen] == '/';
+    if (len == tlen || !complete || path[len - 1] == '/')
+        return 1;
+    return ((len < flen) ? files[len] : name[len - flen]) == '/';
+}
+
+static int resident_index_i(st_data_t key, st_data_t value, st_data_t arg) {
+    struct augeas_handle *h = (struct augeas_handle *) arg;
+
+    h->resident_index[h->resident_index_len++] = (const char *) key;
+    return ST_CONTINUE;
+}
+
+static int resident_name_cmp(const void *a, const void *b) {
+    return strcmp(*(const char *const *) a, *(const char *const *) b);
+}
+
+/* Build the sorted index of the files of H unless it is up to date */
+static void resident_index_build(struct augeas_handle *h) {
+    if (h->resident_index != NULL || h->resident == NULL)
+        return;
+    h->resident_index = ALLOC_N(const char *, h->resident->num_entries + 1);
+    h->resident_index_len = 0;
+    st_foreach(h->resident, resident_index_i, (st_data_t) h);
+    qsort((void *) h->resident_index, h->resident_index_len,
+          sizeof(char *), resident_name_cmp);
+}
+
+/*
+ * What restore does with each file a path may lead into: mark it as used
+ * at CLOCK, unless CLOCK is 0, and add it to LIST if it is unloaded
+ */
+struct restore_collect {
+    const char       *path;
+    long              len;
+    int               complete;
+    unsigned long     clock;
+    struct file_list *list;
+};
+
+static void restore_file(struct restore_collect *c, const char *name,
+                         struct resident_file *f) {
+    if (f->unloaded)
+        file_list_add(c->list, name);
+    if (c->clock != 0)
+        f->used = c->clock;
+}
+
+static int restore_unloaded_i(st_data_t key, st_data_t value,
+                              st_data_t arg) {
+    restore_file((struct restore_collect *) arg, (const char *) key,
+                 (struct resident_file *) value);
+    return ST_CONTINUE;
+}
+
+/*
+ * Pass the files of H that the literal path in C may lead into to
+ * restore_file. Those that contain the nodes it names are looked up by
+ * each of its prefixes, and those whose names start with it are found
+ * with a binary search in the sorted index
+ */
+static void restore_collect(struct augeas_handle *h,
+                            struct restore_collect *c) {
+    const char *name = "";
+    long nlen = 0, lo, hi, i;
+    st_data_t value;
+    char *prefix;
+    VALUE tmp;
+
+    if (c->len >= 6) {
+        if (strncmp(c->path, "/files", 6) != 0)
+            return;
+        name = c->path + 6;
+        nlen = c->len - 6;
+    }
+
+    /* The files above the nodes, like /etc/hosts for /files/etc/hosts/1 */
+    prefix = ALLOCV_N(char, tmp, nlen + 1);
+    memcpy(prefix, name, nlen);
+    for (i = 1; i < nlen; i++) {
+        if (name[i] != '/')
+            continue;
+        prefix[i] = '\0';
+        if (st_lookup(h->resident, (st_data_t) prefix, &value)
+            && path_reaches(c->path, c->len, c->complete, prefix))
+            restore_file(c, prefix, (struct resident_file *) value);
+        prefix[i] = '/';
+    }
+    ALLOCV_END(tmp);
+
+    /* The files whose names start with the path */
+    resident_index_build(h);
+    lo = 0;
+    hi = h->resident_index_len;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+
+        if (strncmp(h->resident_index[mid], name, nlen) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (i = lo; i < h->resident_index_len; i++) {
+        const char *key = h->resident_index[i];
+
+        if (strncmp(key, name, nlen) != 0)
+            break;
+        if (path_reaches(c->path, c->len, c->complete, key)
+            && st_lookup(h->resident, (st_data_t) key, &value))
+            restore_file(c, key, (struct resident_file *) value);
+    }
+}
+
+/*
+ * Unload the loaded files whose names match GLOB, except those with
+ * unsaved changes. Return an array of their names, or Qnil on failure
+ */
+static VALUE unload(VALUE s, VALUE glob) {
+    struct augeas_handle *h = get_handle(s);
+    struct file_list loaded = FILE_LIST_INIT, victims = FILE_LIST_INIT;
+    VALUE fglob = rb_str_new_frozen(StringValue(glob));
+    const char *cglob = StringValueCStr(fglob);
+    VALUE result = Qnil;
+    int i, r, nomem;
+
+    r = aug_blocking(s, loaded_files_blocking, &loaded);
+    if (r == 0) {
+        for (i = 0; i < loaded.len; i++) {
+            if (fnmatch(cglob, loaded.names[i], FNM_PATHNAME) == 0
+                && !resident_dirty(h, loaded.names[i]))
+                file_list_add(&victims, loaded.names[i]);
+        }
+        r = victims.nomem ? -1 : resident_drop(s, &victims);
+    }
+    if (r == 0) {
+        result = rb_ary_new_capa(victims.len);
+        for (i = 0; i < victims.len; i++)
+            rb_ary_push(result, rb_str_new2(victims.names[i]));
+    }
+    RB_GC_GUARD(fglob);
+
+    nomem = loaded.nomem || victims.nomem;
+    file_list_free(&loaded);
+    file_list_free(&victims);
+    if (nomem)
+        rb_memerror();
+    return result;
+}
+
+/*
+ * call-seq:
+ *   unload(GLOB) -> an_array
+ *
+ * Drop the trees of the loaded files whose names, relative to the root
+ * like "/etc/hosts", match the glob pattern GLOB from the tree, together
+ * with their metadata under /augeas/files. Files with unsaved changes
+ * are kept, and so are all files after changes that can not be traced to
+ * a file, like those of +srun+, until the next +save+ or +load+; see
+ * +dirty?+. The rest of the tree is left alone.
+ *
+ * An unloaded file is parsed again as soon as a path that may lead into
+ * it is used, see +restore+, or by the next +load+.
+ *
+ * Returns the names of the files that were unloaded, or +nil+ on failure.
+ */
+VALUE augeas_unload(VALUE s, VALUE glob) {
+    return unload(s, glob);
+}
+
+/*
+ * call-seq:
+ *   unload(GLOB) -> an_array
+ *
+ * Drop the trees of the loaded files whose names match GLOB, see
+ * Augeas#unload. Returns the names of the files that were unloaded.
+ */
+VALUE facade_unload(VALUE s, VALUE glob) {
+    VALUE result = unload(s, glob);
+
+    return facade_check(s, NIL_P(result) ? INT2FIX(-1) : result);
+}
+
+/*
+ * call-seq:
+ *   restore(PATH = nil) -> an_array
+ *
+ * Parse the files that +unload+ dropped again if the path expression
+ * PATH may lead into them, and mark the loaded files it leads into as
+ * used for the tree budget. Without PATH, or if PATH may lead anywhere,
+ * e.g. because it is relative or uses a variable, all unloaded files are
+ * parsed again, but that does not count as a use of them; the budget is
+ * then enforced again by the next call with a path that names its files.
+ * Handles call this themselves before using a path once they have
+ * unloaded files or a tree budget.
+ *
+ * Returns the names of the files that were parsed again.
+ */
+VALUE augeas_restore(int argc, VALUE *argv, VALUE s) {
+    struct augeas_handle *h = get_handle(s);
+    struct file_list list = FILE_LIST_INIT;
+    struct restore_collect c;
+    VALUE path, result = rb_ary_new();
+    int i, nomem;
+
+    rb_scan_args(argc, argv, "01", &path);
+    if (h->resident == NULL)
+        return result;
+
+    c.path = NIL_P(path) ? "" : StringValueCStr(path);
+    c.len = path_literal_len(c.path);
+    c.complete = c.len < 0 || c.path[c.len] == '\0'
+        || strchr("[/|", c.path[c.len]) != NULL || ISSPACE(c.path[c.len]);
+    c.list = &list;
+    if (c.len < 0) {
+        /* Marking every file as used would keep the budget from ever
+           unloading one */
+        c.clock = 0;
+        st_foreach(h->resident, restore_unloaded_i, (st_data_t) &c);
+    } else {
+        c.clock = ++h->resident_clock;
+        restore_collect(h, &c);
+    }
+    RB_GC_GUARD(path);
+    if (list.nomem || list.len == 0) {
+        nomem = list.nomem;
+        file_list_free(&list);
+        if (nomem)
+            rb_memerror();
+        return result;
+    }
+
+    aug_offload(s, reload_files_blocking, &list);
+    tree_changed(s);
+    for (i = 0; i < list.len; i++) {
+        struct resident_file *f = resident_entry(h, list.names[i]);
+
+        f->unloaded = 0;
+        f->bytes = -1;
+        rb_ary_push(result, rb_str_new2(list.names[i]));
+    }
+    if (h->budget_bytes > 0 || h->budget_nodes > 0) {
+        /* Only the files just parsed need measuring, and all of them are
+           needed by the call if PATH may lead anywhere */
+        if (budget_measure(s, &list) == 0 && c.len >= 0)
+            budget_enforce(s);
+    }
+    nomem = list.nomem;
+    file_list_free(&list);
+    if (nomem)
+        rb_memerror();
+    /* Files that fail to parse report that under /augeas/files; it is not
+       an error of the call that needed them */
+    h->err_code = AUG_NOERROR;
+    return result;
+}
+
+static int unloaded_files_i(st_data_t key, st_data_t value, st_data_t arg) {
+    if (((struct resident_file *) value)->unloaded)
+        rb_ary_push((VALUE) arg, rb_str_new2((const char *) key));
+    return ST_CONTINUE;
+}
+
+/*
+ * call-seq:
+ *   unloaded_files() -> an_array
+ *
+ * Return the sorted names of the files that +unload+ or the tree budget
+ * dropped and that have not been parsed again since
+ */
+VALUE augeas_unloaded_files(VALUE s) {
+    struct augeas_handle *h = get_handle(s);
+    VALUE result = rb_ary_new();
+
+    if (h->resident != NULL)
+        st_foreach(h->resident, unloaded_files_i, (st_data_t) result);
+    return rb_ary_sort_bang(result);
+}
+
+/*
+ * call-seq:
+ *   augeas_tree_budget = HASH
+ *
+ * Set the tree budget to the <tt>:bytes</tt> and <tt>:nodes</tt> in
+ * HASH, or turn it off if HASH is +nil+, and unload files until the tree
+ * fits into it. Wrapped by +tree_budget=+ in augeas.rb and
+ * augeas/facade.rb
+ */
+VALUE augeas_set_tree_budget(VALUE s, VALUE budget) {
+    struct augeas_handle *h = get_handle(s);
+    ID ids[2];
+    VALUE values[2] = { Qundef, Qundef };
+    long limits[2] = { 0, 0 };
+    int i;
+
+    if (!NIL_P(budget)) {
+        ids[0] = rb_intern("bytes");
+        ids[1] = rb_intern("nodes");
+        rb_get_kwargs(rb_convert_type(budget, T_HASH, "Hash", "to_hash"),
+                      ids, 0, 2, values);
+        for (i = 0; i < 2; i++) {
+            if (values[i] != Qundef && !NIL_P(values[i]))
+                limits[i] = NUM2LONG(values[i]);
+            if (limits[i] < 0)
+                rb_raise(rb_eArgError, "the tree budget must not be negative");
+        }
+        if (limits[0] == 0 && limits[1] == 0)
+            rb_raise(rb_eArgError, "the tree budget needs :bytes or :nodes");
+    }
+    h->budget_bytes = limits[0];
+    h->budget_nodes = limits[1];
+    if (budget_update(s, NULL) < 0 && h->check_errors)
+        facade_check(s, INT2FIX(-1));
+    return budget;
+}
+
+/*
+ * call-seq:
+ *   tree_budget -> a_hash
+ *
+ * Return the tree budget as a hash with <tt>:bytes</tt> and
+ * <tt>:nodes</tt>, or +nil+ if there is none
+ */
+VALUE augeas_tree_budget(VALUE s) {
+    struct augeas_handle *h = get_handle(s);
+    VALUE result;
+
+    if (h->budget_bytes <= 0 && h->budget_nodes <= 0)
+        return Qnil;
+    result = rb_hash_new();
+    if (h->budget_bytes > 0)
+        hash_set(result, "bytes", LONG2NUM(h->budget_bytes));
+    if (h->budget_nodes > 0)
+        hash_set(result, "nodes", LONG2NUM(h->budget_nodes));
+    return result;
+}
+#else
+/* Without aug_load_file, files can not be parsed again one by one, and
+   there is never a tree budget */
+static long budget_update(VALUE s, const char *file) {
+    return 0;
+}
+#endif
+
+/*
+ * call-seq:
+ *   defvar(NAME, EXPR) -> boolean
+ *
+ * Define a variable NAME whose value is the result of evaluating EXPR. If
+ * a variable NAME already exists, its name will be replaced with the
+ * result of evaluating EXPR.
+ *
+ * If EXPR is NULL, the variable NAME will be removed if it is defined.
+ *
+ */
+VALUE augeas_defvar(VALUE s, VALUE name, VALUE expr) {
+    const char *cname = StringValueCStr(name);
+    const char *cexpr = StringValueCStrOrNull(expr);
+    augeas *aug = aug_lock(s);
+
+    int r = aug_defvar(aug, cname, cexpr);
+    aug_unlock(s);
+    tree_changed(s);
+
+    return (r < 0) ? Qfalse : Qtrue;
+}
+
+/*
+ * call-seq:
+ *   defvar(NAME, EXPR) -> boolean
+ *
+ * Evaluate EXPR and set the variable NAME to the resulting nodeset. The
+ * variable can be used in path expressions as $NAME. Note that EXPR is
+ * evaluated when the variable is defined, not when it is used.
+ */
+VALUE facade_defvar(VALUE s, VALUE name, VALUE expr) {
+    return facade_check(s, augeas_defvar(s, name, expr));
+}
+
+/*
+ * call-seq:
+ *   defnode(NAME, EXPR, VALUE) -> boolean
+ *
+ * Define a variable NAME whose value is the result of evaluating EXPR,
+ * which must be non-NULL and evaluate to a nodeset. If a variable NAME
+ * already exists, its name will be replaced with the result of evaluating
+ * EXPR.
+ *
+ * If EXPR evaluates to an empty nodeset, a node is created, equivalent to
+ * calling AUG_SET(AUG, EXPR, VALUE) and NAME will be the nodeset containing
+ * that single node.
+ *
+ * Returns +false+ if +aug_defnode+ fails, and the number of nodes in the
+ * nodeset on success.
+ */
+VALUE augeas_defnode(VALUE s, VALUE name, VALUE expr, VALUE value) {
+    const char *cname = StringValueCStr(name);
+    const char *cexpr = StringValueCStrOrNull(expr);
+    const char *cvalue = StringValueCStrOrNull(value);
+    struct dirty_list dirty = DIRTY_LIST_INIT;
+    augeas *aug = aug_lock(s);
+    int created = 0;
+
+    /* FIXME: Figure out a way to return created, maybe accept a block
+       that gets run when created == 1 ? */
+    int r = aug_defnode(aug, cname, cexpr, cvalue, &created);
+    if (r >= 0 && created)
+        dirty_collect(aug, cexpr, &dirty);
+    aug_unlock(s);
+    tree_changed(s);
+    dirty_merge(s, &dirty);
+
+    return (r < 0) ? Qfalse : INT2NUM(r);
+}
+
+/*
+ * call-seq:
+ *   defnode(NAME, EXPR, VALUE = nil) -> int
+ *
+ * Define the variable NAME to the result of evaluating EXPR, which must
+ * be a nodeset. If no node matching EXPR exists yet, one is created and
+ * NAME will refer to it. When a node is created and VALUE is given, the
+ * new node's value is set to VALUE.
+ */
+VALUE facade_defnode(int argc, VALUE *argv, VALUE s) {
+    VALUE name, expr, value;
+
+    rb_scan_args(argc, argv, "21", &name, &expr, &value);
+    return facade_check(s, augeas_defnode(s, name, expr, value));
+}
+
+struct init_args {
+    const char  *root;
+    const char  *loadpath;
+    unsigned int flags;
+};
+
+static void *init_blocking(void *data) {
+    struct init_args *args = data;
+
+    return aug_init(args->root, args->loadpath, args->flags);
+}
+
+/* Create an object of CLASS for a handle that aug_init has yet to open */
+static VALUE handle_new(VALUE class) {
+    struct augeas_handle *h;
+    VALUE result;
+
+    result = TypedData_Make_Struct(class, struct augeas_handle,
+                                   &augeas_data_type, h);
+    h->lock = rb_mutex_new();
+    h->match_cache = Qnil;
+    h->check_errors = (class == c_facade);
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+    h->ractor = current_ractor();
+#endif
+    return result;
+}
+
+/*
+ * Return the exception for the failure of aug_init to open the handle S,
+ * closing it, or Qnil if it succeeded
+ */
+static VALUE handle_init_error(VALUE s) {
+    struct augeas_handle *h = get_handle(s);
+
+    if (h->aug == NULL) {
+        return rb_exc_new2(rb_eSystemCallError, "Failed to initialize Augeas");
+    }
+    if (h->check_errors && aug_error(h->aug) != AUG_NOERROR) {
+        VALUE exc = error_exception(aug_error(h->aug),
+                                    aug_error_message(h->aug),
+                                    aug_error_details(h->aug));
+        aug_close(h->aug);
+        h->aug = NULL;
+        return exc;
+    }
+    return Qnil;
+}
+
+static VALUE init(VALUE class, VALUE m, VALUE r, VALUE l, VALUE f) {
+    struct init_args args;
+    struct augeas_handle *h;
+    VALUE result, exc;
+
+    /* aug_init compiles all lens modules and, unless NO_LOAD is passed,
+       loads the tree; it does not need the GVL for any of that */
+    if (!NIL_P(r))
+        r = rb_str_new_frozen(StringValue(r));
+    if (!NIL_P(l))
+        l = rb_str_new_frozen(StringValue(l));
+    args.flags = NUM2UINT(f);
+    args.root = StringValueCStrOrNull(r);
+    args.loadpath = StringValueCStrOrNull(l);
+
+    result = handle_new(class);
+    h = get_handle(result);
+    h->aug = call_without_gvl(init_blocking, &args, 1);
+    RB_GC_GUARD(r);
+    RB_GC_GUARD(l);
+
+    exc = handle_init_error(result);
+    if (!NIL_P(exc))
+        rb_exc_raise(exc);
+    return result;
+}
+
+/* The handles open_many opens, shared by its worker threads */
+struct open_many_args {
+    const char **roots;
+    augeas     **augs;
+    long         len;
+    long         next;
+    const char  *loadpath;
+    unsigned int flags;
+    int          concurrency;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+#endif
+};
+
+static void *open_many_worker(void *data) {
+    struct open_many_args *args = data;
+    long i;
+
+    for (;;) {
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_lock(&args->lock);
+        i = args->next++;
+        pthread_mutex_unlock(&args->lock);
+#else
+        i = args->next++;
+#endif
+        if (i >= args->len)
+            break;
+        args->augs[i] = aug_init(args->roots[i], args->loadpath, args->flags);
+    }
+    return NULL;
+}
+
+/*
+ * Open all handles with up to CONCURRENCY threads, including the calling
+ * one; without pthreads, they are opened one after the other
+ */
+static void *open_many_blocking(void *data) {
+    struct open_many_args *args = data;
+#ifdef HAVE_PTHREAD_H
+    pthread_t *threads;
+    int nthreads = 0, i;
+
+    pthread_mutex_init(&args->lock, NULL);
+    threads = malloc(args->concurrency * sizeof(*threads));
+    for (i = 1; threads != NULL && i < args->concurrency && i < args->len; i++) {
+        if (pthread_create(threads + nthreads, NULL, open_many_worker, args) != 0)
+            break;
+        nthreads += 1;
+    }
+    open_many_worker(args);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&args->lock);
+#else
+    open_many_worker(args);
+#endif
+    return NULL;
+}
+
+/*
+ * call-seq:
+ *   open_many(ROOTS, LOADPATH, FLAGS, CONCURRENCY) -> an_array
+ *
+ * Open a handle for each of ROOTS with aug_init, using up to CONCURRENCY
+ * native threads that run without the GVL. Return an array with the
+ * handle for each root, or the exception for a root that could not be
+ * opened.
+ */
+VALUE facade_open_many(VALUE class, VALUE roots, VALUE l, VALUE f, VALUE c) {
+    struct open_many_args args;
+    VALUE handles, keep, tmp_roots, tmp_augs;
+    long i;
+
+    roots = rb_convert_type(roots, T_ARRAY, "Array", "to_ary");
+    memset(&args, 0, sizeof(args));
+    args.len = RARRAY_LEN(roots);
+    args.flags = NUM2UINT(f);
+    args.concurrency = NUM2INT(c);
+    if (args.concurrency < 1)
+        rb_raise(rb_eArgError, "concurrency must be at least 1");
+    if (!NIL_P(l))
+        l = rb_str_new_frozen(StringValue(l));
+    args.loadpath = StringValueCStrOrNull(l);
+
+    args.roots = ALLOCV_N(const char *, tmp_roots, args.len);
+    args.augs = ALLOCV_N(augeas *, tmp_augs, args.len);
+    keep = rb_ary_new();
+    handles = rb_ary_new2(args.len);
+    for (i = 0; i < args.len; i++) {
+        VALUE r = RARRAY_AREF(roots, i);
+
+        if (!NIL_P(r)) {
+            r = rb_str_new_frozen(StringValue(r));
+            rb_ary_push(keep, r);
+        }
+        args.roots[i] = StringValueCStrOrNull(r);
+        args.augs[i] = NULL;
+        rb_ary_push(handles, handle_new(class));
+    }
+
+    call_without_gvl(open_many_blocking, &args, 1);
+
+    for (i = 0; i < args.len; i++) {
+        VALUE handle = RARRAY_AREF(handles, i);
+        struct augeas_handle *h = get_handle(handle);
+        VALUE exc;
+
+        h->aug = args.augs[i];
+        exc = handle_init_error(handle);
+        if (!NIL_P(exc))
+            rb_ary_store(handles, i, exc);
+    }
+    ALLOCV_END(tmp_roots);
+    ALLOCV_END(tmp_augs);
+    RB_GC_GUARD(keep);
+    RB_GC_GUARD(l);
+    return handles;
+}
+
+VALUE augeas_init(VALUE m, VALUE r, VALUE l, VALUE f) {
+    return init(c_augeas, m, r, l, f);
+}
+
+VALUE facade_init(VALUE m, VALUE r, VALUE l, VALUE f) {
+    return init(c_facade, m, r, l, f);
+}
+
+VALUE augeas_close (VALUE s) {
+    augeas *aug = aug_lock(s);
+
+    aug_close(aug);
+    get_handle(s)->aug = NULL;
+    aug_unlock(s);
+    tree_changed(s);
+    dirty_clear(get_handle(s));
+    resident_clear(get_handle(s));
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   error -> HASH
+ *
+ * Retrieve details about the last error encountered and return those
+ * details in a HASH with the following entries:
+ * - :code    error code from +aug_error+
+ * - :message error message from +aug_error_message+
+ * - :minor   minor error message from +aug_minor_error_message+
+ * - :details error details from +aug_error_details+
+ */
+VALUE augeas_error(VALUE s) {
+    augeas *aug = aug_lock(s);
+    int code;
+    const char *msg, *minor, *details;
+    VALUE result;
+
+    code = aug_error(aug);
+    msg = aug_error_message(aug);
+    minor = aug_error_minor_message(aug);
+    details = aug_error_details(aug);
+    aug_unlock(s);
+
+    result = rb_hash_new();
+
+    hash_set(result, "code", INT2NUM(code));
+
+    if (msg != NULL)
+        hash_set(result, "message", rb_str_new2(msg));
+
+    if (minor != NULL)
+        hash_set(result, "minor", rb_str_new2(minor));
+
+    if (details != NULL)
+        hash_set(result, "details", rb_str_new2(details));
+
+    return result;
+}
+
+static void hash_set_range(VALUE hash, const char *sym,
+                           unsigned int start, unsigned int end) {
+    VALUE r;
+
+    r = rb_range_new(INT2NUM(start), INT2NUM(end), 0);
+    hash_set(hash, sym, r);
+}
+
+VALUE augeas_span(VALUE s, VALUE path) {
+    char *cpath = StringValueCStr(path);
+    char *filename = NULL;
+    unsigned int label_start, label_end, value_start, value_end,
+        span_start, span_end;
+    int r;
+    VALUE result;
+    augeas *aug = aug_lock(s);
+
+    r = aug_span(aug, cpath,
+                 &filename,
+                 &label_start, &label_end,
+                 &value_start, &value_end,
+                 &span_start, &span_end);
+    aug_unlock(s);
+
+    result = rb_hash_new();
+
+    if (r == 0) {
+        hash_set(result, "filename", rb_str_new2(filename));
+        hash_set_range(result, "label", label_start, label_end);
+        hash_set_range(result, "value", value_start, value_end);
+        hash_set_range(result, "span", span_start, span_end);
+    }
+
+    free(filename);
+
+    return result;
+}
+
+/*
+ * call-seq:
+ *   span(PATH) -> HASH
+ *
+ * Get the filename, label and value position in the text of this node
+ *
+ * Raises Augeas::NoMatchError if the node could not be found
+ * Raises Augeas::NoSpanInfoError if the node associated with PATH doesn't
+ * belong to a file or doesn't exist
+ */
+VALUE facade_span(VALUE s, VALUE path) {
+    return facade_check(s, augeas_span(s, path));
+}
+
+/* The span of one node, as found by spans */
+struct span_info {
+    char        *path;
+    char        *filename;
+    unsigned int label_start, label_end;
+    unsigned int value_start, value_end;
+    unsigned int span_start, span_end;
+};
+
+struct spans_args {
+    const char       *path;
+    struct span_info *spans;
+    int               nspans;
+    int               nomem;
+};
+
+static int spans_blocking(augeas *aug, void *data) {
+    struct spans_args *args = data;
+    char **matches = NULL;
+    int cnt, i, r = 0;
+
+    cnt = aug_match(aug, args->path, &matches);
+    if (cnt < 0)
+        return -1;
+    if (cnt > 0) {
+        args->spans = calloc(cnt, sizeof(*args->spans));
+        if (args->spans == NULL)
+            args->nomem = 1;
+    }
+    for (i = 0; i < cnt; i++) {
+        struct span_info *sp = args->nomem ? NULL : args->spans + args->nspans;
+
+        if (sp == NULL || r < 0) {
+            free(matches[i]);
+        } else if (aug_span(aug, matches[i], &sp->filename,
+                            &sp->label_start, &sp->label_end,
+                            &sp->value_start, &sp->value_end,
+                            &sp->span_start, &sp->span_end) == 0) {
+            sp->path = matches[i];
+            args->nspans += 1;
+        } else {
+            /* Nodes without span information are skipped; anything else
+               is an error, which stays the last one of the handle */
+            if (aug_error(aug) != AUG_ENOSPAN)
+                r = -1;
+            free(matches[i]);
+        }
+    }
+    free(matches);
+    return r;
+}
+
+/*
+ * Look up the span of every node matching P. Return an array with a hash
+ * like the one from span for each, or a flat array of integers if FLAT
+ * is true, or Qnil if P could not be evaluated
+ */
+static VALUE spans(VALUE s, VALUE p, int flat) {
+    VALUE path = rb_str_new_frozen(StringValue(p));
+    VALUE result = Qnil;
+    struct spans_args args;
+    int i, r;
+
+    memset(&args, 0, sizeof(args));
+    args.path = StringValueCStr(path);
+    r = aug_blocking(s, spans_blocking, &args);
+    RB_GC_GUARD(path);
+
+    if (r == 0 && !args.nomem) {
+        /* All nodes from the same file share one filename string */
+        struct augeas_handle *h = get_handle(s);
+        st_table *filenames = st_init_strtable();
+
+        result = rb_ary_new2(args.nspans);
+        for (i = 0; i < args.nspans; i++) {
+            struct span_info *sp = args.spans + i;
+            VALUE filename, entry;
+            st_data_t v;
+
+            if (st_lookup(filenames, (st_data_t) sp->filename, &v)) {
+                filename = (VALUE) v;
+            } else {
+                filename = rb_obj_freeze(rb_str_new2(sp->filename));
+                st_insert(filenames, (st_data_t) sp->filename,
+                          (st_data_t) filename);
+            }
+            if (flat) {
+                entry = rb_ary_new_from_args(8,
+                                             tree_str(h, sp->path), filename,
+                                             UINT2NUM(sp->label_start),
+                                             UINT2NUM(sp->label_end),
+                                             UINT2NUM(sp->value_start),
+                                             UINT2NUM(sp->value_end),
+                                             UINT2NUM(sp->span_start),
+                                             UINT2NUM(sp->span_end));
+            } else {
+                entry = rb_hash_new();
+                hash_set(entry, "path", tree_str(h, sp->path));
+                hash_set(entry, "filename", filename);
+                hash_set_range(entry, "label", sp->label_start, sp->label_end);
+                hash_set_range(entry, "value", sp->value_start, sp->value_end);
+                hash_set_range(entry, "span", sp->span_start, sp->span_end);
+            }
+            rb_ary_push(result, entry);
+        }
+        st_free_table(filenames);
+    }
+
+    for (i = 0; i < args.nspans; i++) {
+        free(args.spans[i].path);
+        free(args.spans[i].filename);
+    }
+    free(args.spans);
+
+    if (args.nomem)
+        rb_memerror();
+    return result;
+}
+
+/*
+ * call-seq:
+ *   spans(PATH, FLAT = false) -> an_array
+ *
+ * Look up the span of every node matching the path expression PATH in
+ * one call. Return an array with a hash for each node like the one from
+ * +span+, with the path of the node added as <tt>:path</tt>. If FLAT is
+ * true, each entry is an array
+ *
+ *   [path, filename, label_start, label_end, value_start, value_end,
+ *    span_start, span_end]
+ *
+ * instead. Entries for nodes from the same file share one frozen
+ * filename string. Nodes without span information are left out.
+ *
+ * Returns +nil+ if PATH is invalid, or if looking up a span fails for
+ * another reason than missing span information.
+ */
+VALUE augeas_spans(int argc, VALUE *argv, VALUE s) {
+    VALUE path, flat;
+
+    rb_scan_args(argc, argv, "11", &path, &flat);
+    return spans(s, path, RTEST(flat));
+}
+
+/*
+ * call-seq:
+ *   spans(PATH, FLAT = false) -> an_array
+ *
+ * Look up the span of every node matching the path expression PATH in
+ * one call, see Augeas#spans. Nodes without span information are left
+ * out.
+ *
+ * Raises Augeas::InvalidPathError if PATH is invalid, and the error of
+ * the first span that can not be looked up for another reason than
+ * missing span information
+ */
+VALUE facade_spans(int argc, VALUE *argv, VALUE s) {
+    VALUE path, flat, result;
+    struct augeas_handle *h = get_handle(s);
+
+    rb_scan_args(argc, argv, "11", &path, &flat);
+    result = spans(s, path, RTEST(flat));
+    /* Nodes without span information are skipped, not errors */
+    if (h->err_code == AUG_ENOSPAN)
+        h->err_code = AUG_NOERROR;
+    return facade_check(s, NIL_P(result) ? INT2FIX(-1) : result);
+}
+
+struct srun_args {
+    FILE       *out;
+    const char *text;
+};
+
+static int srun_blocking(augeas *aug, void *data) {
+    struct srun_args *args = data;
+
+    return aug_srun(aug, args->out, args->text);
+}
+
+/* Size of the chunks in which srun streams the output of the commands */
+#define SRUN_CHUNK_SIZE 65536
+
+/* Where srun streams the output of the commands to */
+struct srun_stream {
+    VALUE       io;        /* The IO to write to, or Qnil to yield */
+    const char *buf;
+    size_t      size;
+    int         state;     /* Set by rb_protect once passing output failed */
+};
+
+static VALUE srun_emit(VALUE arg) {
+    struct srun_stream *st = (struct srun_stream *) arg;
+    VALUE chunk = rb_str_new(st->buf, st->size);
+
+    if (NIL_P(st->io))
+        rb_yield(chunk);
+    else
+        rb_io_write(st->io, chunk);
+    return Qnil;
+}
+
+static void *srun_emit_protect(void *arg) {
+    struct srun_stream *st = arg;
+
+    rb_protect(srun_emit, (VALUE) st, &st->state);
+    return NULL;
+}
+
+/*
+ * Pass the SIZE bytes of output in BUF on while aug_srun runs. Since
+ * aug_srun runs without the GVL, reacquire it for that; whatever the
+ * block or IO raises is kept in ST->state and raised once the lock of the
+ * handle is released. After a failure, the remaining output is dropped.
+ */
+static long srun_stream_write(struct srun_stream *st, const char *buf,
+                              size_t size) {
+    if (st->state != 0)
+        return -1;
+    st->buf = buf;
+    st->size = size;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_with_gvl(srun_emit_protect, st);
+#else
+    srun_emit_protect(st);
+#endif
+    return st->state == 0 ? (long) size : -1;
+}
+
+#if defined(HAVE_FOPENCOOKIE)
+static ssize_t srun_cookie_write(void *cookie, const char *buf, size_t size) {
+    return srun_stream_write(cookie, buf, size);
+}
+
+static FILE *srun_stream_open(struct srun_stream *st) {
+    cookie_io_functions_t funcs = { NULL, srun_cookie_write, NULL, NULL };
+
+    return fopencookie(st, "w", funcs);
+}
+#elif defined(HAVE_FUNOPEN)
+static int srun_cookie_write(void *cookie, const char *buf, int size) {
+    return (int) srun_stream_write(cookie, buf, size);
+}
+
+static FILE *srun_stream_open(struct srun_stream *st) {
+    return funopen(st, NULL, srun_cookie_write, NULL, NULL);
+}
+#endif
+
+#if defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN)
+struct srun_stream_args {
+    struct srun_stream *st;
+    const char         *text;
+    int                 nomem;
+};
+
+/*
+ * Run the commands with their output going to the stream. The stream is
+ * opened and closed here so that its last chunk is also passed on while
+ * the GVL is released.
+ */
+static int srun_stream_blocking(augeas *aug, void *data) {
+    struct srun_stream_args *args = data;
+    char *buf;
+    FILE *out;
+    int r;
+
+    buf = malloc(SRUN_CHUNK_SIZE);
+    out = buf == NULL ? NULL : srun_stream_open(args->st);
+    if (out == NULL) {
+        free(buf);
+        args->nomem = 1;
+        return -1;
+    }
+    setvbuf(out, buf, _IOFBF, SRUN_CHUNK_SIZE);
+    r = aug_srun(aug, out, args->text);
+    fclose(out);
+    free(buf);
+    return r;
+}
+#endif
+
+/* Note that commands ran, which may have changed any node and file */
+static void srun_changed(VALUE s) {
+    tree_changed(s);
+    get_handle(s)->dirty_unknown = 1;
+}
+
+/*
+ * Run the commands in TEXT, passing their output to IO or the block as it
+ * is produced. Without fopencookie or funopen, the output is collected
+ * and passed on in one piece once the commands are done.
+ */
+static int srun_stream(VALUE s, const char *text, VALUE io) {
+    struct srun_stream st;
+    int r;
+
+    st.io = io;
+    st.state = 0;
+#if defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN)
+    {
+        struct srun_stream_args args;
+
+        args.st = &st;
+        args.text = text;
+        args.nomem = 0;
+        /* The block and IO have to be called on the caller's thread */
+        r = aug_blocking(s, srun_stream_blocking, &args);
+        if (args.nomem)
+            rb_memerror();
+    }
+#else
+    {
+        struct srun_args args;
+        struct memstream ms;
+
+        __aug_init_memstream(&ms);
+        args.out = ms.stream;
+        args.text = text;
+        r = aug_offload(s, srun_blocking, &args);
+        __aug_close_memstream(&ms);
+        st.buf = ms.buf;
+        st.size = strlen(ms.buf);
+        srun_emit_protect(&st);
+        free(ms.buf);
+    }
+#endif
+    RB_GC_GUARD(io);
+    /* aug_srun runs all commands even if passing their output on failed */
+    srun_changed(s);
+    if (st.state != 0)
+        rb_jump_tag(st.state);
+    return r;
+}
+
+/*
+ * call-seq:
+ *   srun(COMMANDS) -> [int, String]
+ *   srun(COMMANDS, io: IO) -> [int, nil]
+ *   srun(COMMANDS) { |chunk| block } -> [int, nil]
+ *
+ * Run one or more newline-separated commands, returning their output.
+ *
+ * Returns:
+ * an array where the first element is the number of executed commands on
+ * success, -1 on failure, and -2 if a 'quit' command was encountered.
+ * The second element is a string of the output from all commands.
+ *
+ * With <tt>io:</tt> or a block, the output is not collected; instead, it
+ * is written to IO or yielded in chunks of up to 64KiB while the commands
+ * run, and the second element is +nil+. The block must not use the
+ * handle, which stays locked until the commands are done; doing so raises
+ * Augeas::Error. If the block or IO raises, the exception is raised once
+ * the commands are done: the commands after the one whose output could
+ * not be passed on still run, only their output is dropped.
+ */
+VALUE augeas_srun(int argc, VALUE *argv, VALUE s) {
+    VALUE text, opts, io = Qundef, ftext;
+    ID kw = rb_intern("io");
+    struct srun_args args;
+    int r;
+    VALUE result;
+    struct memstream ms;
+
+    rb_scan_args(argc, argv, "1:", &text, &opts);
+    if (!NIL_P(opts))
+        rb_get_kwargs(opts, &kw, 0, 1, &io);
+    if (io == Qundef)
+        io = Qnil;
+    ftext = rb_str_new_frozen(StringValue(text));
+    args.text = StringValueCStr(ftext);
+
+    if (!NIL_P(io) || rb_block_given_p()) {
+        r = srun_stream(s, args.text, io);
+    } else {
+        __aug_init_memstream(&ms);
+        args.out = ms.stream;
+        r = aug_offload(s, srun_blocking, &args);
+        __aug_close_memstream(&ms);
+        srun_changed(s);
+    }
+    RB_GC_GUARD(ftext);
+
+    result = rb_ary_new();
+    rb_ary_push(result, INT2NUM(r));
+    if (!NIL_P(io) || rb_block_given_p()) {
+        rb_ary_push(result, Qnil);
+    } else {
+        rb_ary_push(result, rb_str_new2(ms.buf));
+        free(ms.buf);
+    }
+    return result;
+}
+
+/*
+ * call-seq:
+ *   srun(COMMANDS) -> [int, String]
+ *   srun(COMMANDS, io: IO) -> [int, nil]
+ *   srun(COMMANDS) { |chunk| block } -> [int, nil]
+ *
+ * Run one or more newline-separated commands specified by COMMANDS,
+ * returns an array of [successful_commands_number, output] or
+ * [-2, output] in case 'quit' command has been encountered.
+ * With <tt>io:</tt> or a block, the output is streamed there instead of
+ * being returned, see Augeas#srun.
+ * Raises Augeas::CommandExecutionError if gets an invalid command
+ */
+VALUE facade_srun(int argc, VALUE *argv, VALUE s) {
+    return facade_check(s, augeas_srun(argc, argv, s));
+}
+
+/*
+ * call-seq:
+ *   label(PATH) -> String
+ *
+ * Lookup the label associated with PATH
+ */
+VALUE augeas_label(VALUE s, VALUE path) {
+    const char *cpath = StringValueCStr(path);
+    const char *label;
+    augeas *aug = aug_lock(s);
+
+    aug_label(aug, cpath, &label);
+    aug_unlock(s);
+    if (label != NULL) {
+        return tree_str(get_handle(s), label);
+    } else {
+        return Qnil;
+    }
+}
+
+/*
+ * call-seq:
+ *   label(PATH) -> String
+ *
+ * Lookup the label associated with PATH
+ * Raises Augeas::NoMatchError if the PATH node does not exist
+ */
+VALUE facade_label(VALUE s, VALUE path) {
+    return facade_check(s, augeas_label(s, path));
+}
+
+/*
+ * call-seq:
+ *   rename(SRC, LABEL) -> int
+ *
+ * Rename the label of all nodes matching SRC to LABEL.
+ *
+ * Returns +false+ if +aug_rename+ fails, and the number of nodes renamed
+ * on success.
+ */
+VALUE augeas_rename(VALUE s, VALUE src, VALUE label) {
+    const char *csrc = StringValueCStr(src);
+    const char *clabel = StringValueCStr(label);
+    struct dirty_list dirty = DIRTY_LIST_INIT;
+    augeas *aug = aug_lock(s);
+    int r;
+
+    dirty_collect(aug, csrc, &dirty);
+    r = aug_rename(aug, csrc, clabel);
+    aug_unlock(s);
+    tree_changed(s);
+    dirty_merge(s, &dirty);
+
+    return (r < 0) ? Qfalse : INT2NUM(r);
+}
+
+/*
+ * call-seq:
+ *   rename(PATH, LABEL) -> int
+ *
+ * Rename the label of all nodes matching PATH to LABEL
+ * Raises Augeas::NoMatchError if the PATH node does not exist
+ * Raises Augeas::InvalidLabelError if LABEL is invalid
+ */
+VALUE facade_rename(VALUE s, VALUE src, VALUE label) {
+    return facade_check(s, augeas_rename(s, src, label));
+}
+
+/*
+ * call-seq:
+ *   text_store(LENS, NODE, PATH) -> boolean
+ *
+ * Use the value of node NODE as a string and transform it into a tree
+ * using the lens LENS and store it in the tree at PATH, which will be
+ * overwritten. PATH and NODE are path expressions.
+ */
+VALUE augeas_text_store(VALUE s, VALUE lens, VALUE node, VALUE path) {
+    const char *clens = StringValueCStr(lens);
+    const char *cnode = StringValueCStr(node);
+    const char *cpath = StringValueCStr(path);
+    struct dirty_list dirty = DIRTY_LIST_INIT;
+    augeas *aug = aug_lock(s);
+    int r = aug_text_store(aug, clens, cnode, cpath);
+
+    if (r >= 0)
+        dirty_collect(aug, cpath, &dirty);
+    aug_unlock(s);
+    tree_changed(s);
+    dirty_merge(s, &dirty);
+
+    return (r < 0) ? Qfalse : Qtrue;
+}
+
+/*
+ * call-seq:
+ *   text_store(LENS, NODE, PATH) -> boolean
+ *
+ * Use the value of node NODE as a string and transform it into a tree
+ * using the lens LENS and store it in the tree at PATH, which will be
+ * overwritten. PATH and NODE are path expressions.
+ */
+VALUE facade_text_store(VALUE s, VALUE lens, VALUE node, VALUE path) {
+    return facade_check(s, augeas_text_store(s, lens, node, path));
+}
+
+/*
+ * call-seq:
+ *   text_retrieve(LENS, NODE_IN, PATH, NODE_OUT) -> boolean
+ *
+ * Transform the tree at PATH into a string using lens LENS and store it in
+ * the node NODE_OUT, assuming the tree was initially generated using the
+ * value of node NODE_IN. PATH, NODE_IN, and NODE_OUT are path expressions.
+ */
+VALUE augeas_text_retrieve(VALUE s, VALUE lens, VALUE node_in, VALUE path, VALUE node_out) {
+    const char *clens = StringValueCStr(lens);
+    const char *cnode_in = StringValueCStr(node_in);
+    const char *cpath = StringValueCStr(path);
+    const char *cnode_out = StringValueCStr(node_out);
+    struct dirty_list dirty = DIRTY_LIST_INIT;
+    augeas *aug = aug_lock(s);
+    int r = aug_text_retrieve(aug, clens, cnode_in, cpath, cnode_out);
+
+    if (r >= 0)
+        dirty_collect(aug, cnode_out, &dirty);
+    aug_unlock(s);
+    tree_changed(s);
+    dirty_merge(s, &dirty);
+
+    return (r < 0) ? Qfalse : Qtrue;
+}
+
+/*
+ * call-seq:
+ *   text_retrieve(LENS, NODE_IN, PATH, NODE_OUT) -> boolean
+ *
+ * Transform the tree at PATH into a string using lens LENS and store it in
+ * the node NODE_OUT, assuming the tree was initially generated using the
+ * value of node NODE_IN. PATH, NODE_IN, and NODE_OUT are path expressions.
+ */
+VALUE facade_text_retrieve(VALUE s, VALUE lens, VALUE node_in, VALUE path,
+                           VALUE node_out) {
+    return facade_check(s, augeas_text_retrieve(s, lens, node_in, path,
+                                                node_out));
+}
+
+struct to_xml_args {
+    const char           *path;
+    xmlNode              *xml;
+    /* The handle whose string settings the conversion follows */
+    struct augeas_handle *h;
+};
+
+static int to_xml_blocking(augeas *aug, void *data) {
+    struct to_xml_args *args = data;
+
+    return aug_to_xml(aug, args->path, &args->xml, 0);
+}
+
+/*
+ * Turn the <node> element NODE that aug_to_xml produced into an array
+ * [LABEL, VALUE, CHILDREN], with strings made like get makes them for H
+ */
+static VALUE xml_node_to_tree(struct augeas_handle *h, xmlNode *node) {
+    VALUE label = Qnil, value = Qnil, children = rb_ary_new();
+    xmlNode *cur;
+    xmlChar *text;
+
+    text = xmlGetProp(node, BAD_CAST "label");
+    if (text != NULL) {
+        label = tree_str(h, (const char *) text);
+        xmlFree(text);
+    }
+
+    for (cur = node->children; cur != NULL; cur = cur->next) {
+        if (cur->type != XML_ELEMENT_NODE)
+            continue;
+        if (xmlStrEqual(cur->name, BAD_CAST "value")) {
+            text = xmlNodeGetContent(cur);
+            value = tree_str(h, text == NULL ? "" : (const char *) text);
+            xmlFree(text);
+        } else if (xmlStrEqual(cur->name, BAD_CAST "node")) {
+            rb_ary_push(children, xml_node_to_tree(h, cur));
+        }
+    }
+
+    return rb_ary_new3(3, label, value, children);
+}
+
+static VALUE xml_to_tree(VALUE arg) {
+    struct to_xml_args *args = (struct to_xml_args *) arg;
+    VALUE result = rb_ary_new();
+    xmlNode *cur;
+
+    for (cur = args->xml->children; cur != NULL; cur = cur->next) {
+        if (cur->type == XML_ELEMENT_NODE
+            && xmlStrEqual(cur->name, BAD_CAST "node"))
+            rb_ary_push(result, xml_node_to_tree(args->h, cur));
+    }
+    return result;
+}
+
+static VALUE xml_dump(VALUE arg) {
+    xmlNode *xml = ((struct to_xml_args *) arg)->xml;
+    xmlBuffer *buf = xmlBufferCreate();
+    VALUE result;
+
+    if (buf == NULL)
+        rb_memerror();
+    xmlNodeDump(buf, NULL, xml, 0, 1);
+    result = rb_utf8_str_new((const char *) xmlBufferContent(buf),
+                             xmlBufferLength(buf));
+    xmlBufferFree(buf);
+
+    return result;
+}
+
+static VALUE xml_free(VALUE arg) {
+    xmlFreeNode(((struct to_xml_args *) arg)->xml);
+    return Qnil;
+}
+
+/*
+ * Produce the XML for the nodes matching the path expression P with
+ * aug_to_xml and pass it to CONVERT, as the struct to_xml_args. Return
+ * Qnil if aug_to_xml fails
+ */
+static VALUE to_xml(VALUE s, VALUE p, VALUE (*convert)(VALUE)) {
+    VALUE path = rb_str_new_frozen(StringValue(p));
+    struct to_xml_args args;
+    int r;
+
+    args.path = StringValueCStr(path);
+    args.xml = NULL;
+    args.h = get_handle(s);
+    r = aug_blocking(s, to_xml_blocking, &args);
+    RB_GC_GUARD(path);
+
+    if (r < 0 || args.xml == NULL) {
+        if (args.xml != NULL)
+            xmlFreeNode(args.xml);
+        return Qnil;
+    }
+    return rb_ensure(convert, (VALUE) &args, xml_free, (VALUE) &args);
+}
+
+/*
+ * call-seq:
+ *   tree(PATH) -> an_array
+ *
+ * Return the subtrees of all nodes matching the path expression PATH. Each
+ * node is represented as an array [LABEL, VALUE, CHILDREN], where VALUE is
+ * +nil+ if the node has no value and CHILDREN is an array of nodes in the
+ * same format. Labels and values are strings like those from +get+, see
+ * +interned_strings=+.
+ *
+ * Returns +nil+ if PATH is invalid.
+ */
+VALUE augeas_tree(VALUE s, VALUE path) {
+    return to_xml(s, path, xml_to_tree);
+}
+
+/*
+ * call-seq:
+ *   tree(PATH) -> an_array
+ *
+ * Return the subtrees of all nodes matching the path expression PATH as
+ * arrays [LABEL, VALUE, CHILDREN], see Augeas#tree
+ */
+VALUE facade_tree(VALUE s, VALUE path) {
+    VALUE result = to_xml(s, path, xml_to_tree);
+
+    return facade_check(s, NIL_P(result) ? INT2FIX(-1) : result);
+}
+
+/*
+ * call-seq:
+ *   to_xml(PATH) -> String
+ *
+ * Return the XML representation of the subtrees of all nodes matching the
+ * path expression PATH, as produced by +aug_to_xml+
+ *
+ * Returns +nil+ if PATH is invalid.
+ */
+VALUE augeas_to_xml(VALUE s, VALUE path) {
+    return to_xml(s, path, xml_dump);
+}
+
+/*
+ * call-seq:
+ *   to_xml(PATH) -> String
+ *
+ * Return the XML representation of the subtrees of all nodes matching the
+ * path expression PATH, as produced by +aug_to_xml+
+ */
+VALUE facade_to_xml(VALUE s, VALUE path) {
+    VALUE result = to_xml(s, path, xml_dump);
+
+    return facade_check(s, NIL_P(result) ? INT2FIX(-1) : result);
+}
+
+/* The node below which parse and render keep their text and tree while
+ * they run; it is removed again before the handle is unlocked */
+#define SCRATCH_NODE "/__ruby_augeas_scratch"
+#define SCRATCH_TEXT SCRATCH_NODE "/text"
+#define SCRATCH_TREE SCRATCH_NODE "/tree"
+#define SCRATCH_OUT  SCRATCH_NODE "/out"
+
+/* Characters that need a backslash in front of them in a node name */
+#define PATH_SPECIAL "][|/=()!,\\"
+
+/* Append LABEL to STR, escaped for use as a name in a path expression */
+static void path_escape_cat(VALUE str, const char *label) {
+    const char *p;
+
+    for (p = label; *p != '\0'; p++) {
+        if (strchr(PATH_SPECIAL, *p) != NULL || ISSPACE(*p))
+            rb_str_cat(str, "\\", 1);
+        rb_str_cat(str, p, 1);
+    }
+}
+
+/*
+ * call-seq:
+ *   Augeas::escape_label(LABEL) -> String
+ *
+ * Return LABEL with a backslash in front of the characters that have a
+ * special meaning in path expressions, so that it can be used as the name
+ * of a node in a path, the same way +import+ and +render+ escape labels
+ */
+VALUE augeas_escape_label(VALUE klass, VALUE label) {
+    VALUE result = rb_str_buf_new(RSTRING_LEN(StringValue(label)));
+
+    path_escape_cat(result, StringValueCStr(label));
+    rb_enc_copy(result, label);
+    return result;
+}
+
+/* The variables through which tree_ops_run reaches the parent of the
+ * nodes it creates, one per level of the tree; they are undefined again
+ * before the handle is unlocked */
+#define TREE_OPS_VAR "__ruby_augeas_tree"
+
+struct tree_op {
+    const char *expr;
+    const char *value;
+    /* The variable to bind to the node for its children, or -1 */
+    int         var;
+};
+
+/*
+ * Turn NODES into an array of nodes [LABEL, VALUE, CHILDREN]. NODES is
+ * either such an array or a Hash mapping labels to values, or to a Hash
+ * of the children of a node without value.
+ */
+static VALUE tree_nodes(VALUE nodes) {
+    VALUE pairs, result;
+    long i;
+
+    if (!RB_TYPE_P(nodes, T_HASH))
+        return rb_convert_type(nodes, T_ARRAY, "Array", "to_ary");
+
+    pairs = rb_funcall(nodes, rb_intern("to_a"), 0);
+    result = rb_ary_new_capa(RARRAY_LEN(pairs));
+    for (i = 0; i < RARRAY_LEN(pairs); i++) {
+        VALUE pair = RARRAY_AREF(pairs, i);
+        VALUE label = rb_obj_as_string(RARRAY_AREF(pair, 0));
+        VALUE value = RARRAY_AREF(pair, 1);
+
+        if (RB_TYPE_P(value, T_HASH))
+            rb_ary_push(result, rb_ary_new3(3, label, Qnil, value));
+        else if (NIL_P(value))
+            rb_ary_push(result, rb_ary_new3(2, label, Qnil));
+        else
+            rb_ary_push(result, rb_ary_new3(2, label, rb_obj_as_string(value)));
+    }
+    return result;
+}
+
+/*
+ * Append to OPS an expression, value and variable for each node of
+ * NODES, see tree_nodes, that create it below the node bound to the
+ * variable for DEPTH. With MERGE, the n-th
+ * node with a given label is matched against the n-th existing child
+ * with that label instead of being appended. Return the depth of the
+ * deepest variable used.
+ */
+static int tree_ops_build(VALUE ops, int depth, VALUE nodes, int merge) {
+    VALUE seen = merge ? rb_hash_new() : Qnil;
+    int max = depth;
+    long i;
+
+    nodes = tree_nodes(nodes);
+    for (i = 0; i < RARRAY_LEN(nodes); i++) {
+        VALUE node = rb_check_array_type(RARRAY_AREF(nodes, i));
+        VALUE label, value, children = Qnil, expr;
+        int var = -1;
+
+        if (NIL_P(node) || RARRAY_LEN(node) < 2 || RARRAY_LEN(node) > 3)
+            rb_raise(rb_eArgError,
+                     "tree nodes must be arrays [LABEL, VALUE, CHILDREN]");
+        label = RARRAY_AREF(node, 0);
+        value = RARRAY_AREF(node, 1);
+        if (NIL_P(label))
+            rb_raise(rb_eArgError, "can not create a node without a label");
+        label = rb_str_new_frozen(StringValue(label));
+        if (RARRAY_LEN(node) > 2 && !NIL_P(RARRAY_AREF(node, 2))) {
+            children = tree_nodes(RARRAY_AREF(node, 2));
+            if (RARRAY_LEN(children) > 0)
+                var = depth + 1;
+        }
+
+        expr = rb_sprintf("$" TREE_OPS_VAR "%d/", depth);
+        path_escape_cat(expr, StringValueCStr(label));
+        if (merge) {
+            VALUE n = rb_hash_lookup2(seen, label, INT2FIX(0));
+
+            n = LONG2FIX(FIX2LONG(n) + 1);
+            rb_hash_aset(seen, label, n);
+            rb_str_catf(expr, "[%ld]", FIX2LONG(n));
+        } else {
+            rb_str_cat2(expr, "[last()+1]");
+        }
+
+        rb_ary_push(ops, rb_obj_freeze(expr));
+        rb_ary_push(ops, NIL_P(value) ? Qnil
+                                      : rb_str_new_frozen(StringValue(value)));
+        rb_ary_push(ops, INT2FIX(var));
+        if (var > 0) {
+            int d = tree_ops_build(ops, var, children, merge);
+
+            if (d > max)
+                max = d;
+        }
+    }
+    return max;
+}
+
+static void tree_ops_var(char *buf, size_t len, const char *prefix, int depth) {
+    snprintf(buf, len, "%s" TREE_OPS_VAR "%d", prefix, depth);
+}
+
+/*
+ * Turn OPS, as built by tree_ops_build, into an array of tree_op for
+ * tree_ops_run; the array is allocated with ALLOCV into *TMP. The
+ * strings in it point into OPS, which must be kept alive
+ */
+static struct tree_op *tree_ops_convert(VALUE ops, long *nops, VALUE *tmp) {
+    struct tree_op *result;
+    long i;
+
+    *nops = RARRAY_LEN(ops) / 3;
+    result = ALLOCV_N(struct tree_op, *tmp, *nops);
+    for (i = 0; i < *nops; i++) {
+        VALUE expr = RARRAY_AREF(ops, 3 * i);
+        VALUE value = RARRAY_AREF(ops, 3 * i + 1);
+
+        result[i].expr = StringValueCStr(expr);
+        result[i].value = NIL_P(value) ? NULL : StringValueCStr(value);
+        result[i].var = FIX2INT(RARRAY_AREF(ops, 3 * i + 2));
+    }
+    return result;
+}
+
+/*
+ * Create the nodes for OPS below the node bound to the variable for depth
+ * 0. Return the index of the op that failed, or -1 if all of them
+ * succeeded. The variables stay bound; undefine them with tree_ops_unbind
+ * once the error of the handle has been looked at
+ */
+static long tree_ops_run(augeas *aug, struct tree_op *ops, long nops) {
+    char name[64], ref[64];
+    long i;
+
+    for (i = 0; i < nops; i++) {
+        struct tree_op *op = ops + i;
+        int created = 1, r;
+
+        if (op->var < 0) {
+            r = aug_set(aug, op->expr, op->value);
+        } else {
+            tree_ops_var(name, sizeof(name), "", op->var);
+            r = aug_defnode(aug, name, op->expr, op->value, &created);
+            if (r >= 0 && !created) {
+                tree_ops_var(ref, sizeof(ref), "$", op->var);
+                r = aug_set(aug, ref, op->value);
+            }
+        }
+        if (r < 0)
+            return i;
+    }
+    return -1;
+}
+
+/* Undefine the variables used for trees up to DEPTH deep */
+static void tree_ops_unbind(augeas *aug, int depth) {
+    char name[64];
+    int d;
+
+    for (d = 0; d <= depth; d++) {
+        tree_ops_var(name, sizeof(name), "", d);
+        aug_defvar(aug, name, NULL);
+    }
+}
+
+struct scratch_args {
+    const char  *lens;
+    const char  *text;
+    /* The ops that build the tree for render, see tree_ops_build */
+    struct tree_op *ops;
+    long         nops;
+    int          depth;
+    xmlNode     *xml;
+    char        *out;
+    int          nomem;
+    /* Why the call failed */
+    int          err_code;
+    char        *err_message;
+    char        *err_details;
+};
+
+static void scratch_clear(augeas *aug) {
+    aug_rm(aug, SCRATCH_NODE);
+    aug_rm(aug, "/augeas/text" SCRATCH_NODE);
+}
+
+static char *strdup_or_null(const char *s) {
+    return s == NULL ? NULL : strdup(s);
+}
+
+/*
+ * Remember why parse or render failed: the error of the handle or, if
+ * there is none, the error that aug_text_store and aug_text_retrieve
+ * leave below /augeas/text. Then clear the scratch node.
+ */
+static int scratch_fail(augeas *aug, struct scratch_args *args) {
+    const char *msg = NULL;
+
+    args->err_code = aug_error(aug);
+    if (args->err_code != AUG_NOERROR) {
+        args->err_message = strdup_or_null(aug_error_message(aug));
+        args->err_details = strdup_or_null(aug_error_details(aug));
+    } else {
+        if (aug_get(aug, "/augeas/text" SCRATCH_TREE "/message", &msg) != 1)
+            aug_get(aug, "/augeas/text" SCRATCH_TREE "/error", &msg);
+        args->err_message = strdup_or_null(msg);
+    }
+    scratch_clear(aug);
+    return -1;
+}
+
+static int parse_blocking(augeas *aug, void *data) {
+    struct scratch_args *args = data;
+
+    scratch_clear(aug);
+    if (aug_set(aug, SCRATCH_TEXT, args->text) < 0
+        || aug_text_store(aug, args->lens, SCRATCH_TEXT, SCRATCH_TREE) < 0
+        || aug_to_xml(aug, SCRATCH_TREE "/*", &args->xml, 0) < 0)
+        return scratch_fail(aug, args);
+    scratch_clear(aug);
+    return 0;
+}
+
+static int render_blocking(augeas *aug, void *data) {
+    struct scratch_args *args = data;
+    const char *out = NULL;
+    char name[64];
+    int r;
+
+    scratch_clear(aug);
+    tree_ops_var(name, sizeof(name), "", 0);
+    if (aug_set(aug, SCRATCH_TEXT, args->text) < 0
+        || aug_set(aug, SCRATCH_TREE, NULL) < 0
+        || aug_defvar(aug, name, SCRATCH_TREE) < 0
+        || tree_ops_run(aug, args->ops, args->nops) >= 0) {
+        r = scratch_fail(aug, args);
+        tree_ops_unbind(aug, args->depth);
+        return r;
+    }
+    tree_ops_unbind(aug, args->depth);
+    if (aug_text_retrieve(aug, args->lens, SCRATCH_TEXT, SCRATCH_TREE,
+                          SCRATCH_OUT) < 0
+        || aug_get(aug, SCRATCH_OUT, &out) != 1)
+        return scratch_fail(aug, args);
+    args->out = strdup(out == NULL ? "" : out);
+    if (args->out == NULL)
+        args->nomem = 1;
+    scratch_clear(aug);
+    return 0;
+}
+
+/*
+ * Run FUNC with ARGS on the scratch node. Return 0 on success; otherwise
+ * return -1 and, if EXC is not NULL, store the exception for the failure
+ * in *EXC
+ */
+static int scratch_run(VALUE s, int (*func)(augeas *aug, void *data),
+                       struct scratch_args *args, VALUE *exc) {
+    int r;
+
+    args->xml = NULL;
+    args->out = NULL;
+    args->nomem = 0;
+    args->err_code = AUG_NOERROR;
+    args->err_message = NULL;
+    args->err_details = NULL;
+    r = aug_blocking(s, func, args);
+
+    if (r < 0 && exc != NULL) {
+        if (args->err_code != AUG_NOERROR) {
+            *exc = error_exception(args->err_code, args->err_message,
+                                   args->err_details);
+        } else {
+            const char *msg = args->err_message;
+            VALUE klass = rb_const_get(c_augeas,
+                                       rb_intern("CommandExecutionError"));
+
+            *exc = rb_exc_new_str(klass,
+                                  rb_sprintf("Lens %s failed: %s", args->lens,
+                                             msg == NULL ? "unknown error"
+                                                         : msg));
+        }
+    }
+    free(args->err_message);
+    free(args->err_details);
+    if (args->nomem)
+        rb_memerror();
+    return r;
 }
 
 /*
- * call-seq:
- *       match(PATH) -> an_array
- *
- * Return all the paths that match the path expression PATH as an aray of
- * strings.
- * Returns an empty array if no paths were found.
+ * Parse TEXT with LENS. Return the tree or, if that fails, Qnil and, if
+ * EXC is not NULL, the exception for the failure in *EXC
  */
-VALUE facade_match(VALUE s, VALUE p) {
-    augeas *aug = aug_handle(s);
-    const char *path = StringValueCStr(p);
-    char **matches = NULL;
-    int cnt, i;
-    VALUE result;
-
-    cnt = aug_match(aug, path, &matches) ;
-    if (cnt < 0)
-        return -1;
+static VALUE parse(VALUE s, VALUE lens, VALUE text, VALUE *exc) {
+    VALUE flens = rb_str_new_frozen(StringValue(lens));
+    VALUE ftext = rb_str_new_frozen(StringValue(text));
+    struct scratch_args args;
 
-    result = rb_ary_new();
-    for (i = 0; i < cnt; i++) {
-        rb_ary_push(result, rb_str_new(matches[i], strlen(matches[i])));
-        free(matches[i]) ;
+    args.lens = StringValueCStr(flens);
+    args.text = StringValueCStr(ftext);
+    args.ops = NULL;
+    args.nops = 0;
+    args.depth = 0;
+    if (scratch_run(s, parse_blocking, &args, exc) < 0) {
+        if (args.xml != NULL)
+            xmlFreeNode(args.xml);
+        return Qnil;
     }
-    free (matches) ;
-
-    return result ;
+    RB_GC_GUARD(flens);
+    RB_GC_GUARD(ftext);
+    if (args.xml == NULL)
+        return rb_ary_new();
+    return rb_ensure(xml_to_tree, (VALUE) args.xml, xml_free, (VALUE) args.xml);
 }
 
 /*
- * call-seq:
- *       save() -> boolean
- *
- * Write all pending changes to disk
+ * Render TREE with LENS, starting from the text ORIGINAL. Return the text
+ * or, if that fails, Qnil and, if EXC is not NULL, the exception for the
+ * failure in *EXC
  */
-VALUE augeas_save(VALUE s) {
-    augeas *aug = aug_handle(s);
+static VALUE render(VALUE s, int argc, VALUE *argv, VALUE *exc) {
+    VALUE lens, tree, opts, original = Qundef, ops, result;
+    ID kw = rb_intern("original");
+    struct scratch_args args;
+    VALUE tmp;
+
+    rb_scan_args(argc, argv, "2:", &lens, &tree, &opts);
+    if (!NIL_P(opts))
+        rb_get_kwargs(opts, &kw, 0, 1, &original);
+    if (original == Qundef || NIL_P(original))
+        original = rb_str_new_cstr("");
+    original = rb_str_new_frozen(StringValue(original));
+    lens = rb_str_new_frozen(StringValue(lens));
 
-    return (aug_save(aug) == 0) ? Qtrue : Qfalse;
+    ops = rb_ary_new();
+    args.depth = tree_ops_build(ops, 0, tree, 0);
+    args.ops = tree_ops_convert(ops, &args.nops, &tmp);
+    args.lens = StringValueCStr(lens);
+    args.text = StringValueCStr(original);
+    if (scratch_run(s, render_blocking, &args, exc) < 0) {
+        result = Qnil;
+    } else {
+        result = rb_str_new_cstr(args.out);
+        free(args.out);
+    }
+    ALLOCV_END(tmp);
+    RB_GC_GUARD(ops);
+    RB_GC_GUARD(lens);
+    RB_GC_GUARD(original);
+    return result;
 }
 
 /*
  * call-seq:
- *       save() -> int
+ *   parse(LENS, TEXT) -> an_array
+ *
+ * Parse the string TEXT with the lens LENS, e.g. "Hosts.lns", and return
+ * the resulting tree in the format of +tree+, without touching any file
+ * or the rest of the tree. The handle compiles each lens only once, so
+ * parsing many strings with the same lens is cheap.
  *
- * Write all pending changes to disk
+ * Returns +nil+ if TEXT can not be parsed.
  */
-VALUE facade_save(VALUE s) {
-    augeas *aug = aug_handle(s);
-    return INT2FIX(aug_save(aug));
+VALUE augeas_parse(VALUE s, VALUE lens, VALUE text) {
+    return parse(s, lens, text, NULL);
 }
 
 /*
  * call-seq:
- *       load() -> boolean
+ *   parse(LENS, TEXT) -> an_array
  *
- * Load files from disk according to the transforms under +/augeas/load+
+ * Parse the string TEXT with the lens LENS and return the resulting tree
+ * in the format of +tree+, see Augeas#parse
+ *
+ * Raises Augeas::CommandExecutionError if TEXT can not be parsed
  */
-VALUE augeas_load(VALUE s) {
-    augeas *aug = aug_handle(s);
-    int callValue = aug_load(aug);
-    VALUE returnValue ;
-
-    if (callValue == 0)
-        returnValue = Qtrue ;
-    else
-        returnValue = Qfalse ;
+VALUE facade_parse(VALUE s, VALUE lens, VALUE text) {
+    VALUE exc = Qnil;
+    VALUE result = parse(s, lens, text, &exc);
 
-    return returnValue ;
+    if (!NIL_P(exc))
+        rb_exc_raise(exc);
+    return result;
 }
 
 /*
  * call-seq:
- *   defvar(NAME, EXPR) -> boolean
- *
- * Define a variable NAME whose value is the result of evaluating EXPR. If
- * a variable NAME already exists, its name will be replaced with the
- * result of evaluating EXPR.
+ *   render(LENS, TREE, original: nil) -> String
  *
- * If EXPR is NULL, the variable NAME will be removed if it is defined.
+ * Turn TREE, in the format returned by +parse+ and +tree+, into text with
+ * the lens LENS. If ORIGINAL is given, TREE is taken to be a changed
+ * version of the tree parsed from it, and the text keeps as much of the
+ * formatting of ORIGINAL as possible. Files and the rest of the tree are
+ * not touched.
  *
+ * Returns +nil+ if TREE can not be rendered.
  */
-VALUE augeas_defvar(VALUE s, VALUE name, VALUE expr) {
-    augeas *aug = aug_handle(s);
-    const char *cname = StringValueCStr(name);
-    const char *cexpr = StringValueCStrOrNull(expr);
-
-    int r = aug_defvar(aug, cname, cexpr);
-
-    return (r < 0) ? Qfalse : Qtrue;
+VALUE augeas_render(int argc, VALUE *argv, VALUE s) {
+    return render(s, argc, argv, NULL);
 }
 
 /*
  * call-seq:
- *   defnode(NAME, EXPR, VALUE) -> boolean
- *
- * Define a variable NAME whose value is the result of evaluating EXPR,
- * which must be non-NULL and evaluate to a nodeset. If a variable NAME
- * already exists, its name will be replaced with the result of evaluating
- * EXPR.
+ *   render(LENS, TREE, original: nil) -> String
  *
- * If EXPR evaluates to an empty nodeset, a node is created, equivalent to
- * calling AUG_SET(AUG, EXPR, VALUE) and NAME will be the nodeset containing
- * that single node.
+ * Turn TREE into text with the lens LENS, keeping the formatting of
+ * ORIGINAL where possible, see Augeas#render
  *
- * Returns +false+ if +aug_defnode+ fails, and the number of nodes in the
- * nodeset on success.
+ * Raises Augeas::CommandExecutionError if TREE can not be rendered
  */
-VALUE augeas_defnode(VALUE s, VALUE name, VALUE expr, VALUE value) {
-    augeas *aug = aug_handle(s);
-    const char *cname = StringValueCStr(name);
-    const char *cexpr = StringValueCStrOrNull(expr);
-    const char *cvalue = StringValueCStrOrNull(value);
+VALUE facade_render(int argc, VALUE *argv, VALUE s) {
+    VALUE exc = Qnil;
+    VALUE result = render(s, argc, argv, &exc);
 
-    /* FIXME: Figure out a way to return created, maybe accept a block
-       that gets run when created == 1 ? */
-    int r = aug_defnode(aug, cname, cexpr, cvalue, NULL);
-
-    return (r < 0) ? Qfalse : INT2NUM(r);
+    if (!NIL_P(exc))
+        rb_exc_raise(exc);
+    return result;
 }
 
-static VALUE init(VALUE class, VALUE m, VALUE r, VALUE l, VALUE f) {
-    unsigned int flags = NUM2UINT(f);
-    const char *root = StringValueCStrOrNull(r);
-    const char *loadpath = StringValueCStrOrNull(l);
-    augeas *aug = NULL;
+struct import_args {
+    const char        *path;
+    struct tree_op    *ops;
+    long               nops;
+    /* The index of the node that could not be created, or -1 */
+    long               failed;
+    int                depth;
+    int                merge;
+    struct dirty_list  dirty;
+    int                err_code;
+    char              *err_message;
+    char              *err_details;
+};
 
-    aug = aug_init(root, loadpath, flags);
-    if (aug == NULL) {
-        rb_raise(rb_eSystemCallError, "Failed to initialize Augeas");
+/* Remember the error of the handle, then undefine the import variables */
+static int import_done(augeas *aug, struct import_args *args, int r) {
+    if (r < 0) {
+        args->err_code = aug_error(aug);
+        if (args->err_code != AUG_NOERROR) {
+            args->err_message = strdup_or_null(aug_error_message(aug));
+            args->err_details = strdup_or_null(aug_error_details(aug));
+        }
     }
-    return Data_Wrap_Struct(class, NULL, augeas_free, aug);
+    tree_ops_unbind(aug, args->depth);
+    return r;
 }
 
-VALUE augeas_init(VALUE m, VALUE r, VALUE l, VALUE f) {
-    return init(c_augeas, m, r, l, f);
-}
+static int import_blocking(augeas *aug, void *data) {
+    struct import_args *args = data;
+    char name[64];
 
-VALUE facade_init(VALUE m, VALUE r, VALUE l, VALUE f) {
-    return init(c_facade, m, r, l, f);
+    /* Create the node at PATH if it is missing; fails if PATH matches
+       more than one node */
+    if (aug_match(aug, args->path, NULL) != 1
+        && aug_set(aug, args->path, NULL) < 0)
+        return import_done(aug, args, -1);
+    tree_ops_var(name, sizeof(name), "", 0);
+    if (aug_defvar(aug, name, args->path) < 0)
+        return import_done(aug, args, -1);
+    if (!args->merge && aug_rm(aug, "$" TREE_OPS_VAR "0/*") < 0)
+        return import_done(aug, args, -1);
+
+    args->failed = tree_ops_run(aug, args->ops, args->nops);
+    if (args->failed >= 0) {
+        import_done(aug, args, -1);
+        dirty_collect(aug, args->path, &args->dirty);
+        return -1;
+    }
+
+    /* The files below PATH, or PATH itself if it is in a file */
+    dirty_collect(aug, "$" TREE_OPS_VAR "0", &args->dirty);
+    if (args->dirty.unknown) {
+        args->dirty.unknown = 0;
+        dirty_collect(aug, "$" TREE_OPS_VAR "0/*", &args->dirty);
+    }
+    return import_done(aug, args, 0);
 }
 
-VALUE augeas_close (VALUE s) {
-    augeas *aug = aug_handle(s);
+/*
+ * Create TREE below PATH. Return the number of nodes imported, or -1 and,
+ * if EXC is not NULL, the exception for the failure in *EXC
+ */
+static long import(VALUE s, int argc, VALUE *argv, VALUE *exc) {
+    VALUE path, tree, opts, mode = Qundef, ops;
+    ID kw = rb_intern("mode");
+    struct import_args args;
+    VALUE tmp;
+    int r;
 
-    aug_close(aug);
-    DATA_PTR(s) = NULL;
+    rb_scan_args(argc, argv, "2:", &path, &tree, &opts);
+    if (!NIL_P(opts))
+        rb_get_kwargs(opts, &kw, 0, 1, &mode);
+    if (mode == Qundef || NIL_P(mode))
+        mode = ID2SYM(rb_intern("merge"));
+    if (mode == ID2SYM(rb_intern("merge")))
+        args.merge = 1;
+    else if (mode == ID2SYM(rb_intern("replace")))
+        args.merge = 0;
+    else
+        rb_raise(rb_eArgError, "mode must be :replace or :merge, not %"PRIsVALUE,
+                 rb_inspect(mode));
+    path = rb_str_new_frozen(StringValue(path));
 
-    return Qnil;
+    ops = rb_ary_new();
+    args.depth = tree_ops_build(ops, 0, tree, args.merge);
+    args.path = StringValueCStr(path);
+    args.ops = tree_ops_convert(ops, &args.nops, &tmp);
+    args.failed = -1;
+    memset(&args.dirty, 0, sizeof(args.dirty));
+    args.err_code = AUG_NOERROR;
+    args.err_message = NULL;
+    args.err_details = NULL;
+
+    r = aug_blocking(s, import_blocking, &args);
+    tree_changed(s);
+    ALLOCV_END(tmp);
+    RB_GC_GUARD(ops);
+    RB_GC_GUARD(path);
+    dirty_merge(s, &args.dirty);
+    /* The error was taken before the variables were undefined */
+    get_handle(s)->err_code = AUG_NOERROR;
+
+    if (r < 0 && exc != NULL) {
+        if (args.err_code != AUG_NOERROR) {
+            *exc = error_exception(args.err_code, args.err_message,
+                                   args.err_details);
+        } else {
+            VALUE klass = rb_const_get(c_augeas,
+                                       rb_intern("CommandExecutionError"));
+
+            *exc = rb_exc_new_str(klass,
+                                  rb_sprintf("Importing into %s failed",
+                                             args.path));
+        }
+        if (args.failed >= 0)
+            rb_iv_set(*exc, "@index", LONG2NUM(args.failed));
+    }
+    free(args.err_message);
+    free(args.err_details);
+    return r < 0 ? -1 : args.nops;
 }
 
-static void hash_set(VALUE hash, const char *sym, VALUE v) {
-    rb_hash_aset(hash, ID2SYM(rb_intern(sym)), v);
+/*
+ * call-seq:
+ *   import(PATH, TREE, mode: :merge) -> int
+ *
+ * Create the nodes of TREE, in the format returned by +tree+ and +parse+,
+ * as children of the node PATH, which is created if it does not exist.
+ * TREE, or the children of any of its nodes, may also be a Hash that
+ * maps labels to values, which are turned into strings, or to a Hash of
+ * children for nodes without a value.
+ * Each node is created relative to its parent, so that its depth does
+ * not add to the cost of the call. Finding the place of a node still
+ * means looking at the children its parent already has, though, so that
+ * importing many siblings below the same node takes time that grows
+ * with the square of their number.
+ *
+ * With <tt>mode: :replace</tt>, the children that PATH had before are
+ * removed first. With <tt>mode: :merge</tt>, the n-th node with a given
+ * label in TREE updates the value of the n-th child with that label,
+ * and is only created if there is no such child.
+ *
+ * Returns the number of nodes imported, or -1 if importing failed. The
+ * nodes that were created before the failure are left in the tree; use
+ * +load+ to drop them along with any other unsaved changes.
+ */
+VALUE augeas_import(int argc, VALUE *argv, VALUE s) {
+    return LONG2NUM(import(s, argc, argv, NULL));
 }
 
 /*
  * call-seq:
- *   error -> HASH
+ *   import(PATH, TREE, mode: :merge) -> int
  *
- * Retrieve details about the last error encountered and return those
- * details in a HASH with the following entries:
- * - :code    error code from +aug_error+
- * - :message error message from +aug_error_message+
- * - :minor   minor error message from +aug_minor_error_message+
- * - :details error details from +aug_error_details+
+ * Create the nodes of TREE as children of the node PATH, see
+ * Augeas#import
+ *
+ * Returns the number of nodes imported. Raises the error that stopped
+ * the import; if a node could not be created, the +index+ of the error
+ * is the position of that node in TREE, counted depth-first, and the
+ * nodes before it are left in the tree.
  */
-VALUE augeas_error(VALUE s) {
-    augeas *aug = aug_handle(s);
-    int code;
-    const char *msg;
-    VALUE result;
+VALUE facade_import(int argc, VALUE *argv, VALUE s) {
+    VALUE exc = Qnil;
+    long n = import(s, argc, argv, &exc);
 
-    result = rb_hash_new();
+    if (!NIL_P(exc))
+        rb_exc_raise(exc);
+    return LONG2NUM(n);
+}
 
-    code = aug_error(aug);
-    hash_set(result, "code", INT2NUM(code));
+/* Operations understood by apply */
+enum batch_op_type {
+    OP_SET, OP_SETM, OP_RM, OP_MV, OP_INSERT, OP_RENAME, OP_CLEAR,
+    OP_TOUCH, OP_DEFNODE, OP_LAST
+};
 
-    msg = aug_error_message(aug);
-    if (msg != NULL)
-        hash_set(result, "message", rb_str_new2(msg));
+/* Bits for the arguments of an operation that may be nil, and for those
+   that are booleans */
+#define ARG(n) (1 << (n))
 
-    msg = aug_error_minor_message(aug);
-    if (msg != NULL)
-        hash_set(result, "minor", rb_str_new2(msg));
+static const struct {
+    const char *name;
+    int         argc;
+    int         nullable;
+    int         boolean;
+} batch_op_info[OP_LAST] = {
+    [OP_SET]    = { "set", 2, ARG(1), 0 },
+    [OP_SETM]   = { "setm", 3, ARG(1) | ARG(2), 0 },
+    [OP_RM]     = { "rm", 1, 0, 0 },
+    [OP_MV]     = { "mv", 2, 0, 0 },
+    [OP_INSERT] = { "insert", 3, 0, ARG(2) },
+    [OP_RENAME] = { "rename", 2, 0, 0 },
+    [OP_CLEAR]  = { "clear", 1, 0, 0 },
+    [OP_TOUCH]  = { "touch", 1, 0, 0 },
+    [OP_DEFNODE] = { "defnode", 3, ARG(2), 0 }
+};
 
-    msg = aug_error_details(aug);
-    if (msg != NULL)
-        hash_set(result, "details", rb_str_new2(msg));
+static ID batch_op_ids[OP_LAST];
 
-    return result;
+struct batch_op {
+    enum batch_op_type type;
+    const char        *arg[3];
+};
+
+struct batch_args {
+    struct batch_op  *ops;
+    long              len;
+    long              failed;
+    struct dirty_list dirty;
+    /* For replay, which runs all operations: the error of each failed
+       operation, or NULL for those that succeeded */
+    struct batch_error **errors;
+    /* Set when there was no memory to remember an error */
+    int               nomem;
+};
+
+struct batch_error {
+    int   code;
+    char *message;
+    char *details;
+};
+
+static int batch_run(augeas *aug, struct batch_op *op) {
+    switch (op->type) {
+    case OP_SET:
+        return aug_set(aug, op->arg[0], op->arg[1]);
+    case OP_SETM:
+        return aug_setm(aug, op->arg[0], op->arg[1], op->arg[2]);
+    case OP_RM:
+        return aug_rm(aug, op->arg[0]);
+    case OP_MV:
+        return aug_mv(aug, op->arg[0], op->arg[1]);
+    case OP_INSERT:
+        return aug_insert(aug, op->arg[0], op->arg[1], op->arg[2] != NULL);
+    case OP_RENAME:
+        return aug_rename(aug, op->arg[0], op->arg[1]);
+    case OP_CLEAR:
+        return aug_set(aug, op->arg[0], NULL);
+    case OP_TOUCH: {
+        int r = aug_match(aug, op->arg[0], NULL);
+
+        return r == 0 ? aug_set(aug, op->arg[0], NULL) : r;
+    }
+    case OP_DEFNODE:
+        return aug_defnode(aug, op->arg[0], op->arg[1], op->arg[2], NULL);
+    default:
+        return -1;
+    }
 }
 
-static void hash_set_range(VALUE hash, const char *sym,
-                           unsigned int start, unsigned int end) {
-    VALUE r;
+/*
+ * Run OP like batch_run and add the files it changes to DIRTY. Nodes
+ * that OP removes or renames are looked up before running it, all others
+ * afterwards.
+ */
+static int batch_run_tracked(augeas *aug, struct batch_op *op,
+                             struct dirty_list *dirty) {
+    int len = dirty->len, r;
 
-    r = rb_range_new(INT2NUM(start), INT2NUM(end), 0);
-    hash_set(hash, sym, r);
+    if (op->type == OP_RM || op->type == OP_MV || op->type == OP_RENAME)
+        dirty_collect(aug, op->arg[0], dirty);
+    r = batch_run(aug, op);
+    if (r == 0 && (op->type == OP_RM || op->type == OP_RENAME))
+        dirty_truncate(dirty, len);
+    if (r >= 0) {
+        /* The first argument of defnode is the name of a variable */
+        if (op->type == OP_MV || op->type == OP_DEFNODE)
+            dirty_collect(aug, op->arg[1], dirty);
+        else if (op->type == OP_SET || op->type == OP_CLEAR
+                 || (op->type == OP_TOUCH && r == 0)) {
+            /* Created nodes may no longer match, see set */
+            if (!dirty_collect(aug, op->arg[0], dirty))
+                dirty->unknown = 1;
+        } else if (op->type == OP_INSERT || (op->type == OP_SETM && r > 0))
+            dirty_collect(aug, op->arg[0], dirty);
+    }
+    return r;
 }
 
-VALUE augeas_span(VALUE s, VALUE path) {
-    augeas *aug = aug_handle(s);
-    char *cpath = StringValueCStr(path);
-    char *filename = NULL;
-    unsigned int label_start, label_end, value_start, value_end,
-        span_start, span_end;
-    int r;
-    VALUE result;
+static int batch_blocking(augeas *aug, void *data) {
+    struct batch_args *args = data;
+    long i;
 
-    r = aug_span(aug, cpath,
-                 &filename,
-                 &label_start, &label_end,
-                 &value_start, &value_end,
-                 &span_start, &span_end);
+    for (i = 0; i < args->len; i++) {
+        if (batch_run_tracked(aug, args->ops + i, &args->dirty) < 0) {
+            args->failed = i;
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    result = rb_hash_new();
+/* Run all operations, remembering the error of each one that fails */
+static int replay_blocking(augeas *aug, void *data) {
+    struct batch_args *args = data;
+    long i;
 
-    if (r == 0) {
-        hash_set(result, "filename", rb_str_new2(filename));
-        hash_set_range(result, "label", label_start, label_end);
-        hash_set_range(result, "value", value_start, value_end);
-        hash_set_range(result, "span", span_start, span_end);
+    for (i = 0; i < args->len; i++) {
+        struct batch_error *err;
+        const char *msg;
+
+        if (batch_run_tracked(aug, args->ops + i, &args->dirty) >= 0)
+            continue;
+        if (args->failed < 0)
+            args->failed = i;
+        err = calloc(1, sizeof(*err));
+        if (err == NULL) {
+            args->nomem = 1;
+            continue;
+        }
+        err->code = aug_error(aug);
+        if (err->code != AUG_NOERROR) {
+            msg = aug_error_message(aug);
+            err->message = msg == NULL ? NULL : strdup(msg);
+            msg = aug_error_details(aug);
+            err->details = msg == NULL ? NULL : strdup(msg);
+        }
+        args->errors[i] = err;
     }
+    return args->failed < 0 ? 0 : -1;
+}
 
-    free(filename);
+/*
+ * Convert the operation OP, the I-th entry passed to apply, into BOP.
+ * String arguments are frozen and kept alive in KEEP so that they can be
+ * used without the GVL.
+ */
+static void batch_op_convert(VALUE op, long i, struct batch_op *bop,
+                             VALUE keep) {
+    VALUE name;
+    long j;
+    int type;
 
-    return result;
+    op = rb_check_array_type(op);
+    if (NIL_P(op) || RARRAY_LEN(op) == 0)
+        rb_raise(rb_eArgError, "operation %ld is not an array", i);
+
+    name = RARRAY_AREF(op, 0);
+    for (type = 0; type < OP_LAST; type++) {
+        if (SYMBOL_P(name) && SYM2ID(name) == batch_op_ids[type])
+            break;
+    }
+    if (type == OP_LAST)
+        rb_raise(rb_eArgError, "operation %ld: unknown operation %"PRIsVALUE,
+                 i, rb_inspect(name));
+    if (RARRAY_LEN(op) != batch_op_info[type].argc + 1)
+        rb_raise(rb_eArgError,
+                 "operation %ld: wrong number of arguments for %s (given %ld, expected %d)",
+                 i, batch_op_info[type].name, RARRAY_LEN(op) - 1,
+                 batch_op_info[type].argc);
+
+    bop->type = type;
+    for (j = 0; j < 3; j++) {
+        VALUE arg;
+
+        bop->arg[j] = NULL;
+        if (j >= batch_op_info[type].argc)
+            continue;
+        arg = RARRAY_AREF(op, j + 1);
+        if (batch_op_info[type].boolean & ARG(j)) {
+            /* Any non-NULL pointer means true */
+            bop->arg[j] = RTEST(arg) ? "" : NULL;
+        } else if (NIL_P(arg) && (batch_op_info[type].nullable & ARG(j))) {
+            continue;
+        } else {
+            arg = rb_str_new_frozen(StringValue(arg));
+            rb_ary_push(keep, arg);
+            bop->arg[j] = StringValueCStr(arg);
+        }
+    }
 }
 
 /*
- * call-seq:
- *   srun(COMMANDS) -> [int, String]
- *
- * Run one or more newline-separated commands, returning their output.
- *
- * Returns:
- * an array where the first element is the number of executed commands on
- * success, -1 on failure, and -2 if a 'quit' command was encountered.
- * The second element is a string of the output from all commands.
+ * Parse the files in DIRTY, which apply changed before one of its
+ * operations failed, again to drop those changes, and merge DIRTY into
+ * the dirty table of S. When the changes can not all be tied to a file,
+ * load the whole tree again instead
+ */
+static void apply_rollback(VALUE s, struct dirty_list *dirty) {
+    struct augeas_handle *h = get_handle(s);
+#ifdef HAVE_AUG_LOAD_FILE
+    struct file_list list = FILE_LIST_INIT;
+    int i, nomem;
+
+    if (!dirty->unknown) {
+        for (i = 0; i < dirty->len; i++)
+            file_list_add(&list, dirty->names[i]);
+    }
+    dirty_merge(s, dirty);
+    if (!dirty->unknown && !list.nomem) {
+        aug_offload(s, reload_files_blocking, &list);
+        tree_changed(s);
+        for (i = 0; i < list.len; i++) {
+            stamps_forget(h, list.names[i]);
+            dirty_forget(h, list.names[i]);
+            resident_reloaded(h, list.names[i]);
+        }
+        if ((h->budget_bytes > 0 || h->budget_nodes > 0)
+            && budget_measure(s, &list) == 0)
+            budget_enforce(s);
+        nomem = list.nomem;
+        file_list_free(&list);
+        if (nomem)
+            rb_memerror();
+        return;
+    }
+    file_list_free(&list);
+#else
+    dirty_merge(s, dirty);
+#endif
+    aug_offload(s, load_blocking, NULL);
+    tree_changed(s);
+    stamps_clear(h);
+    dirty_clear(h);
+    resident_clear(h);
+    budget_update(s, NULL);
+}
+
+/*
+ * Run the operations OPS in one call, stopping at the first one that
+ * fails. When ROLLBACK is true and an operation fails, parse the files
+ * it changed again to drop the changes made so far. Return the number of operations that
+ * were applied, and store the exception for the failed operation of a
+ * Facade handle in *EXC
  */
-VALUE augeas_srun(VALUE s, VALUE text) {
-    augeas *aug = aug_handle(s);
-    const char *ctext = StringValueCStr(text);
+static long apply(VALUE s, VALUE ops, int rollback, VALUE *exc) {
+    VALUE keep, tmp;
+    struct batch_args args;
+    long i;
     int r;
-    VALUE result;
-    struct memstream ms;
-    __aug_init_memstream(&ms);
 
-    r = aug_srun(aug, ms.stream, ctext);
-    __aug_close_memstream(&ms);
+    ops = rb_convert_type(ops, T_ARRAY, "Array", "to_ary");
+    args.len = RARRAY_LEN(ops);
+    args.failed = -1;
+    memset(&args.dirty, 0, sizeof(args.dirty));
+    args.errors = NULL;
+    args.nomem = 0;
+    args.ops = ALLOCV_N(struct batch_op, tmp, args.len);
+    keep = rb_ary_new();
+    for (i = 0; i < args.len; i++)
+        batch_op_convert(RARRAY_AREF(ops, i), i, args.ops + i, keep);
 
-    result = rb_ary_new();
-    rb_ary_push(result, INT2NUM(r));
-    rb_ary_push(result, rb_str_new2(ms.buf));
+    r = aug_blocking(s, batch_blocking, &args);
+    tree_changed(s);
+    ALLOCV_END(tmp);
+    RB_GC_GUARD(keep);
+    RB_GC_GUARD(ops);
 
-    free(ms.buf);
-    return result;
+    *exc = Qnil;
+    if (r == 0 || !rollback)
+        dirty_merge(s, &args.dirty);
+    if (r == 0)
+        return args.len;
+
+    if (get_handle(s)->check_errors) {
+        *exc = facade_exception(s, INT2FIX(-1));
+        rb_iv_set(*exc, "@index", LONG2NUM(args.failed));
+    }
+    if (rollback) {
+        apply_rollback(s, &args.dirty);
+        /* Errors from reloading must not mask the original error */
+        get_handle(s)->err_code = AUG_NOERROR;
+    }
+    return args.failed;
 }
 
 /*
  * call-seq:
- *   label(PATH) -> String
+ *   apply(OPS, ROLLBACK = false) -> int
  *
- * Lookup the label associated with PATH
+ * Apply the list of operations OPS in one call. Each operation is an
+ * array of the name of a method and its arguments, one of
+ *
+ *   [:set, PATH, VALUE]
+ *   [:setm, BASE, SUB, VALUE]
+ *   [:rm, PATH]
+ *   [:mv, SRC, DST]
+ *   [:insert, PATH, LABEL, BEFORE]
+ *   [:rename, SRC, LABEL]
+ *   [:clear, PATH]
+ *   [:touch, PATH]
+ *   [:defnode, NAME, EXPR, VALUE]
+ *
+ * Operations are applied in order until one of them fails. If ROLLBACK is
+ * true, the files that were changed are then loaded again from disk,
+ * which also discards any unsaved changes to them made before +apply+;
+ * other files keep theirs. If not all changes can be tied to a file,
+ * like when a new file was created, the whole tree is loaded again.
+ *
+ * Returns the number of operations applied. If that is less than the
+ * size of OPS, it is the index of the operation that failed.
  */
-VALUE augeas_label(VALUE s, VALUE path) {
-    augeas *aug = aug_handle(s);
-    const char *cpath = StringValueCStr(path);
-    const char *label;
+VALUE augeas_apply(int argc, VALUE *argv, VALUE s) {
+    VALUE ops, rollback, exc;
 
-    aug_label(aug, cpath, &label);
-    if (label != NULL) {
-        return rb_str_new(label, strlen(label)) ;
-    } else {
-        return Qnil;
-    }
+    rb_scan_args(argc, argv, "11", &ops, &rollback);
+    return LONG2NUM(apply(s, ops, RTEST(rollback), &exc));
 }
 
 /*
  * call-seq:
- *   rename(SRC, LABEL) -> int
+ *   apply(OPS, ROLLBACK = false) -> int
  *
- * Rename the label of all nodes matching SRC to LABEL.
+ * Apply the list of operations OPS in one call, see Augeas#apply for
+ * their format. Operations are applied in order until one of them fails;
+ * if ROLLBACK is true, the files that were changed are then loaded again
+ * from disk.
  *
- * Returns +false+ if +aug_rename+ fails, and the number of nodes renamed
- * on success.
+ * Returns the number of operations applied. Raises the error for the
+ * operation that failed; its +index+ is the position of that operation
+ * in OPS.
  */
-VALUE augeas_rename(VALUE s, VALUE src, VALUE label) {
-    augeas *aug = aug_handle(s);
-    const char *csrc = StringValueCStr(src);
-    const char *clabel = StringValueCStr(label);
-    int r = aug_rename(aug, csrc, clabel);
+VALUE facade_apply(int argc, VALUE *argv, VALUE s) {
+    VALUE ops, rollback, exc;
+    long n;
 
-    return (r < 0) ? Qfalse : INT2NUM(r);
+    rb_scan_args(argc, argv, "11", &ops, &rollback);
+    n = apply(s, ops, RTEST(rollback), &exc);
+    if (!NIL_P(exc))
+        rb_exc_raise(exc);
+    return LONG2NUM(n);
 }
 
 /*
  * call-seq:
- *   text_store(LENS, NODE, PATH) -> boolean
+ *   replay(OPS) -> an_array
  *
- * Use the value of node NODE as a string and transform it into a tree
- * using the lens LENS and store it in the tree at PATH, which will be
- * overwritten. PATH and NODE are path expressions.
+ * Apply the list of operations OPS, usually an Augeas::Journal, in one
+ * call. Unlike +apply+, keep going when an operation fails. Return the
+ * errors of the operations that failed, in order, as an array of
+ * Augeas::Error whose +index+ is the position of the operation in OPS;
+ * the array is empty if all operations succeeded.
  */
-VALUE augeas_text_store(VALUE s, VALUE lens, VALUE node, VALUE path) {
-    augeas *aug = aug_handle(s);
-    const char *clens = StringValueCStr(lens);
-    const char *cnode = StringValueCStr(node);
-    const char *cpath = StringValueCStr(path);
-    int r = aug_text_store(aug, clens, cnode, cpath);
+VALUE augeas_replay(VALUE s, VALUE ops) {
+    VALUE keep, tmp, etmp, result;
+    struct batch_args args;
+    long i;
 
-    return (r < 0) ? Qfalse : Qtrue;
+    ops = rb_convert_type(ops, T_ARRAY, "Array", "to_ary");
+    args.len = RARRAY_LEN(ops);
+    args.failed = -1;
+    memset(&args.dirty, 0, sizeof(args.dirty));
+    args.ops = ALLOCV_N(struct batch_op, tmp, args.len);
+    args.errors = ALLOCV_N(struct batch_error *, etmp, args.len);
+    memset(args.errors, 0, args.len * sizeof(*args.errors));
+    args.nomem = 0;
+    keep = rb_ary_new();
+    for (i = 0; i < args.len; i++)
+        batch_op_convert(RARRAY_AREF(ops, i), i, args.ops + i, keep);
+
+    aug_blocking(s, replay_blocking, &args);
+    tree_changed(s);
+    dirty_merge(s, &args.dirty);
+    /* Errors are returned, not raised */
+    get_handle(s)->err_code = AUG_NOERROR;
+    if (args.nomem) {
+        /* Returning fewer errors than there were would hide failures */
+        for (i = 0; i < args.len; i++) {
+            if (args.errors[i] != NULL) {
+                free(args.errors[i]->message);
+                free(args.errors[i]->details);
+                free(args.errors[i]);
+            }
+        }
+        ALLOCV_END(etmp);
+        ALLOCV_END(tmp);
+        rb_memerror();
+    }
+
+    result = rb_ary_new();
+    for (i = 0; i < args.len; i++) {
+        struct batch_error *err = args.errors[i];
+        VALUE exc;
+
+        if (err == NULL)
+            continue;
+        if (err->code != AUG_NOERROR) {
+            exc = error_exception(err->code, err->message, err->details);
+        } else {
+            const char *name = batch_op_info[args.ops[i].type].name;
+            VALUE klass = rb_const_get(c_augeas,
+                                       rb_intern("CommandExecutionError"));
+
+            exc = rb_exc_new_str(klass, rb_sprintf("Operation %ld (%s) failed",
+                                                   i, name));
+        }
+        rb_iv_set(exc, "@index", LONG2NUM(i));
+        rb_ary_push(result, exc);
+        free(err->message);
+        free(err->details);
+        free(err);
+        args.errors[i] = NULL;
+    }
+    ALLOCV_END(etmp);
+    ALLOCV_END(tmp);
+    RB_GC_GUARD(keep);
+    RB_GC_GUARD(ops);
+    return result;
 }
 
 /*
  * call-seq:
- *   text_retrieve(LENS, NODE_IN, PATH, NODE_OUT) -> boolean
+ *   augeas_instrumenting = BOOLEAN
  *
- * Transform the tree at PATH into a string using lens LENS and store it in
- * the node NODE_OUT, assuming the tree was initially generated using the
- * value of node NODE_IN. PATH, NODE_IN, and NODE_OUT are path expressions.
+ * Turn timing of the calls into libaugeas on or off for this handle. Use
+ * +instrument+ rather than this.
  */
-VALUE augeas_text_retrieve(VALUE s, VALUE lens, VALUE node_in, VALUE path, VALUE node_out) {
-    augeas *aug = aug_handle(s);
-    const char *clens = StringValueCStr(lens);
-    const char *cnode_in = StringValueCStr(node_in);
-    const char *cpath = StringValueCStr(path);
-    const char *cnode_out = StringValueCStr(node_out);
-    int r = aug_text_retrieve(aug, clens, cnode_in, cpath, cnode_out);
+VALUE augeas_set_instrumenting(VALUE s, VALUE enable) {
+    get_handle(s)->instrumenting = RTEST(enable);
+    return enable;
+}
 
-    return (r < 0) ? Qfalse : Qtrue;
+/*
+ * call-seq:
+ *   augeas_instrument() -> [int, int]
+ *
+ * Return the total time in ns that this handle spent in libaugeas while
+ * instrumentation was on, and the error code of its last call
+ */
+VALUE augeas_instrument(VALUE s) {
+    struct augeas_handle *h = get_handle(s);
+
+    return rb_assoc_new(LL2NUM(h->inst_ns), INT2NUM(h->inst_err));
 }
 
 void Init__augeas() {
+    int i;
+
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+    /* Handles are not shareable and can only be used by the Ractor that
+       created them, so every Ractor can work with its own handles */
+    rb_ext_ractor_safe(true);
+    ractor_key = rb_ractor_local_storage_ptr_newkey(&ractor_token_type);
+#endif
 
     /* Define the ruby class */
     c_augeas = rb_define_class("Augeas", rb_cObject) ;
@@ -595,8 +5148,17 @@ void Init__augeas() {
     DEF_AUG_ERR(ELABEL);
 #undef DEF_AUG_ERR
 
+    /* Names of the operations for apply */
+    for (i = 0; i < OP_LAST; i++)
+        batch_op_ids[i] = rb_intern(batch_op_info[i].name);
+
     /* Define the methods */
     rb_define_singleton_method(c_augeas, "open3", augeas_init, 3);
+    rb_define_singleton_method(c_augeas, "escape_label",
+                               augeas_escape_label, 1);
+    rb_define_method(c_augeas, "augeas_instrumenting=",
+                     augeas_set_instrumenting, 1);
+    rb_define_method(c_augeas, "augeas_instrument", augeas_instrument, 0);
     rb_define_method(c_augeas, "defvar", augeas_defvar, 2);
     rb_define_method(c_augeas, "defnode", augeas_defnode, 3);
     rb_define_method(c_augeas, "get", augeas_get, 1);
@@ -605,42 +5167,132 @@ void Init__augeas() {
     rb_define_method(c_augeas, "mv", augeas_mv, 2);
     rb_define_method(c_augeas, "rm", augeas_rm, 1);
     rb_define_method(c_augeas, "match", augeas_match, 1);
-    rb_define_method(c_augeas, "save", augeas_save, 0);
+    rb_define_method(c_augeas, "each_match", augeas_each_match, 1);
+    rb_define_method(c_augeas, "get_all", augeas_get_all, 1);
+    rb_define_method(c_augeas, "save", augeas_save, -1);
     rb_define_method(c_augeas, "load", augeas_load, 0);
+#ifdef HAVE_AUG_LOAD_FILE
+    rb_define_method(c_augeas, "load_file", augeas_load_file, 1);
+#else
+    rb_define_method(c_augeas, "load_file", rb_f_notimplement, -1);
+#endif
+    rb_define_method(c_augeas, "refresh", augeas_refresh, 0);
     rb_define_method(c_augeas, "set_internal", augeas_set, 2);
     rb_define_method(c_augeas, "setm", augeas_setm, 3);
     rb_define_method(c_augeas, "close", augeas_close, 0);
     rb_define_method(c_augeas, "error", augeas_error, 0);
     rb_define_method(c_augeas, "span", augeas_span, 1);
-    rb_define_method(c_augeas, "srun", augeas_srun, 1);
+    rb_define_method(c_augeas, "spans", augeas_spans, -1);
+    rb_define_method(c_augeas, "srun", augeas_srun, -1);
     rb_define_method(c_augeas, "label", augeas_label, 1);
     rb_define_method(c_augeas, "rename", augeas_rename, 2);
     rb_define_method(c_augeas, "text_store", augeas_text_store, 3);
     rb_define_method(c_augeas, "text_retrieve", augeas_text_retrieve, 4);
+    rb_define_method(c_augeas, "apply", augeas_apply, -1);
+    rb_define_method(c_augeas, "replay", augeas_replay, 1);
+    rb_define_method(c_augeas, "tree", augeas_tree, 1);
+    rb_define_method(c_augeas, "to_xml", augeas_to_xml, 1);
+    rb_define_method(c_augeas, "parse", augeas_parse, 2);
+    rb_define_method(c_augeas, "render", augeas_render, -1);
+    rb_define_method(c_augeas, "import", augeas_import, -1);
+    rb_define_method(c_augeas, "match_cache=", augeas_set_match_cache, 1);
+    rb_define_method(c_augeas, "match_cache?", augeas_match_cache_p, 0);
+    rb_define_method(c_augeas, "interned_strings=",
+                     augeas_set_interned_strings, 1);
+    rb_define_method(c_augeas, "interned_strings?",
+                     augeas_interned_strings_p, 0);
+    rb_define_method(c_augeas, "match_cache_stats",
+                     augeas_match_cache_stats, 0);
+    rb_define_method(c_augeas, "dirty?", augeas_dirty_p, 0);
+    rb_define_method(c_augeas, "dirty_files", augeas_dirty_files, 0);
+    rb_define_method(c_augeas, "augeas_forget_changes", augeas_forget_changes, 1);
+    rb_define_method(c_augeas, "stats", augeas_stats, 0);
+#ifdef HAVE_AUG_LOAD_FILE
+    rb_define_method(c_augeas, "augeas_unload", augeas_unload, 1);
+    rb_define_method(c_augeas, "restore", augeas_restore, -1);
+    rb_define_method(c_augeas, "unloaded_files", augeas_unloaded_files, 0);
+    rb_define_method(c_augeas, "augeas_tree_budget=",
+                     augeas_set_tree_budget, 1);
+    rb_define_method(c_augeas, "tree_budget", augeas_tree_budget, 0);
+#else
+    rb_define_method(c_augeas, "augeas_unload", rb_f_notimplement, -1);
+    rb_define_method(c_augeas, "restore", rb_f_notimplement, -1);
+    rb_define_method(c_augeas, "unloaded_files", rb_f_notimplement, -1);
+    rb_define_method(c_augeas, "augeas_tree_budget=", rb_f_notimplement, -1);
+    rb_define_method(c_augeas, "tree_budget", rb_f_notimplement, -1);
+#endif
 
-    /* Define methods to support the 'new' API in Augeas::Facade */
+    /* Define methods to support the 'new' API in Augeas::Facade. These
+       raise the error that the underlying call ran into, if any */
     rb_define_singleton_method(c_facade, "open3", facade_init, 3);
+    rb_define_singleton_method(c_facade, "open_many", facade_open_many, 4);
     /* The `close` and `error` methods as used unchanged in the ruby bindings */
     rb_define_method(c_facade, "close", augeas_close, 0);
     rb_define_method(c_facade, "error", augeas_error, 0);
-    rb_define_method(c_facade, "augeas_defvar", augeas_defvar, 2);
-    rb_define_method(c_facade, "augeas_defnode", augeas_defnode, 3);
-    rb_define_method(c_facade, "augeas_get", augeas_get, 1);
-    rb_define_method(c_facade, "augeas_exists", augeas_exists, 1);
-    rb_define_method(c_facade, "augeas_insert", augeas_insert, 3);
-    rb_define_method(c_facade, "augeas_mv", augeas_mv, 2);
-    rb_define_method(c_facade, "augeas_rm", augeas_rm, 1);
-    rb_define_method(c_facade, "augeas_match", facade_match, 1);
-    rb_define_method(c_facade, "augeas_save", facade_save, 0);
-    rb_define_method(c_facade, "augeas_load", augeas_load, 0);
+    rb_define_method(c_facade, "defvar", facade_defvar, 2);
+    rb_define_method(c_facade, "defnode", facade_defnode, -1);
+    rb_define_method(c_facade, "get", facade_get, 1);
+    rb_define_method(c_facade, "exists", facade_exists, 1);
+    rb_define_method(c_facade, "insert", facade_insert, 3);
+    rb_define_method(c_facade, "mv", facade_mv, 2);
+    rb_define_method(c_facade, "rm", facade_rm, 1);
+    rb_define_method(c_facade, "match", facade_match, 1);
+    rb_define_method(c_facade, "each_match", facade_each_match, 1);
+    rb_define_method(c_facade, "get_all", facade_get_all, 1);
+    rb_define_method(c_facade, "setm", facade_setm, 3);
+    rb_define_method(c_facade, "span", facade_span, 1);
+    rb_define_method(c_facade, "spans", facade_spans, -1);
+    rb_define_method(c_facade, "srun", facade_srun, -1);
+    rb_define_method(c_facade, "label", facade_label, 1);
+    rb_define_method(c_facade, "rename", facade_rename, 2);
+    rb_define_method(c_facade, "text_store", facade_text_store, 3);
+    rb_define_method(c_facade, "text_retrieve", facade_text_retrieve, 4);
+    rb_define_method(c_facade, "apply", facade_apply, -1);
+    rb_define_method(c_facade, "replay", augeas_replay, 1);
+#ifdef HAVE_AUG_LOAD_FILE
+    rb_define_method(c_facade, "load_file", facade_load_file, 1);
+#else
+    rb_define_method(c_facade, "load_file", rb_f_notimplement, -1);
+#endif
+    rb_define_method(c_facade, "refresh", facade_refresh, 0);
+    rb_define_method(c_facade, "tree", facade_tree, 1);
+    rb_define_method(c_facade, "to_xml", facade_to_xml, 1);
+    rb_define_method(c_facade, "parse", facade_parse, 2);
+    rb_define_method(c_facade, "render", facade_render, -1);
+    rb_define_method(c_facade, "import", facade_import, -1);
+    rb_define_method(c_facade, "match_cache=", augeas_set_match_cache, 1);
+    rb_define_method(c_facade, "match_cache?", augeas_match_cache_p, 0);
+    rb_define_method(c_facade, "interned_strings=",
+                     augeas_set_interned_strings, 1);
+    rb_define_method(c_facade, "interned_strings?",
+                     augeas_interned_strings_p, 0);
+    rb_define_method(c_facade, "match_cache_stats",
+                     augeas_match_cache_stats, 0);
+    rb_define_method(c_facade, "dirty?", augeas_dirty_p, 0);
+    rb_define_method(c_facade, "dirty_files", augeas_dirty_files, 0);
+    rb_define_method(c_facade, "augeas_forget_changes", augeas_forget_changes, 1);
+    rb_define_method(c_facade, "stats", facade_stats, 0);
+#ifdef HAVE_AUG_LOAD_FILE
+    rb_define_method(c_facade, "augeas_unload", facade_unload, 1);
+    rb_define_method(c_facade, "restore", augeas_restore, -1);
+    rb_define_method(c_facade, "unloaded_files", augeas_unloaded_files, 0);
+    rb_define_method(c_facade, "augeas_tree_budget=",
+                     augeas_set_tree_budget, 1);
+    rb_define_method(c_facade, "tree_budget", augeas_tree_budget, 0);
+#else
+    rb_define_method(c_facade, "augeas_unload", rb_f_notimplement, -1);
+    rb_define_method(c_facade, "restore", rb_f_notimplement, -1);
+    rb_define_method(c_facade, "unloaded_files", rb_f_notimplement, -1);
+    rb_define_method(c_facade, "augeas_tree_budget=", rb_f_notimplement, -1);
+    rb_define_method(c_facade, "tree_budget", rb_f_notimplement, -1);
+#endif
+    /* Wrapped by methods in augeas/facade.rb */
+    rb_define_method(c_facade, "augeas_save", facade_save, -1);
+    rb_define_method(c_facade, "augeas_load", facade_load, 0);
     rb_define_method(c_facade, "augeas_set", facade_set, 2);
-    rb_define_method(c_facade, "augeas_setm", augeas_setm, 3);
-    rb_define_method(c_facade, "augeas_span", augeas_span, 1);
-    rb_define_method(c_facade, "augeas_srun", augeas_srun, 1);
-    rb_define_method(c_facade, "augeas_label", augeas_label, 1);
-    rb_define_method(c_facade, "augeas_rename", augeas_rename, 2);
-    rb_define_method(c_facade, "augeas_text_store", augeas_text_store, 3);
-    rb_define_method(c_facade, "augeas_text_retrieve", augeas_text_retrieve, 4);
+    rb_define_method(c_facade, "augeas_instrument", augeas_instrument, 0);
+    rb_define_method(c_facade, "augeas_instrumenting=",
+                     augeas_set_instrumenting, 1);
 }
 
 /*
@@ -26,6 +26,56 @@
 #define StringValueCStrOrNull(v)                \
     NIL_P(v) ? NULL : StringValueCStr(v)
 
+/* The data wrapped by Augeas and Augeas::Facade objects */
+struct augeas_handle {
+    struct augeas *aug;
+    /* Mutex that serializes all calls into libaugeas for AUG */
+    VALUE          lock;
+    /* For Augeas::Facade handles, the error of the last call is recorded
+     * when the lock is released so that it can be raised afterwards */
+    int            check_errors;
+    int            err_code;
+    const char    *err_message;
+    const char    *err_details;
+    /* What refresh last saw of each loaded file, keyed by file name */
+    st_table      *stamps;
+    /* Bumped by every call that may change the tree */
+    unsigned long  generation;
+    /* Results of match, keyed by path expression, while match_cache_gen
+     * is the current generation; Qnil unless the cache is enabled */
+    VALUE          match_cache;
+    unsigned long  match_cache_gen;
+    unsigned long  match_hits;
+    unsigned long  match_misses;
+    /* Whether strings from the tree are returned frozen and interned */
+    int            interned;
+    /* Names of the files with unsaved changes, and whether srun or changes
+     * outside of loaded files may have changed files not in that table */
+    st_table      *dirty;
+    int            dirty_unknown;
+    /* Estimated memory used by the tree as of the last stats */
+    long           tree_bytes;
+    /* The files that unload dropped from the tree and, with a tree
+     * budget, the size and last use of the loaded ones, keyed by name */
+    st_table      *resident;
+    /* The keys of that table in sorted order while it does not change, so
+     * that restore can find the files under a path; NULL if out of date */
+    const char   **resident_index;
+    long           resident_index_len;
+    unsigned long  resident_clock;
+    /* The limits of the tree budget, 0 for none */
+    long           budget_bytes;
+    long           budget_nodes;
+    /* Whether calls are timed and, while they are, the time spent in
+     * libaugeas in ns and the error code of the last call */
+    int            instrumenting;
+    long long      inst_start;
+    long long      inst_ns;
+    int            inst_err;
+    /* The Ractor that created the handle, see current_ractor */
+    void          *ractor;
+};
+
 /* memstream support from Augeas internal.h */
 struct memstream {
     FILE   *stream;
@@ -31,4 +31,14 @@ unless pkg_config("libxml-2.0")
     raise "libxml2-devel not installed"
 end
 
+have_func("rb_thread_call_without_gvl", "ruby/thread.h")
+have_func("aug_ns_path", "augeas.h")
+have_func("aug_load_file", "augeas.h")
+have_struct_member("struct stat", "st_mtim", "sys/stat.h")
+have_header("pthread.h")
+have_func("rb_enc_interned_str", "ruby/encoding.h")
+have_func("fopencookie", "stdio.h") or have_func("funopen", "stdio.h")
+have_func("rb_fiber_scheduler_current", "ruby/fiber/scheduler.h")
+have_func("rb_ext_ractor_safe", "ruby.h")
+
 create_makefile(extension_name)
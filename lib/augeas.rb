@@ -21,13 +21,25 @@
 ##
 
 require "_augeas"
+require "augeas/journal"
+require "augeas/instrument"
 require "augeas/facade"
+require "augeas/batch"
+require "augeas/tree_cache"
+require "augeas/resident"
 
 # Wrapper class for the augeas[http://augeas.net] library.
 class Augeas
+    include Augeas::Journal::Recording
+    include Augeas::Instrument::Handle
+
     private_class_method :new
 
-    class Error < RuntimeError; end
+    class Error < RuntimeError
+        # The position of the operation that failed when the error was
+        # raised by +apply+, +nil+ otherwise
+        attr_reader :index
+    end
 	class NoMemoryError           < Error; end
 	class InternalError           < Error; end
 	class InvalidPathError        < Error; end
@@ -58,6 +70,8 @@ class Augeas
 		:EBADARG   => InvalidArgumentError,
 		:ELABEL    => InvalidLabelError,
 	}.map { |k, v| [(const_get(k) rescue nil), v] }].freeze
+	# The extension looks this up from whichever Ractor an error happens in
+	Ractor.make_shareable(ERRORS_HASH) if defined?(Ractor)
 
     # Create a new Augeas instance and return it.
 	#
@@ -83,6 +97,14 @@ class Augeas
 	#
 	# :enable_span - track the span in the input nodes
 	#
+	# :tree_budget - a Hash with the <tt>:bytes</tt> and/or <tt>:nodes</tt>
+	# the tree may take up; see #tree_budget=
+	#
+	# :lenses - compile and load only these lenses instead of autoloading
+	# every module: a Hash of lenses and the glob(s) of the files for each,
+	# or an Array of lenses to load the +:files+ with, where each file gets
+	# the first lens that parses it; see Augeas::Facade::create
+	#
 	# :save_mode can be one of :backup, :newfile, :noop as explained below.
 	#
 	#   :noop - make save a no-op process, just record what would have changed
@@ -99,6 +121,30 @@ class Augeas
       Augeas::Facade::create(opts, &block)
     end
 
+    # Open and load one Augeas instance for each of +roots+ in parallel.
+    # Initialising and loading happens on a pool of native threads that
+    # run without the GVL; its size is <tt>:concurrency</tt>, by default
+    # the number of processors. The other options are those of ::create,
+    # except for +:root+ and +:tree_cache+.
+    #
+    # Returns an array with an instance for each root, in the order of
+    # +roots+; for a root that could not be opened, the array contains
+    # the exception instead.
+    def self.load_many(roots, opts={})
+      Augeas::Facade::create_many(roots, opts)
+    end
+
+    # Return a hash mapping the name of each method that was called
+    # through a handle with instrumentation turned on, see #instrument, to
+    # a hash with the number of +:calls+, the number of +:errors+, the
+    # +:total_ns+ and +:max_ns+ spent in libaugeas, and a +:histogram+ of
+    # the durations whose entry +i+ counts the calls that took at least
+    # 2**(i-1) but less than 2**i ns. If +reset+ is true, start counting
+    # from scratch afterwards.
+    def self.instrument_stats(reset = false)
+      Augeas::Instrument.stats(reset)
+    end
+
     # Create a new Augeas instance and return it.
     #
     # Use +root+ as the filesystem root. If +root+ is +nil+, use the value
@@ -200,6 +246,30 @@ class Augeas
         raise Augeas::Error unless load
     end
 
+    # Drop the trees of the loaded files whose names match the glob
+    # pattern +glob+, like "/etc/ssh/*", to free the memory they take up.
+    # Files with unsaved changes are kept, and after changes that can not
+    # be traced to a file, like those of +srun+, all files are kept until
+    # the next +save+ or +load+. An unloaded file is parsed again
+    # by the first call whose path may lead into it, see +restore+.
+    #
+    # Returns the names of the files that were unloaded.
+    def unload(glob)
+        Augeas::Resident.wrap(self)
+        augeas_unload(glob)
+    end
+
+    # Keep the tree within +budget+, a Hash with the number of
+    # <tt>:bytes</tt> and/or <tt>:nodes</tt> it may take up, by unloading
+    # the files that were used least recently whenever a load goes over
+    # it; see +unload+. Files with unsaved changes are never unloaded.
+    # The size of a file is estimated when it is loaded. A +nil+ budget
+    # turns this off.
+    def tree_budget=(budget)
+        Augeas::Resident.wrap(self) unless budget.nil?
+        self.augeas_tree_budget = budget
+    end
+
     # Set path expression context to +path+ (in /augeas/context)
     def context=(path)
       set_internal('/augeas/context', path)
@@ -211,3 +281,5 @@ class Augeas
     end
 
 end
+
+require "augeas/pool"
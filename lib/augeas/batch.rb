@@ -0,0 +1,78 @@
+##
+#  batch.rb: Collect operations for Augeas#apply
+#
+#  This library is free software; you can redistribute it and/or
+#  modify it under the terms of the GNU Lesser General Public
+#  License as published by the Free Software Foundation; either
+#  version 2.1 of the License, or (at your option) any later version.
+#
+#  This library is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#  Lesser General Public License for more details.
+#
+#  You should have received a copy of the GNU Lesser General Public
+#  License along with this library; if not, write to the Free Software
+#  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+##
+
+# Do not require this file explicitly; instead require "augeas"
+
+# Records calls to the mutating methods of Augeas as a list of operations
+# that Augeas#apply and Augeas::Facade#apply run in one go. See
+# Augeas::Facade#batch
+class Augeas::Batch
+  # The operations recorded so far, in the format that +apply+ expects
+  attr_reader :ops
+
+  def initialize
+    @ops = []
+  end
+
+  # Set one or multiple elements to path.
+  def set(path, *values)
+    values.flatten.each { |v| @ops << [:set, path, v] }
+    self
+  end
+
+  # Set multiple nodes in one operation, see Augeas#setm
+  def setm(base, sub, value)
+    @ops << [:setm, base, sub, value]
+    self
+  end
+
+  # Remove all nodes matching +path+ and their children
+  def rm(path)
+    @ops << [:rm, path]
+    self
+  end
+
+  # Move node +src+ to +dst+
+  def mv(src, dst)
+    @ops << [:mv, src, dst]
+    self
+  end
+
+  # Insert +label+ before or after +path+
+  def insert(path, label, before)
+    @ops << [:insert, path, label, before]
+    self
+  end
+
+  # Rename the label of all nodes matching +path+ to +label+
+  def rename(path, label)
+    @ops << [:rename, path, label]
+    self
+  end
+
+  # Clear the +path+, i.e. make its value +nil+
+  def clear(path)
+    @ops << [:clear, path]
+    self
+  end
+
+  # Clear the values of multiple nodes, see Augeas#clearm
+  def clearm(base, sub)
+    setm(base, sub, nil)
+  end
+end
@@ -26,11 +26,110 @@
 
 # Do not require this file explicitly; instead require "augeas"
 
+require 'etc'
+
 # Wrapper class for the augeas[http://augeas.net] library.
 class Augeas::Facade
+  include Augeas::Journal::Recording
+  include Augeas::Instrument::Handle
+
   private_class_method :new
 
+  # Create a new Augeas handle. Besides the flags, +opts+ can contain
+  # <tt>:root</tt>, <tt>:loadpath</tt> and <tt>:save_mode</tt>,
+  # <tt>:tree_cache</tt> with a directory in which the trees of parsed
+  # files are kept between runs, see Augeas::TreeCache,
+  # <tt>:match_cache</tt> to enable the match cache, see #match_cache=,
+  # <tt>:interned_strings</tt> to get frozen, deduplicated strings
+  # back, see #interned_strings=, <tt>:tree_budget</tt> to bound the
+  # size of the tree, see #tree_budget=, and <tt>:lenses</tt> and
+  # <tt>:files</tt> to start up with only some lenses and files.
+  #
+  # With <tt>:lenses</tt>, modules are not autoloaded: only the named
+  # lenses are compiled, and only the files given for them are loaded.
+  # <tt>:lenses</tt> is either a Hash mapping each lens to the glob
+  # pattern(s) of its files, or an Array of lenses together with an Array
+  # of <tt>:files</tt>. A lens is given by module name like "Hosts", or in
+  # full like "Hosts.lns".
+  #
+  #   Augeas::Facade::create(:lenses => { "Hosts" => "/etc/hosts",
+  #                                       "Sshd" => "/etc/ssh/sshd_config" })
+  #
+  # Prefer the Hash: with an Array, each file is loaded with the first lens
+  # in the Array that can parse it, so that the order of the lenses decides
+  # which lens a file gets, and a lenient lens early in the Array takes
+  # the files meant for the lenses after it. Finding out which lens
+  # parses what also means loading the files once for each lens that
+  # leaves some of them unparsed, up to once per lens.
   def self.create(opts={}, &block)
+    aug_flags = flags(opts, [:root, :loadpath, :tree_cache, :match_cache,
+                             :interned_strings, :tree_budget, :lenses,
+                             :files])
+    lenses = check_lenses(opts)
+
+    # With a tree cache, the initial load is done by Augeas::TreeCache, and
+    # with lenses only once their transforms are in place
+    tree_cache = opts[:tree_cache] && !opts[:no_load]
+    aug_flags |= Augeas::NO_LOAD if tree_cache || lenses
+    aug_flags |= Augeas::NO_MODL_AUTOLOAD if lenses
+
+    aug = Augeas::Facade::open3(opts[:root], opts[:loadpath], aug_flags)
+    if tree_cache || lenses
+      begin
+        load_lenses(aug, lenses, opts[:files]) if lenses
+        if tree_cache
+          cache = Augeas::TreeCache.new(opts[:tree_cache])
+          cache.load(aug)
+          aug.instance_variable_set(:@augeas_tree_cache, cache)
+        elsif !opts[:no_load]
+          aug.load
+        end
+      rescue Exception
+        aug.close
+        raise
+      end
+    end
+    aug.match_cache = true if opts[:match_cache]
+    aug.interned_strings = true if opts[:interned_strings]
+    aug.tree_budget = opts[:tree_budget] if opts[:tree_budget]
+
+    if block_given?
+      begin
+        yield aug
+      ensure
+        aug.close
+      end
+    else
+      return aug
+    end
+  end
+
+  # Open and load a handle for each of +roots+ in parallel, using up to
+  # <tt>:concurrency</tt> native threads, by default one per processor.
+  # The other options in +opts+ are those of ::create, except for
+  # <tt>:root</tt> and <tt>:tree_cache</tt>.
+  #
+  # Returns an array with the handle for each root, in the same order as
+  # +roots+, or with the exception that opening that root raised.
+  def self.create_many(roots, opts={})
+    aug_flags = flags(opts, [:loadpath, :match_cache, :interned_strings,
+                             :tree_budget, :concurrency])
+    concurrency = opts[:concurrency] || Etc.nprocessors
+
+    handles = Augeas::Facade::open_many(roots, opts[:loadpath], aug_flags,
+                                        concurrency)
+    handles.each do |aug|
+      next if aug.is_a?(Exception)
+      aug.match_cache = true if opts[:match_cache]
+      aug.interned_strings = true if opts[:interned_strings]
+      aug.tree_budget = opts[:tree_budget] if opts[:tree_budget]
+    end
+    handles
+  end
+
+  # Compute the flags for aug_init from the options +opts+ to ::create,
+  # which may also contain the keys in +extra+
+  def self.flags(opts, extra)
     # aug_flags is a bitmask in the underlying library, we add all the
     # values of the flags which were set to true to the default value
     # Augeas::NONE (which is 0)
@@ -57,72 +156,83 @@ class Augeas::Facade
         else
           raise ArgumentError, "Invalid save mode #{opts[:save_mode]}."
         end
-      elsif key != :root && key != :loadpath
+      elsif !extra.include?(key)
         raise ArgumentError, "Unknown argument #{key}."
       end
     end
-
-    aug = Augeas::Facade::open3(opts[:root], opts[:loadpath], aug_flags)
-
-    begin
-      aug.send(:raise_last_error)
-    rescue
-      aug.close
-      raise
+    aug_flags
+  end
+  private_class_method :flags
+
+  # Check the <tt>:lenses</tt> and <tt>:files</tt> options to ::create and
+  # return the lenses, if any
+  def self.check_lenses(opts)
+    lenses = opts[:lenses]
+    files = opts[:files]
+    if lenses.nil?
+      raise ArgumentError, "No :lenses to load :files with" if files
+    elsif lenses.is_a?(Hash)
+      raise ArgumentError, "Give the files of each lens in :lenses, not in :files" if files
+    elsif !lenses.is_a?(Array)
+      raise ArgumentError, ":lenses must be an Array or a Hash"
+    elsif !files.is_a?(Array)
+      raise ArgumentError, "No :files to load with :lenses"
+    elsif opts[:no_load] && lenses.size > 1
+      raise ArgumentError, "With :no_load, :lenses must be a Hash of lenses and their files"
+    end
+    lenses
+  end
+  private_class_method :check_lenses
+
+  # Add a transform to +aug+ for each of +lenses+. When several lenses
+  # share the +files+, they are tried in order: each lens loads the files
+  # that the lenses before it failed to parse, and keeps those it parsed.
+  # That takes one load for every lens but the last that is tried, and
+  # the first lens that parses a file wins, even if a later one would
+  # have been the right one for it.
+  def self.load_lenses(aug, lenses, files)
+    if lenses.is_a?(Hash)
+      lenses.each { |lens, incl| aug.transform(:lens => lens_name(lens), :incl => incl) }
+      return
     end
 
-    if block_given?
-      begin
-        yield aug
-      ensure
-        aug.close
+    remaining = files.map(&:to_s)
+    lenses.each_with_index do |lens, i|
+      break if remaining.empty?
+      lens = lens_name(lens)
+      name = lens.split(".")[0]
+      incl = remaining.map { |f| f.gsub(/[\\*?\[\]]/) { |c| "\\#{c}" } }
+      aug.transform(:lens => lens, :name => name, :incl => incl)
+      break if lenses.size == 1
+      aug.load
+
+      failed = remaining.select { |f| aug.exists("/augeas/files#{f}/error") }
+      # The last lens keeps the files nobody could parse, and their errors
+      if i < lenses.size - 1 && !failed.empty?
+        xfm = "/augeas/load/#{name}"
+        aug.rm("#{xfm}/incl")
+        remaining.each_with_index do |f, j|
+          aug.set("#{xfm}/incl[last()+1]", incl[j]) unless failed.include?(f)
+        end
+        aug.rm(xfm) if failed.size == remaining.size
       end
-    else
-      return aug
+      remaining = failed
     end
   end
+  private_class_method :load_lenses
 
-  # Get the value associated with +path+.
-  def get(path)
-    run_command :augeas_get, path
-  end
-
-  # Return true if there is an entry for this path, false otherwise
-  def exists(path)
-    run_command :augeas_exists, path
+  # The lens +lens+, which may be given by the name of its module
+  def self.lens_name(lens)
+    lens = lens.to_s
+    lens.include?(".") ? lens : "#{lens}.lns"
   end
+  private_class_method :lens_name
 
   # Set one or multiple elements to path.
   # Multiple elements are mainly sensible with a path like
   # .../array[last()+1], since this will append all elements.
   def set(path, *values)
-    values.flatten.each { |v| run_command :augeas_set, path, v }
-  end
-
-  # Set multiple nodes in one operation.  Find or create a node matching SUB
-  # by interpreting SUB as a  path expression relative to each node matching
-  # BASE. If SUB is '.', the nodes matching BASE will be modified.
-
-  # +base+    the base node
-  # +sub+     the subtree relative to the base
-  # +value+   the value for the nodes
-  def setm(base, sub, value)
-    run_command :augeas_setm, base, sub, value
-  end
-
-  # Remove all nodes matching path expression +path+ and all their
-  # children.
-  # Raises an <tt>Augeas::InvalidPathError</tt> when the +path+ is invalid.
-  def rm(path)
-    run_command :augeas_rm, path
-  end
-
-  # Return an Array of all the paths that match the path expression +path+
-  #
-  # Returns an empty Array if no paths were found.
-  # Raises an <tt>Augeas::InvalidPathError</tt> when the +path+ is invalid.
-  def match(path)
-    run_command :augeas_match, path
+    values.flatten.each { |v| augeas_set(path, v) }
   end
 
   # Create the +path+ with empty value if it doesn't exist
@@ -130,22 +240,6 @@ class Augeas::Facade
     set(path, nil) if match(path).empty?
   end
 
-  # Evaluate +expr+ and set the variable +name+ to the resulting
-  # nodeset. The variable can be used in path expressions as $name.
-  # Note that +expr+ is evaluated when the variable is defined, not when
-  # it is used.
-  def defvar(name, expr)
-    run_command :augeas_defvar, name, expr
-  end
-
-  # Define the variable +name+ to the result of evaluating +expr+, which
-  # must be a nodeset.  If no node matching +expr+ exists yet, one is
-  # created and +name+ will refer to it.  When a node is created and
-  # +value+ is given, the new node's value is set to +value+.
-  def defnode(name, expr, value=nil)
-    run_command :augeas_defnode, name, expr, value
-  end
-
   # Clear the +path+, i.e. make its value +nil+
   def clear(path)
     augeas_set(path, nil)
@@ -184,15 +278,22 @@ class Augeas::Facade
 
   # Write all pending changes to disk.
   # Raises <tt>Augeas::CommandExecutionError</tt> if saving fails.
-  def save
+  #
+  # With <tt>:return_changed => true</tt>, return the names of the files
+  # that were written, relative to the root, like "/etc/hosts"
+  def save(opts = {})
+    opts.each_key do |key|
+      raise ArgumentError, "Unknown argument #{key}." unless key == :return_changed
+    end
+
     begin
-      run_command :augeas_save
+      changed = augeas_save(:return_changed => !!opts[:return_changed])
     rescue Augeas::CommandExecutionError => e
       raise e, 'Saving failed. Search the augeas tree in /augeas//error ' <<
         'for the actual errors.'
     end
 
-    nil
+    opts[:return_changed] ? changed : nil
   end
 
   def clearm(path, sub)
@@ -209,7 +310,7 @@ class Augeas::Facade
   # file can be processed by multiple transforms.
   def load
     begin
-      run_command :augeas_load
+      augeas_load
     rescue Augeas::CommandExecutionError => e
       raise e, "Loading failed. Search the augeas tree in /augeas//error"+
         "for the actual errors."
@@ -218,71 +319,45 @@ class Augeas::Facade
     nil
   end
 
-  # Move node +src+ to +dst+. +src+ must match exactly one node in
-  # the tree. +dst+ must either match exactly one node in the tree,
-  # or may not exist yet. If +dst+ exists already, it and all its
-  # descendants are deleted. If +dst+ does not exist yet, it and all
-  # its missing ancestors are created.
+  # Record the changes that the block makes to the Augeas::Batch passed
+  # to it and apply them in a single call; see +apply+.
   #
-  # Raises <tt>Augeas::NoMatchError</tt> if the +src+ node does not exist
-  # Raises <tt>Augeas::MultipleMatchesError</tt> if there were
-  # multiple matches in +src+
-  # Raises <tt>Augeas::DescendantError</tt> if the +dst+ node is a
-  # descendant of the +src+ node.
-  def mv(src, dst)
-    run_command :augeas_mv, src, dst
-  end
-
-  # Get the filename, label and value position in the text of this node
+  # If +:rollback+ is true and one of the changes fails, the files that
+  # were changed are loaded again from disk before the error is raised.
   #
-  # Raises <tt>Augeas::NoMatchError</tt> if the node could not be found
-  # Raises <tt>Augeas::NoSpanInfo</tt> if the node associated with
-  # +path+ doesn't belong to a file or doesn't exist
-  def span(path)
-    run_command :augeas_span, path
-  end
-
-  # Run one or more newline-separated commands specified by +text+,
-  # returns an array of [successful_commands_number, output] or
-  # [-2, output] in case 'quit' command has been encountered.
-  # Raises <tt>Augeas::CommandExecutionError</tt> if gets an invalid command
-  def srun(text)
-    run_command(:augeas_srun, text)
-  end
-
-  # Lookup the label associated with +path+
-  # Raises <tt>Augeas::NoMatchError</tt> if the +path+ node does not exist
-  def label(path)
-    run_command :augeas_label, path
-  end
-
-  # Rename the label of all nodes matching +path+ to +label+
-  # Raises <tt>Augeas::NoMatchError</tt> if the +path+ node does not exist
-  # Raises <tt>Augeas::InvalidLabelError</tt> if +label+ is invalid
-  def rename(path, label)
-    run_command :augeas_rename, path, label
+  # Returns the number of operations applied.
+  def batch(opts={})
+    opts.each_key do |key|
+      raise ArgumentError, "Unknown argument #{key}." unless key == :rollback
+    end
+    b = Augeas::Batch.new
+    yield b
+    apply(b.ops, opts[:rollback])
   end
 
-  # Use the value of node +node+ as a string and transform it into a tree
-  # using the lens +lens+ and store it in the tree at +path+,
-  # which will be overwritten. +path+ and +node+ are path expressions.
-  def text_store(lens, node, path)
-    run_command :augeas_text_store, lens, node, path
+  # Return how many files the <tt>:tree_cache</tt> of ::create took from
+  # the cache as <tt>:hits</tt>, and how many it had Augeas parse as
+  # <tt>:misses</tt>, or +nil+ if the handle was created without one
+  def tree_cache_stats
+    cache = @augeas_tree_cache
+    cache && { :hits => cache.hits, :misses => cache.misses }
   end
 
-  # Transform the tree at +path+ into a string lens +lens+ and store it
-  # in the node +node_out+, assuming the tree was initially generated using
-  # the value of node +node_in+. +path+, +node_in+ and +node_out+ are path expressions.
-  def text_retrieve(lens, node_in, path, node_out)
-    run_command :augeas_text_retrieve, lens, node_in, path, node_out
+  # Drop the trees of the loaded files whose names match the glob pattern
+  # +glob+, see Augeas#unload. Returns the names of the files that were
+  # unloaded.
+  def unload(glob)
+    Augeas::Resident.wrap(self)
+    augeas_unload(glob)
   end
 
-  # Make +label+ a sibling of +path+ by inserting it directly before
-  # or after +path+.
-  # The boolean +before+ determines if +label+ is inserted before or
-  # after +path+.
-  def insert(path, label, before)
-    run_command :augeas_insert, path, label, before
+  # Keep the tree within +budget+, a Hash with the number of
+  # <tt>:bytes</tt> and/or <tt>:nodes</tt> it may take up, by unloading
+  # the files used least recently; see Augeas#tree_budget=. A +nil+
+  # budget turns this off.
+  def tree_budget=(budget)
+    Augeas::Resident.wrap(self) unless budget.nil?
+    self.augeas_tree_budget = budget
   end
 
   # Set path expression context to +path+ (in /augeas/context)
@@ -294,33 +369,4 @@ class Augeas::Facade
   def context
     get('/augeas/context')
   end
-
-  private
-
-  # Run a command and raise any errors that happen due to execution.
-  #
-  # +cmd+ name of the Augeas command to run
-  # +params+ parameters with which +cmd+ will be called
-  #
-  # Returns whatever the original +cmd+ returns
-  def run_command(cmd, *params)
-    result = self.send cmd, *params
-
-    raise_last_error
-
-    if result.kind_of? Integer and result < 0
-      # we raise CommandExecutionError here, because this is the error that
-      # augtool raises in this case as well
-      raise Augeas::CommandExecutionError, "Command failed. Return code was #{result}."
-    end
-
-    return result
-  end
-
-  def raise_last_error
-    error_cache = error
-    unless error_cache[:code].zero?
-      raise Augeas::ERRORS_HASH[error_cache[:code]], "#{error_cache[:message]} #{error_cache[:details]}"
-    end
-  end
 end
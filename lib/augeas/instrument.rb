@@ -0,0 +1,159 @@
+##
+#  instrument.rb: Timing of the calls into libaugeas
+#
+#  This library is free software; you can redistribute it and/or
+#  modify it under the terms of the GNU Lesser General Public
+#  License as published by the Free Software Foundation; either
+#  version 2.1 of the License, or (at your option) any later version.
+#
+#  This library is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#  Lesser General Public License for more details.
+#
+#  You should have received a copy of the GNU Lesser General Public
+#  License along with this library; if not, write to the Free Software
+#  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+##
+
+# Do not require this file explicitly; instead require "augeas"
+
+# Counts and times the calls made through Augeas and Augeas::Facade
+# handles that have instrumentation turned on; see Augeas#instrument.
+#
+# The time of a call is the time spent inside libaugeas, as measured by
+# the native extension with a monotonic clock; it does not include time
+# spent waiting for another thread to release the handle. Only the
+# handles that are instrumented are wrapped: the wrappers are defined in
+# a module prepended to the singleton class of the handle when it is
+# instrumented, and removed again when it is not anymore, so that other
+# handles keep calling the bindings directly.
+module Augeas::Instrument
+  # The methods that are counted and timed
+  METHODS = [:get, :exists, :set, :setm, :insert, :mv, :rm, :match,
+             :each_match, :get_all, :save, :load, :load_file, :refresh,
+             :defvar, :defnode, :span, :spans, :srun, :label, :rename,
+             :text_store, :text_retrieve, :parse, :render, :apply, :replay,
+             :import, :tree, :to_xml, :stats, :unload, :restore,
+             :close].freeze
+
+  # The methods to turn instrumentation of a handle on and off, included
+  # into Augeas and Augeas::Facade
+  module Handle
+    # Turn on instrumentation of the calls made through this handle. Each
+    # call is counted and timed, see Augeas::instrument_stats. If a block
+    # is given, it is called after each call as
+    #
+    #   block.call(event, method, args, duration_ns, error_code)
+    #
+    # where +event+ is +:call+, or +:error+ if the call raised, and
+    # +duration_ns+ is the time spent in libaugeas. The block runs in the
+    # thread that made the call.
+    def instrument(&hook)
+      Augeas::Instrument.enable(self, hook)
+    end
+
+    # Turn off instrumentation of this handle and forget the block passed
+    # to +instrument+
+    def uninstrument
+      Augeas::Instrument.disable(self)
+    end
+
+    # Whether the calls made through this handle are instrumented
+    def instrumented?
+      !@augeas_instrument.nil?
+    end
+  end
+
+  # Statistics live in the main Ractor; handles can not be instrumented in
+  # other Ractors
+  @lock = Mutex.new
+  @stats = {}
+
+  def self.enable(aug, hook)
+    @lock.synchronize do
+      wrap(aug) if aug.instance_variable_get(:@augeas_instrument).nil?
+      aug.instance_variable_set(:@augeas_instrument, hook || false)
+      aug.augeas_instrumenting = true
+    end
+  end
+
+  def self.disable(aug)
+    @lock.synchronize do
+      return if aug.instance_variable_get(:@augeas_instrument).nil?
+      aug.augeas_instrumenting = false
+      aug.instance_variable_set(:@augeas_instrument, nil)
+      unwrap(aug)
+    end
+  end
+
+  # Return the statistics per method, and clear them if +reset+ is true
+  def self.stats(reset)
+    @lock.synchronize do
+      result = {}
+      @stats.each do |name, s|
+        result[name] = s.merge(:histogram => s[:histogram].dup)
+      end
+      @stats = {} if reset
+      result
+    end
+  end
+
+  # Account for the call of +name+ with +args+ on +aug+; +start+ is what
+  # <tt>aug.augeas_instrument</tt> returned before the call, and +hook+
+  # the block passed to Augeas#instrument, if any
+  def self.record(aug, hook, name, args, start, failed)
+    ns, code = aug.augeas_instrument
+    ns -= start[0]
+    @lock.synchronize do
+      s = (@stats[name] ||= { :calls => 0, :errors => 0, :total_ns => 0,
+                              :max_ns => 0, :histogram => [] })
+      s[:calls] += 1
+      s[:errors] += 1 if failed || code != Augeas::NOERROR
+      s[:total_ns] += ns
+      s[:max_ns] = ns if ns > s[:max_ns]
+      # Bucket i counts the calls that took 2**(i-1) up to 2**i ns
+      bucket = ns.bit_length
+      s[:histogram].fill(0, s[:histogram].size..bucket)
+      s[:histogram][bucket] += 1
+    end
+    hook.call(failed ? :error : :call, name, args, ns, code) if hook
+  end
+
+  # Define the wrappers in the module prepended to the singleton class of
+  # +aug+, adding that module the first time
+  def self.wrap(aug)
+    mod = aug.instance_variable_get(:@augeas_instrument_wrappers)
+    unless mod
+      mod = Module.new
+      aug.singleton_class.send(:prepend, mod)
+      aug.instance_variable_set(:@augeas_instrument_wrappers, mod)
+    end
+    METHODS.select { |m| aug.class.public_method_defined?(m) }.each do |name|
+      mod.send(:define_method, name) do |*args, &block|
+        hook = @augeas_instrument
+        return super(*args, &block) if hook.nil?
+        start = augeas_instrument
+        begin
+          result = super(*args, &block)
+        rescue Exception
+          Augeas::Instrument.record(self, hook, name, args, start, true)
+          raise
+        end
+        Augeas::Instrument.record(self, hook, name, args, start, false)
+        result
+      end
+      # Pass keywords like the io: of srun on as keywords
+      mod.send(:ruby2_keywords, name) if mod.respond_to?(:ruby2_keywords, true)
+    end
+  end
+  private_class_method :wrap
+
+  # Remove the wrappers, so that calls through +aug+ go straight to the
+  # bindings again
+  def self.unwrap(aug)
+    mod = aug.instance_variable_get(:@augeas_instrument_wrappers)
+    mod.instance_methods(false).each { |name| mod.send(:remove_method, name) }
+  end
+  private_class_method :unwrap
+end
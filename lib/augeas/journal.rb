@@ -0,0 +1,217 @@
+##
+#  journal.rb: Record changes to the tree and replay them elsewhere
+#
+#  This library is free software; you can redistribute it and/or
+#  modify it under the terms of the GNU Lesser General Public
+#  License as published by the Free Software Foundation; either
+#  version 2.1 of the License, or (at your option) any later version.
+#
+#  This library is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#  Lesser General Public License for more details.
+#
+#  You should have received a copy of the GNU Lesser General Public
+#  License along with this library; if not, write to the Free Software
+#  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+##
+
+# Do not require this file explicitly; instead require "augeas"
+
+require 'json'
+
+# The changes made through a handle while it was recording, see
+# Augeas#record. Each entry is an operation in the format of Augeas#apply,
+# so that a journal can be passed to +apply+ or +replay+ as it is.
+class Augeas::Journal
+  include Enumerable
+
+  # The recorded operations
+  attr_reader :ops
+
+  def initialize(ops = [])
+    @ops = ops
+  end
+
+  def each(&block)
+    @ops.each(&block)
+  end
+
+  def size
+    @ops.size
+  end
+
+  def to_ary
+    @ops
+  end
+
+  # Return the journal as a JSON string
+  def dump
+    JSON.generate(@ops)
+  end
+
+  # Turn a string produced by #dump back into a journal
+  def self.load(str)
+    new(JSON.parse(str).map { |name, *args| [name.to_sym, *args] })
+  end
+
+  # The methods that Augeas and Augeas::Facade use to start and stop
+  # recording into a journal
+  module Recording
+    # Start recording the changes made through this handle with +set+,
+    # +setm+, +rm+, +mv+, +insert+, +rename+, +clear+, +touch+, +defnode+,
+    # +apply+ and +import+ into an Augeas::Journal, which +replay+ applies
+    # to other handles. Calls that fail are not recorded.
+    #
+    # With a block, record the changes made while it runs and return the
+    # journal. Without one, return the journal, which keeps growing until
+    # +stop_recording+.
+    def record
+      raise RuntimeError, "Already recording" if recording?
+      Augeas::Journal::Recorder.wrap(self)
+      journal = @augeas_journal = Augeas::Journal.new
+      return journal unless block_given?
+      begin
+        yield self
+      ensure
+        @augeas_journal = nil
+      end
+      journal
+    end
+
+    # Stop recording and return the journal, or +nil+ if the handle was
+    # not recording
+    def stop_recording
+      journal = @augeas_journal
+      @augeas_journal = nil
+      journal
+    end
+
+    # Whether changes are being recorded, see +record+
+    def recording?
+      !@augeas_journal.nil?
+    end
+  end
+
+  # Records the calls of the methods that change the tree on handles that
+  # have a journal. The wrappers are only prepended to the singleton class
+  # of a handle once it starts recording, so that other handles keep
+  # calling the bindings directly.
+  module Recorder
+    # The methods that are recorded, and the operation a call turns into.
+    # +set_internal+ and +augeas_set+ are what +set+, +set!+ and
+    # +context=+ call for each value
+    OPS = {
+      :set_internal => :set, :augeas_set => :set, :setm => :setm,
+      :rm => :rm, :mv => :mv, :insert => :insert, :rename => :rename,
+      :clear => :clear, :touch => :touch, :defnode => :defnode
+    }.freeze
+
+    @lock = Mutex.new
+    # The module with the wrappers for the methods of each class
+    @wrappers = {}
+
+    # Wrap the methods of the handle +aug+; wrapping it again does nothing
+    def self.wrap(aug)
+      aug.singleton_class.send(:prepend, wrapper(aug.class))
+    end
+
+    def self.wrapper(klass)
+      @lock.synchronize do
+        @wrappers[klass] ||= build(klass)
+      end
+    end
+    private_class_method :wrapper
+
+    def self.build(klass)
+      names = OPS.keys.select { |m| klass.public_method_defined?(m) }
+      Module.new {
+        names.each do |name|
+          define_method(name) do |*args, &block|
+            journal = @augeas_journal
+            return super(*args, &block) if journal.nil? || @augeas_journal_busy
+            # Calls made by the method itself are part of this one
+            @augeas_journal_busy = true
+            begin
+              result = super(*args, &block)
+            ensure
+              @augeas_journal_busy = false
+            end
+            Recorder.add(journal, OPS[name], args, result)
+            result
+          end
+        end
+        define_method(:apply) do |ops, *rest|
+          journal = @augeas_journal
+          return super(ops, *rest) if journal.nil? || @augeas_journal_busy
+          @augeas_journal_busy = true
+          begin
+            n = super(ops, *rest)
+          ensure
+            @augeas_journal_busy = false
+          end
+          # After a failure with rollback, nothing was applied
+          applied = n < ops.size && rest.first ? 0 : n
+          ops.to_ary.first(applied).each do |name, *args|
+            Recorder.add(journal, name, args, true)
+          end
+          n
+        end
+        define_method(:import) do |path, tree, **opts|
+          journal = @augeas_journal
+          return super(path, tree, **opts) if journal.nil? || @augeas_journal_busy
+          @augeas_journal_busy = true
+          begin
+            n = super(path, tree, **opts)
+          ensure
+            @augeas_journal_busy = false
+          end
+          unless n < 0
+            Recorder.import_ops(path, tree, opts[:mode] == :replace).each do |name, *args|
+              Recorder.add(journal, name, args, true)
+            end
+          end
+          n
+        end
+      }
+    end
+    private_class_method :build
+
+    # The operations that have the same effect as importing +tree+ into
+    # +path+, see Augeas#import
+    def self.import_ops(path, tree, replace)
+      ops = [[:touch, path]]
+      ops << [:rm, "#{path}/*"] if replace
+      import_nodes(ops, path, tree, replace)
+    end
+
+    def self.import_nodes(ops, parent, nodes, replace)
+      if nodes.is_a?(Hash)
+        nodes = nodes.map { |l, v| v.is_a?(Hash) ? [l.to_s, nil, v] : [l.to_s, v] }
+      end
+      seen = Hash.new(0)
+      nodes.each do |label, value, children|
+        path = "#{parent}/#{Augeas::escape_label(label)}"
+        if replace
+          ops << [:set, "#{path}[last()+1]", value && value.to_s]
+          path += "[last()]"
+        else
+          path += "[#{seen[label] += 1}]"
+          ops << [:set, path, value && value.to_s]
+        end
+        import_nodes(ops, path, children, replace) if children
+      end
+      ops
+    end
+
+    # Add the call of the operation +name+ with +args+ that returned
+    # +result+ to +journal+, unless it failed
+    def self.add(journal, name, args, result)
+      return if result == false || (result.is_a?(Integer) && result < 0)
+      args = args.map { |a| a.is_a?(String) ? a.dup.freeze : a }
+      # defnode may be called without a value
+      args << nil if name == :defnode && args.size == 2
+      journal.ops << [name, *args]
+    end
+  end
+end
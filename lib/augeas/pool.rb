@@ -0,0 +1,233 @@
+##
+#  pool.rb: A pool of ready-to-use Augeas handles
+#
+#  This library is free software; you can redistribute it and/or
+#  modify it under the terms of the GNU Lesser General Public
+#  License as published by the Free Software Foundation; either
+#  version 2.1 of the License, or (at your option) any later version.
+#
+#  This library is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#  Lesser General Public License for more details.
+#
+#  You should have received a copy of the GNU Lesser General Public
+#  License along with this library; if not, write to the Free Software
+#  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+##
+
+# Do not require this file explicitly; instead require "augeas"
+
+# A thread-safe pool of Augeas::Facade handles that are created up front,
+# so that the cost of compiling lenses and loading the tree is paid once
+# rather than for every unit of work.
+#
+#   pool = Augeas::Pool.new(:size => 4, :root => "/")
+#   pool.with { |aug| aug.get("/files/etc/hosts/1/ipaddr") }
+#
+# Handles are reset when they are checked back in: recording stops,
+# /augeas/context and all variables are removed, nodes outside of /augeas and /files are
+# deleted and unsaved changes to files are dropped by loading the files
+# that have them again.
+class Augeas::Pool
+  # Raised when no handle becomes available within the timeout
+  class TimeoutError < Augeas::Error; end
+
+  attr_reader :size
+
+  # Create a pool and all its handles.
+  #
+  # +opts+ can contain
+  # * <tt>:size</tt> - the number of handles, 5 by default
+  # * <tt>:timeout</tt> - how many seconds +checkout+ waits for a handle
+  #   by default; +nil+, the default, means waiting forever
+  # * any option accepted by Augeas::Facade::create, like <tt>:root</tt>,
+  #   <tt>:loadpath</tt> or <tt>:no_modl_autoload</tt>
+  def initialize(opts={})
+    opts = opts.dup
+    @size = opts.delete(:size) || 5
+    @timeout = opts.delete(:timeout)
+    @create_opts = opts
+    raise ArgumentError, "Invalid pool size #{@size}." unless @size > 0
+
+    @mutex = Mutex.new
+    @available = ConditionVariable.new
+    @checked_out = {}
+    @checkouts = 0
+    @timeouts = 0
+    @wait_time = 0.0
+    @max_wait_time = 0.0
+    @busy_time = 0.0
+    @created_at = now
+
+    # Handles are initialized without holding the GVL, so creating them
+    # from several threads overlaps the work of compiling lenses
+    threads = Array.new(@size) do
+      Thread.new do
+        Thread.current.report_on_exception = false
+        create_handle
+      end
+    end
+    @all = []
+    error = nil
+    threads.each do |t|
+      begin
+        @all << t.value
+      rescue Exception => e
+        error ||= e
+      end
+    end
+    if error
+      # Do not leak the handles that were created before the failure
+      @all.each { |aug| aug.close rescue nil }
+      raise error
+    end
+    @idle = @all.dup
+  end
+
+  # Take a handle out of the pool, waiting up to +timeout+ seconds for one
+  # to become available.
+  # Raises Augeas::Pool::TimeoutError if that does not happen in time.
+  def checkout(timeout = @timeout)
+    started = now
+    @mutex.synchronize do
+      raise Augeas::Error, "Pool has been closed." if @all.empty?
+      begin
+        while @idle.empty?
+          remaining = timeout && timeout - (now - started)
+          if remaining && remaining <= 0
+            @timeouts += 1
+            raise TimeoutError, "No Augeas handle available after #{timeout}s."
+          end
+          @available.wait(@mutex, remaining)
+        end
+      ensure
+        # Waits that time out count, too
+        waited = now - started
+        @wait_time += waited
+        @max_wait_time = waited if waited > @max_wait_time
+      end
+      @checkouts += 1
+      aug = @idle.pop
+      @checked_out[aug] = now
+      aug
+    end
+  end
+
+  # Reset +aug+ and return it to the pool
+  def checkin(aug)
+    since = @mutex.synchronize { @checked_out[aug] }
+    raise ArgumentError, "Handle does not belong to this pool." unless since
+
+    begin
+      reset(aug)
+    rescue StandardError
+      # Replace a handle that can not be reset, e.g. because it was
+      # closed, with a fresh one
+      fresh = create_handle
+      aug.close rescue nil
+    end
+
+    @mutex.synchronize do
+      @checked_out.delete(aug)
+      @busy_time += now - since
+      if fresh
+        i = @all.index(aug)
+        if i
+          @all[i] = fresh
+        else
+          # The pool was closed while the handle was checked out
+          fresh.close
+        end
+        aug = i && fresh
+      end
+      if aug
+        @idle.push(aug)
+        @available.signal
+      end
+    end
+    nil
+  end
+
+  # Check out a handle, pass it to the block and check it back in
+  # afterwards. Returns the value of the block.
+  def with(timeout = @timeout)
+    aug = checkout(timeout)
+    begin
+      yield aug
+    ensure
+      checkin(aug)
+    end
+  end
+
+  # Return a Hash of counters describing how the pool has been used:
+  # * <tt>:size</tt> - the number of handles
+  # * <tt>:in_use</tt> - the number of handles checked out right now
+  # * <tt>:checkouts</tt> - the number of successful checkouts
+  # * <tt>:timeouts</tt> - the number of checkouts that timed out
+  # * <tt>:wait_time</tt> - total seconds spent waiting in +checkout+
+  # * <tt>:max_wait_time</tt> - the longest wait in +checkout+, in seconds
+  # * <tt>:busy_time</tt> - total seconds handles spent checked out
+  # * <tt>:utilisation</tt> - the fraction of the pool's capacity that
+  #   was checked out since the pool was created
+  def stats
+    @mutex.synchronize do
+      t = now
+      busy = @busy_time + @checked_out.values.inject(0.0) { |sum, since| sum + t - since }
+      elapsed = t - @created_at
+      {
+        :size => @size,
+        :in_use => @checked_out.size,
+        :checkouts => @checkouts,
+        :timeouts => @timeouts,
+        :wait_time => @wait_time,
+        :max_wait_time => @max_wait_time,
+        :busy_time => busy,
+        :utilisation => elapsed > 0 ? busy / (elapsed * @size) : 0.0
+      }
+    end
+  end
+
+  # Close all handles in the pool. Handles that are checked out are
+  # closed, too, and must not be used anymore.
+  def close
+    @mutex.synchronize do
+      @all.each { |aug| aug.close }
+      @all.clear
+      @idle.clear
+      @checked_out.clear
+      @available.broadcast
+    end
+    nil
+  end
+
+  private
+
+  def create_handle
+    Augeas::Facade::create(@create_opts)
+  end
+
+  def reset(aug)
+    aug.stop_recording
+    aug.rm("/augeas/context")
+    aug.match("/augeas/variables/*").each do |var|
+      aug.defvar(aug.label(var), nil)
+    end
+    aug.rm("/*[label() != 'augeas' and label() != 'files']")
+    if @create_opts[:no_load]
+      aug.rm("/files/*")
+      aug.rm("/augeas/files/*")
+    elsif aug.dirty?
+      # Only parse the files with unsaved changes again; changes that can
+      # not be tied to a file keep the handle dirty and need a full load
+      if aug.respond_to?(:load_file)
+        aug.dirty_files.each { |file| aug.load_file(file) }
+      end
+      aug.load if aug.dirty?
+    end
+  end
+
+  def now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+end
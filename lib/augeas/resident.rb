@@ -0,0 +1,97 @@
+##
+#  resident.rb: Parse unloaded files again when they are needed
+#
+#  This library is free software; you can redistribute it and/or
+#  modify it under the terms of the GNU Lesser General Public
+#  License as published by the Free Software Foundation; either
+#  version 2.1 of the License, or (at your option) any later version.
+#
+#  This library is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#  Lesser General Public License for more details.
+#
+#  You should have received a copy of the GNU Lesser General Public
+#  License along with this library; if not, write to the Free Software
+#  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+##
+
+# Do not require this file explicitly; instead require "augeas"
+
+# Calls +restore+ with the paths passed to the methods of handles that
+# have unloaded files or a tree budget, so that unloaded files are parsed
+# again before a call needs them, and the tree budget knows which files
+# were used last. The wrappers are only prepended to the singleton class
+# of a handle once it unloads files or gets a tree budget, so that other
+# handles keep calling the bindings directly.
+module Augeas::Resident
+  # The methods that take path expressions, and the positions of those
+  # among their arguments; +nil+ for methods that may touch any file
+  PATHS = {
+    :get => [0], :exists => [0], :set_internal => [0], :augeas_set => [0],
+    :setm => [0], :insert => [0], :mv => [0, 1], :rm => [0],
+    :match => [0], :each_match => [0], :get_all => [0], :label => [0],
+    :rename => [0], :span => [0], :spans => [0], :tree => [0],
+    :to_xml => [0], :defvar => [1], :defnode => [1], :import => [0],
+    :text_store => [1, 2], :text_retrieve => [1, 2, 3], :srun => nil
+  }.freeze
+
+  # The positions of the path expressions among the arguments of the
+  # operations of +apply+ and +replay+
+  OP_PATHS = {
+    :set => [0], :setm => [0], :rm => [0], :mv => [0, 1], :insert => [0],
+    :rename => [0], :clear => [0], :touch => [0], :defnode => [1]
+  }.freeze
+
+  @lock = Mutex.new
+  # The module with the wrappers for the methods of each class
+  @wrappers = {}
+
+  # Wrap the methods of the handle +aug+; wrapping it again does nothing
+  def self.wrap(aug)
+    aug.singleton_class.send(:prepend, wrapper(aug.class))
+  end
+
+  def self.wrapper(klass)
+    @lock.synchronize do
+      @wrappers[klass] ||= build(klass)
+    end
+  end
+  private_class_method :wrapper
+
+  def self.build(klass)
+    names = PATHS.keys.select { |m| klass.public_method_defined?(m) }
+    batch = [:apply, :replay].select { |m| klass.public_method_defined?(m) }
+    Module.new {
+      names.each do |name|
+        positions = PATHS[name]
+        define_method(name) do |*args, &block|
+          if positions.nil?
+            restore
+          else
+            positions.each { |i| restore(args[i]) if args[i].is_a?(String) }
+          end
+          super(*args, &block)
+        end
+        # Pass keywords like the mode: of import on as keywords
+        ruby2_keywords(name) if respond_to?(:ruby2_keywords, true)
+      end
+      batch.each do |name|
+        define_method(name) do |ops, *rest|
+          Augeas::Resident.restore_ops(self, ops)
+          super(ops, *rest)
+        end
+      end
+    }
+  end
+  private_class_method :build
+
+  # Call +restore+ on +aug+ with the paths used by the operations +ops+
+  def self.restore_ops(aug, ops)
+    ops.to_ary.each do |name, *args|
+      (OP_PATHS[name.to_sym] || []).each do |i|
+        aug.restore(args[i]) if args[i].is_a?(String)
+      end
+    end
+  end
+end
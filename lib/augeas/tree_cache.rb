@@ -0,0 +1,180 @@
+##
+#  tree_cache.rb: Persistent cache of parsed file trees
+#
+#  This library is free software; you can redistribute it and/or
+#  modify it under the terms of the GNU Lesser General Public
+#  License as published by the Free Software Foundation; either
+#  version 2.1 of the License, or (at your option) any later version.
+#
+#  This library is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#  Lesser General Public License for more details.
+#
+#  You should have received a copy of the GNU Lesser General Public
+#  License along with this library; if not, write to the Free Software
+#  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+##
+
+# Do not require this file explicitly; instead require "augeas"
+
+require 'digest'
+require 'fileutils'
+
+# Loads the tree of an Augeas::Facade handle, taking the trees of files
+# that have not changed since they were last parsed from a cache
+# directory instead of running their lens again. Used by
+# Augeas::Facade::create when the <tt>:tree_cache</tt> option is given.
+#
+# A cache entry is only used if the path, inode, mtime and size of the
+# file, the lens that loads it and the Augeas version all match what they
+# were when the entry was written; otherwise the file is parsed as usual
+# and the entry rewritten.
+#
+# Trees restored from the cache are not parsed by Augeas itself, which
+# therefore considers them modified: +save+ renders them with their lens,
+# though files whose text does not change are not written, and +load+
+# parses them again. The bindings know better and do not count them as
+# unsaved changes, see Augeas::Facade#dirty?.
+class Augeas::TreeCache
+  # Bump when the format of cache entries changes
+  FORMAT = 1
+
+  attr_reader :dir, :hits, :misses
+
+  def initialize(dir)
+    @dir = dir
+    @hits = 0
+    @misses = 0
+  end
+
+  # Load the tree of +aug+ according to its transforms, like
+  # Augeas::Facade#load, using cached trees where possible
+  def load(aug)
+    FileUtils::mkdir_p(@dir)
+    root = aug.get("/augeas/root")
+    version = aug.get("/augeas/version")
+
+    hits = {}
+    misses = {}
+    transforms(aug, root).each do |xfm, lens, files|
+      files.each do |name|
+        key = cache_key(root, version, name, lens)
+        next unless key
+        tree = read_entry(name, root, key)
+        if tree
+          (hits[xfm] ||= []) << [name, tree]
+        else
+          misses[name] = key
+        end
+      end
+    end
+
+    # Keep Augeas from parsing the files we have in the cache
+    excl = {}
+    hits.each do |xfm, entries|
+      excl[xfm] = aug.match("#{xfm}/excl").size
+      entries.each do |name, _|
+        aug.set("#{xfm}/excl[last()+1]", name.gsub(/[\\*?\[\]]/) { |c| "\\#{c}" })
+      end
+    end
+    begin
+      aug.load
+    ensure
+      excl.each { |xfm, n| aug.rm("#{xfm}/excl[position() > #{n}]") }
+    end
+
+    hits.each_value do |entries|
+      entries.each do |name, tree|
+        # The metadata first, so that the tree is known to be this file's
+        restore(aug, "/augeas/files" + escape_path(name), tree[:meta])
+        restore(aug, "/files" + escape_path(name), tree[:files])
+        aug.augeas_forget_changes(name)
+      end
+    end
+
+    misses.each { |name, key| write_entry(aug, name, root, key) }
+
+    @hits += hits.values.inject(0) { |sum, entries| sum + entries.size }
+    @misses += misses.size
+    nil
+  end
+
+  private
+
+  # Return triples [xfm, lens, files] of the path of each transform under
+  # /augeas/load, its lens and the names of the files it would load
+  def transforms(aug, root)
+    aug.match("/augeas/load/*").map do |xfm|
+      lens = aug.get("#{xfm}/lens")
+      incl = aug.get_all("#{xfm}/incl").values.compact
+      excl = aug.get_all("#{xfm}/excl").values.compact
+      files = incl.map do |pattern|
+        Dir.glob(File::join(root, pattern)).select { |f| File.file?(f) }.map do |f|
+          "/" + f[root.size..-1].sub(%r{\A/+}, "")
+        end
+      end.flatten.uniq
+      files.reject! { |name| excl.any? { |pattern| excluded?(pattern, name) } }
+      [xfm, lens, files]
+    end
+  end
+
+  # Excludes without a '/' apply to the basename of files, as in Augeas
+  def excluded?(pattern, name)
+    name = File::basename(name) unless pattern.include?("/")
+    File::fnmatch(pattern, name, File::FNM_PATHNAME)
+  end
+
+  def cache_key(root, version, name, lens)
+    st = File::stat(File::join(root, name))
+    [FORMAT, version, root, name, lens, st.ino, st.mtime.to_i,
+     st.mtime.nsec, st.size]
+  rescue SystemCallError
+    nil
+  end
+
+  def entry_path(root, name)
+    File::join(@dir, Digest::SHA256.hexdigest(root + "\0" + name))
+  end
+
+  def read_entry(name, root, key)
+    entry = File.open(entry_path(root, name), "rb") { |f| Marshal.load(f) }
+    entry[:key] == key ? entry : nil
+  rescue StandardError
+    nil
+  end
+
+  def write_entry(aug, name, root, key)
+    fpath = "/files" + escape_path(name)
+    mpath = "/augeas/files" + escape_path(name)
+    return unless aug.match("#{mpath}/error").empty?
+    entry = { :key => key, :files => aug.tree(fpath), :meta => aug.tree(mpath) }
+    return if entry[:files].empty?
+
+    path = entry_path(root, name)
+    tmp = "#{path}.#{Process.pid}.tmp"
+    File.open(tmp, "wb") { |f| Marshal.dump(entry, f) }
+    File.rename(tmp, path)
+  rescue SystemCallError
+    File.unlink(tmp) rescue nil
+  end
+
+  # Create the node in +trees+, as returned by Augeas::Facade#tree, at
+  # +path+. Its descendants are created relative to their parents with
+  # Augeas::Facade#import rather than by resolving a full path for each
+  def restore(aug, path, trees)
+    trees.each do |label, value, children|
+      aug.import(path, children, mode: :replace)
+      aug.set(path, value) unless value.nil?
+    end
+  end
+
+  # Escape the characters that have a special meaning in path expressions
+  def escape(label)
+    Augeas::escape_label(label.to_s)
+  end
+
+  def escape_path(name)
+    name.split("/").reject { |s| s.empty? }.map { |s| "/" + escape(s) }.join
+  end
+end
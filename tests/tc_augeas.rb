@@ -129,6 +129,14 @@ class TestAugeas < Test::Unit::TestCase
         assert_raises(Augeas::Error) { aug.save! }
     end
 
+    def test_save_return_changed
+        aug = aug_open
+        aug.set("/files/etc/hosts/1/alias[last()+1]", "new")
+        assert_equal(["/etc/hosts"], aug.save(:return_changed => true))
+        assert_equal([], aug.save(:return_changed => true))
+        assert_equal(true, aug.save)
+    end
+
     def test_set!
         aug = aug_open
         assert_raises(Augeas::Error) { aug.set!("files/etc/hosts/*", nil) }
@@ -278,7 +286,231 @@ class TestAugeas < Test::Unit::TestCase
         end
     end
 
+    def test_get_all
+        aug = aug_open
+        aug.set("/foo/bar", "baz")
+        aug.set("/foo/baz", "qux")
+        aug.clear("/foo/qux")
+        assert_equal({ "/foo/bar" => "baz", "/foo/baz" => "qux",
+                       "/foo/qux" => nil }, aug.get_all("/foo/*"))
+        assert_equal({}, aug.get_all("/nonexistent"))
+        assert_raises(SystemCallError) { aug.get_all("//") }
+    end
+
+    def test_apply
+        aug = aug_open
+        assert_equal(2, aug.apply([[:set, "/foo", "1"], [:set, "/bar", "2"]]))
+        assert_equal("2", aug.get("/bar"))
+        ops = [[:set, "/foo", "3"], [:rm, "//"], [:set, "/bar", "4"]]
+        assert_equal(1, aug.apply(ops))
+        assert_equal("3", aug.get("/foo"))
+        assert_equal("2", aug.get("/bar"))
+    end
+
+    def test_tree
+        aug = aug_open
+        aug.set("/foo/a", "1")
+        aug.set("/foo/b/c", "2")
+        assert_equal([["foo", nil, [["a", "1", []],
+                                    ["b", nil, [["c", "2", []]]]]]],
+                     aug.tree("/foo"))
+        assert_match(/<node label="c"/, aug.to_xml("/foo"))
+        assert_nil(aug.tree("//"))
+    end
+
+    def test_each_match
+        aug = aug_open
+        expected = aug.match("/files/etc/hosts/*")
+        paths = []
+        assert_nil(aug.each_match("/files/etc/hosts/*") { |p| paths << p })
+        assert_equal(expected, paths)
+
+        first = nil
+        aug.each_match("/files/etc/hosts/*") { |p| first = p; break }
+        assert_equal(expected.first, first)
+
+        enum = aug.each_match("/files/etc/hosts/*")
+        assert_kind_of(Enumerator::Lazy, enum)
+        assert_equal(expected.take(2), enum.first(2))
+        assert_raise(SystemCallError) { aug.each_match("//") { } }
+    end
+
+    def test_match_cache
+        aug = aug_open
+        assert(!aug.match_cache?)
+        aug.match_cache = true
+        assert(aug.match_cache?)
+
+        expected = aug.match("/files/etc/hosts/*")
+        paths = aug.match("/files/etc/hosts/*")
+        assert_equal(expected, paths)
+        paths << "/scribble"
+        assert_equal(expected, aug.match("/files/etc/hosts/*"))
+        assert_equal({ :hits => 2, :misses => 1, :entries => 1 },
+                     aug.match_cache_stats)
+
+        aug.set("/files/etc/hosts/99/ipaddr", "10.0.0.1")
+        assert_equal(expected + ["/files/etc/hosts/99"],
+                     aug.match("/files/etc/hosts/*"))
+        assert_equal(2, aug.match_cache_stats[:misses])
+
+        aug.match_cache = false
+        assert_equal(0, aug.match_cache_stats[:entries])
+    end
+
+    def test_record_replay
+        aug = aug_open
+        journal = aug.record
+        assert(aug.recording?)
+        aug.set("/files/etc/hosts/1/alias[last()+1]", "a1")
+        assert_equal(false, aug.set_internal("/files/[", "x"))
+        aug.clearm("/files/etc/hosts/*", "canonical")
+        assert_same(journal, aug.stop_recording)
+        assert_equal([[:set, "/files/etc/hosts/1/alias[last()+1]", "a1"],
+                      [:setm, "/files/etc/hosts/*", "canonical", nil]],
+                     journal.ops)
+        aug.close
+
+        aug = aug_open
+        # Only handles that recorded something are wrapped
+        assert_equal(Augeas, aug.method(:set_internal).owner)
+        assert_equal([], aug.replay(journal))
+        assert_equal("a1", aug.get("/files/etc/hosts/1/alias[last()]"))
+        assert_nil(aug.get("/files/etc/hosts/2/canonical"))
+    end
+
+    def test_interned_strings
+        aug = aug_open
+        assert(!aug.interned_strings?)
+        value = aug.get("/files/etc/hosts/1/ipaddr")
+        assert(!value.frozen?)
+        assert_equal(Encoding::ASCII_8BIT, value.encoding)
+
+        aug.interned_strings = true
+        assert(aug.interned_strings?)
+        value = aug.get("/files/etc/hosts/1/ipaddr")
+        assert(value.frozen?)
+        assert_equal(Encoding::UTF_8, value.encoding)
+        assert_same(value, aug.get("/files/etc/hosts/1/ipaddr"))
+
+        labels = aug.match("/files/etc/hosts/*/ipaddr").map { |p| aug.label(p) }
+        assert(labels.size > 1)
+        assert_equal(1, labels.map(&:object_id).uniq.size)
+        assert(aug.match("/files/etc/hosts/*").all?(&:frozen?))
+        assert(aug.get_all("/files/etc/hosts/*/ipaddr").to_a.flatten.all?(&:frozen?))
+
+        label, _, children = aug.tree("/files/etc/hosts/1").first
+        assert_same(aug.label("/files/etc/hosts/1"), label)
+        assert_same(value, children.assoc("ipaddr")[1])
+    end
+
+    def test_stats
+        require 'objspace'
+        aug = aug_open
+        stats = aug.stats
+        assert(stats[:nodes] > stats[:files])
+        assert_equal(aug.match("/augeas/files//*[path]").size, stats[:files])
+        assert_equal(stats[:files], stats[:file_bytes].size)
+        assert(stats[:file_bytes]["/etc/hosts"] > 0)
+        assert(stats[:modules] > 0 && stats[:modules] <= stats[:files])
+        assert(stats[:bytes] > stats[:file_bytes].values.inject(:+))
+        assert(ObjectSpace.memsize_of(aug) >= stats[:bytes])
+    end
+
+    def test_escape_label
+        assert_equal("a\\ b\\[1\\]\\/c", Augeas::escape_label("a b[1]/c"))
+        aug = aug_open
+        aug.set("/test/#{Augeas::escape_label("x [y]")}", "1")
+        assert_equal(["x [y]"], aug.match("/test/*").map { |p| aug.label(p) })
+    end
+
+    def test_instrument
+        aug = aug_open
+        other = Augeas::open(TST_ROOT, nil, Augeas::NO_LOAD)
+        events = []
+        Augeas::instrument_stats(true)
+        aug.instrument { |*e| events << e }
+        assert(aug.instrumented?)
+        # Other handles are left alone
+        assert_equal(Augeas, other.method(:get).owner)
+        other.get("/augeas/root")
+        aug.get("/files/etc/hosts/1/ipaddr")
+        assert_raise(SystemCallError) { aug.match("//") }
+        aug.uninstrument
+        assert(!aug.instrumented?)
+        assert_equal(Augeas, aug.method(:get).owner)
+        aug.get("/files/etc/hosts/1/ipaddr")
+        other.close
+
+        assert_equal(2, events.size)
+        assert_equal([:call, :get, ["/files/etc/hosts/1/ipaddr"]], events[0][0, 3])
+        assert(events[0][3] > 0)
+        assert_equal(Augeas::NOERROR, events[0][4])
+        assert_equal([:error, :match, ["//"]], events[1][0, 3])
+        assert_equal(Augeas::EPATHX, events[1][4])
+
+        stats = Augeas::instrument_stats(true)
+        assert_equal(1, stats[:get][:calls])
+        assert_equal(1, stats[:get][:histogram].inject(:+))
+        assert_equal(1, stats[:match][:errors])
+        assert_equal({}, Augeas::instrument_stats)
+    ensure
+        aug.uninstrument if aug
+    end
+
+    def test_threads_run_during_load
+        aug = aug_open(Augeas::NO_LOAD)
+        ticks = 0
+        done = false
+        ticker = Thread.new { ticks += 1 until done }
+
+        # How fast the ticker ticks when nothing else runs
+        start, before = now, ticks
+        sleep(0.05)
+        rate = (ticks - before) / (now - start)
+
+        load_time = 0.0
+        load_ticks = 0
+        5.times do
+            start, before = now, ticks
+            assert(aug.load)
+            load_time += now - start
+            load_ticks += ticks - before
+        end
+        done = true
+        ticker.join
+        # If load held on to the GVL, the ticker could not tick at all
+        # while it runs
+        assert(load_ticks > 0.1 * rate * load_time,
+               "#{load_ticks} ticks in #{load_time}s of loading, " +
+               "#{rate.round} per second without")
+        assert_equal(["/files/etc/group", "/files/etc/hosts",
+                      "/files/etc/inittab", "/files/etc/ssh"],
+                     aug.match("/files/etc/*").sort)
+    end
+
+    def test_shared_handle_across_threads
+        aug = aug_open
+        threads = (1..4).map do |i|
+            Thread.new do
+                25.times do |j|
+                    aug.set("/test/t#{i}", j.to_s)
+                    assert_equal(j.to_s, aug.get("/test/t#{i}"))
+                    assert_equal(4, aug.match("/files/etc/*").size)
+                    assert(aug.load) if i == 1
+                end
+            end
+        end
+        threads.each { |t| t.join }
+        assert_equal(["/test/t1", "/test/t2", "/test/t3", "/test/t4"],
+                     aug.match("/test/*"))
+    end
+
     private
+    def now
+        Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+
     def aug_open(flags = Augeas::NONE)
         if File::directory?(TST_ROOT)
             FileUtils::rm_rf(TST_ROOT)
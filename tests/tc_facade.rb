@@ -158,6 +158,159 @@ class TestAugeasFacade < Test::Unit::TestCase
 		assert_equal "Can not find lens bad_lens", aug.get("/augeas/load/bad_lens/error")
 	end
 
+	def test_load_file
+		aug = aug_create(:no_load => true)
+		omit_unless(aug.respond_to?(:load_file), "aug_load_file is not available")
+		aug.load_file("/etc/hosts")
+		assert_equal(["/files/etc/hosts"], aug.match("/files/etc/*"))
+	end
+
+	def test_refresh
+		aug = aug_create
+		assert_equal([], aug.refresh)
+
+		File.open(File::join(TST_ROOT, "etc", "hosts"), "a") do |f|
+			f.puts "192.168.0.1\tnew.example.com"
+		end
+		assert_equal(["/etc/hosts"], aug.refresh)
+		assert_equal("new.example.com",
+					 aug.get("/files/etc/hosts/*[ipaddr = '192.168.0.1']/canonical"))
+		assert_equal([], aug.refresh)
+
+		File.unlink(File::join(TST_ROOT, "etc", "inittab"))
+		assert_equal(["/etc/inittab"], aug.refresh)
+		assert_equal([], aug.match("/files/etc/inittab"))
+		assert_equal([], aug.match("/augeas/files/etc/inittab"))
+	end
+
+	def test_each_match
+		aug = aug_create
+		expected = aug.match("/files/etc/*")
+		assert_equal(expected, aug.each_match("/files/etc/*").to_a)
+		assert_equal(expected.grep(/hosts/),
+					 aug.each_match("/files/etc/*").select { |p| p =~ /hosts/ }.to_a)
+		assert_raises(Augeas::InvalidPathError) { aug.each_match("//") { } }
+
+		# An external enumerator that is dropped after the first path
+		e = aug.each_match("/files/etc/*")
+		assert_equal(expected.first, e.next)
+		e = nil
+		GC.start
+		assert_equal(expected, aug.match("/files/etc/*"))
+	end
+
+	def test_match_cache
+		aug = aug_create(:match_cache => true)
+		assert(aug.match_cache?)
+		expected = aug.match("/files/etc/hosts/*")
+		assert_equal(expected, aug.match("/files/etc/hosts/*"))
+		assert_equal(1, aug.match_cache_stats[:hits])
+
+		aug.rm("/files/etc/hosts/1")
+		assert_equal(expected - ["/files/etc/hosts/1"],
+					 aug.match("/files/etc/hosts/*"))
+		assert_raises(Augeas::InvalidPathError) { aug.match("//") }
+		assert_equal(1, aug.match_cache_stats[:entries])
+	end
+
+	def test_load_many
+		aug_create.close
+		augs = Augeas::load_many([TST_ROOT, TST_ROOT, TST_ROOT],
+								 :loadpath => nil, :concurrency => 2,
+								 :match_cache => true)
+		assert_equal(3, augs.size)
+		augs.each do |aug|
+			assert_kind_of(Augeas::Facade, aug)
+			assert(aug.match_cache?)
+			assert_equal("localhost", aug.get("/files/etc/hosts/1/alias[1]"))
+			aug.close
+		end
+		assert_raises(ArgumentError) { Augeas::load_many([TST_ROOT], :root => "/") }
+		assert_raises(ArgumentError) {
+			Augeas::load_many([TST_ROOT], :concurrency => 0)
+		}
+	end
+
+	def test_ractor
+		omit("needs Ractor") unless defined?(Ractor)
+		aug_create.close
+		experimental = Warning[:experimental]
+		Warning[:experimental] = false
+		ractors = 2.times.map do
+			Ractor.new(TST_ROOT.dup.freeze) do |root|
+				aug = Augeas::create(:root => root, :loadpath => nil)
+				value = aug.get("/files/etc/hosts/1/alias[1]")
+				aug.close
+				value
+			end
+		end
+		assert_equal(["localhost", "localhost"], ractors.map(&:take))
+	ensure
+		Warning[:experimental] = experimental unless experimental.nil?
+	end
+
+	def test_create_lenses
+		aug = aug_create(:lenses => ["Hosts", "Sshd.lns"],
+						 :files => ["/etc/ssh/sshd_config", "/etc/hosts"])
+		assert_equal(["/augeas/load/Hosts", "/augeas/load/Sshd"],
+					 aug.match("/augeas/load/*"))
+		assert_equal(["/etc/hosts"], aug.get_all("/augeas/load/Hosts/incl").values)
+		assert_equal("Hosts.lns", aug.get("/augeas/files/etc/hosts/lens"))
+		assert_equal("Sshd.lns", aug.get("/augeas/files/etc/ssh/sshd_config/lens"))
+		assert_equal([], aug.match("/augeas/files//error"))
+		assert_equal("7", aug.get("/files/etc/ssh/sshd_config/Protocol"))
+		assert(!aug.exists("/files/etc/inittab"))
+		aug.close
+
+		aug = aug_create(:lenses => { "Inittab" => "/etc/inittab" })
+		assert_equal(["/augeas/load/Inittab"], aug.match("/augeas/load/*"))
+		assert_equal(["/files/etc/inittab"], aug.match("/files/etc/*"))
+		aug.close
+
+		aug = aug_create(:lenses => { "Hosts" => "/etc/hosts" }, :no_load => true)
+		assert_equal([], aug.match("/files/etc/*"))
+		aug.load
+		assert_equal(["/files/etc/hosts"], aug.match("/files/etc/*"))
+		aug.close
+
+		assert_raise(ArgumentError) { Augeas::create(:files => ["/etc/hosts"]) }
+		assert_raise(ArgumentError) { Augeas::create(:lenses => ["Hosts"]) }
+		assert_raise(ArgumentError) {
+			Augeas::create(:lenses => ["Hosts", "Sshd"], :files => ["/etc/hosts"],
+						   :no_load => true)
+		}
+	end
+
+	def test_tree_cache
+		cache = File::join(TOPDIR, "build", "tree_cache")
+		FileUtils::rm_rf(cache)
+		aug = aug_create(:tree_cache => cache)
+		expected = aug.tree("/files/etc/hosts")
+		stats = aug.tree_cache_stats
+		assert_equal(0, stats[:hits])
+		assert(stats[:misses] > 0)
+		aug.close
+		assert(!Dir.glob(File::join(cache, "*")).empty?)
+
+		aug = Augeas::create(:root => TST_ROOT, :loadpath => nil,
+							 :tree_cache => cache)
+		assert(aug.tree_cache_stats[:hits] > 0)
+		assert(!aug.dirty?)
+		assert_equal(expected, aug.tree("/files/etc/hosts"))
+		assert_equal("Hosts.lns", aug.get("/augeas/files/etc/hosts/lens"))
+		assert_equal([], aug.match("/augeas/load/*/excl[. = '/etc/hosts']"))
+		aug.close
+
+		File.open(File::join(TST_ROOT, "etc", "hosts"), "a") do |f|
+			f.puts "192.168.0.1\tnew.example.com"
+		end
+		aug = Augeas::create(:root => TST_ROOT, :loadpath => nil,
+							 :tree_cache => cache)
+		assert_equal("new.example.com",
+					 aug.get("/files/etc/hosts/*[ipaddr = '192.168.0.1']/canonical"))
+		aug.close
+	end
+
 	def test_transform
 		aug = aug_create(:no_load => true)
 		aug.clear_transforms
@@ -282,12 +435,191 @@ class TestAugeasFacade < Test::Unit::TestCase
 		assert_raises(Augeas::InvalidPathError) { aug.match('//') }
 	end
 
+	def test_get_all
+		aug = aug_create
+		aug.set("/foo/bar", "baz")
+		aug.set("/foo/baz", "qux")
+		aug.clear("/foo/qux")
+
+		assert_equal({ "/foo/bar" => "baz", "/foo/baz" => "qux",
+					   "/foo/qux" => nil }, aug.get_all("/foo/*"))
+		assert_equal({}, aug.get_all("/nonexistent"))
+		assert_equal(aug.match("/files/etc/hosts/*/ipaddr"),
+					 aug.get_all("/files/etc/hosts/*/ipaddr").keys)
+	end
+
+	def test_get_all_invalid_path
+		aug = aug_create
+		assert_raises(Augeas::InvalidPathError) { aug.get_all('//') }
+	end
+
+	def test_apply
+		aug = aug_create
+		n = aug.apply([[:set, "/foo/a", "1"],
+					   [:set, "/foo/b", nil],
+					   [:setm, "/foo", "c", "3"],
+					   [:insert, "/foo/a", "z", true],
+					   [:rename, "/foo/c", "d"],
+					   [:mv, "/foo/d", "/bar/d"],
+					   [:clear, "/foo/a"],
+					   [:rm, "/foo/b"]])
+		assert_equal(8, n)
+		assert_equal(["/foo/z", "/foo/a"], aug.match("/foo/*"))
+		assert_nil(aug.get("/foo/a"))
+		assert_equal("3", aug.get("/bar/d"))
+	end
+
+	def test_apply_invalid_op
+		aug = aug_create
+		assert_raises(ArgumentError) { aug.apply([[:frobnicate, "/foo"]]) }
+		assert_raises(ArgumentError) { aug.apply([[:set, "/foo"]]) }
+		assert_raises(TypeError) { aug.apply([[:rm, nil]]) }
+	end
+
+	def test_record_replay
+		aug = aug_create
+		journal = aug.record do |a|
+			a.set("/files/etc/hosts/1/alias[last()+1]", ["a1", "a2"])
+			a.touch("/files/etc/hosts/1/alias[. = 'a1']")
+			a.clear("/files/etc/hosts/2/alias")
+			a.defnode("h", "/files/etc/hosts/3", nil)
+			a.rename("/files/etc/hosts/2/alias", "nickname")
+			a.apply([[:rm, "/files/etc/hosts/3/alias"]])
+			assert_raises(Augeas::InvalidPathError) { a.set("/files/[", "x") }
+		end
+		assert(!aug.recording?)
+		assert_equal([[:set, "/files/etc/hosts/1/alias[last()+1]", "a1"],
+					  [:set, "/files/etc/hosts/1/alias[last()+1]", "a2"],
+					  [:touch, "/files/etc/hosts/1/alias[. = 'a1']"],
+					  [:clear, "/files/etc/hosts/2/alias"],
+					  [:defnode, "h", "/files/etc/hosts/3", nil],
+					  [:rename, "/files/etc/hosts/2/alias", "nickname"],
+					  [:rm, "/files/etc/hosts/3/alias"]], journal.ops)
+		expected = aug.tree("/files/etc/hosts")
+		aug.close
+
+		journal = Augeas::Journal.load(journal.dump)
+		aug = aug_create
+		assert_equal([], aug.replay(journal))
+		assert_equal(expected, aug.tree("/files/etc/hosts"))
+		assert(aug.dirty?)
+
+		errors = aug.replay([[:set, "/files/[", "x"],
+							[:set, "/files/etc/hosts/1/ipaddr", "10.0.0.1"],
+							[:mv, "/files/etc", "/files/etc/hosts"]])
+		assert_equal([0, 2], errors.map(&:index))
+		assert_kind_of(Augeas::InvalidPathError, errors[0])
+		assert_kind_of(Augeas::DescendantError, errors[1])
+		assert_equal("10.0.0.1", aug.get("/files/etc/hosts/1/ipaddr"))
+	end
+
+	def test_batch
+		aug = aug_create
+		n = aug.batch do |b|
+			b.set("/files/etc/hosts/1/alias[last()+1]", ["a1", "a2"])
+			b.rm("/files/etc/hosts/2")
+		end
+		assert_equal(3, n)
+		assert_equal(["a1", "a2"],
+					 aug.get_all("/files/etc/hosts/1/alias[position() > 3]").values)
+		assert_equal([], aug.match("/files/etc/hosts/2"))
+	end
+
+	def test_batch_failure
+		aug = aug_create
+		e = assert_raises(Augeas::InvalidPathError) do
+			aug.batch do |b|
+				b.set("/foo", "bar")
+				b.rm("//")
+				b.set("/baz", "qux")
+			end
+		end
+		assert_equal(1, e.index)
+		assert_equal("bar", aug.get("/foo"))
+		assert_nil(aug.get("/baz"))
+	end
+
+	def test_batch_rollback
+		aug = aug_create
+		ipaddr = aug.get("/files/etc/hosts/1/ipaddr")
+		e = assert_raises(Augeas::MultipleMatchesError) do
+			aug.batch(:rollback => true) do |b|
+				b.set("/files/etc/hosts/1/ipaddr", "10.0.0.1")
+				b.mv("/files/etc/hosts/*", "/elsewhere")
+			end
+		end
+		assert_equal(1, e.index)
+		assert_equal(ipaddr, aug.get("/files/etc/hosts/1/ipaddr"))
+	end
+
+	def test_batch_rollback_keeps_other_files
+		aug = aug_create
+		aug.set("/files/etc/group/root/gid", "42")
+		assert_raises(Augeas::MultipleMatchesError) do
+			aug.batch(:rollback => true) do |b|
+				b.set("/files/etc/hosts/1/ipaddr", "10.0.0.1")
+				b.set("/files/etc/hosts/*/ipaddr", "10.0.0.2")
+			end
+		end
+		assert_equal("127.0.0.1", aug.get("/files/etc/hosts/1/ipaddr"))
+		assert_equal("42", aug.get("/files/etc/group/root/gid"))
+		assert_equal(["/etc/group"], aug.dirty_files)
+	end
+
+	def test_tree
+		aug = aug_create
+		aug.set("/foo/a", "1")
+		aug.set("/foo/b/c", "2")
+		assert_equal([["foo", nil, [["a", "1", []],
+									["b", nil, [["c", "2", []]]]]]],
+					 aug.tree("/foo"))
+		assert_equal([["a", "1", []], ["b", nil, [["c", "2", []]]]],
+					 aug.tree("/foo/*"))
+
+		entry = aug.tree("/files/etc/hosts/1").first
+		assert_equal("1", entry[0])
+		assert_equal(["ipaddr", "127.0.0.1", []], entry[2].first)
+		assert_raises(Augeas::InvalidPathError) { aug.tree("//") }
+	end
+
+	def test_to_xml
+		aug = aug_create
+		aug.set("/foo/a", "1")
+		xml = aug.to_xml("/foo")
+		assert_match(/<augeas match="\/foo">/, xml)
+		assert_match(/<node label="a"[^>]*>\s*<value>1<\/value>/, xml)
+		assert_raises(Augeas::InvalidPathError) { aug.to_xml("//") }
+	end
+
 	def test_save
 		aug = aug_create
 		aug.set("/files/etc/hosts/1/garbage", "trash")
 		assert_raises(Augeas::CommandExecutionError) { aug.save }
 	end
 
+	def test_dirty
+		aug = aug_create
+		assert(!aug.dirty?)
+		assert_equal([], aug.dirty_files)
+
+		aug.set("/files/etc/hosts/1/alias[last()+1]", "new")
+		aug.rm("/files/etc/inittab/#comment[1]")
+		aug.get("/files/etc/group/root/gid")
+		assert(aug.dirty?)
+		assert_equal(["/etc/hosts", "/etc/inittab"], aug.dirty_files)
+
+		assert_equal(["/etc/hosts", "/etc/inittab"],
+					 aug.save(:return_changed => true).sort)
+		assert(!aug.dirty?)
+		assert_nil(aug.save)
+
+		aug.srun("set /files/etc/hosts/1/alias[last()+1] other")
+		assert(aug.dirty?)
+		assert_equal([], aug.dirty_files)
+		aug.load
+		assert(!aug.dirty?)
+	end
+
 	def test_save_tree_error
 		aug = aug_create(:no_load => true)
 		aug.set("/files/etc/sysconfig/iptables", "bad")
@@ -383,6 +715,21 @@ class TestAugeasFacade < Test::Unit::TestCase
 		assert_equal(["/files/etc/hosts/1"], aug.match("$x"))
 	end
 
+	def test_defnode_without_value
+		aug = aug_create
+		assert_equal(1, aug.defnode("y", "/new/node"))
+		assert_equal(["/new/node"], aug.match("$y"))
+		assert_nil(aug.get("$y"))
+	end
+
+	def test_error_cleared_after_raise
+		aug = aug_create
+		assert_raises(Augeas::InvalidPathError) { aug.get("//") }
+		assert_equal(TST_ROOT, aug.get("/augeas/root"))
+		assert_raises(Augeas::InvalidPathError) { aug.match("//") }
+		assert_equal([], aug.match("/nonexistent"))
+	end
+
 	def test_defnode_invalid_path
 		aug = aug_create
 		assert_raises (Augeas::InvalidPathError) { aug.defnode('x', '//', nil)}
@@ -460,6 +807,32 @@ class TestAugeasFacade < Test::Unit::TestCase
 		assert_equal(29..40, span[:span])
 	end
 
+	def test_spans
+		aug = aug_create
+
+		assert_equal([], aug.spans("/files/etc/ssh/sshd_config/*"))
+		assert_raises(Augeas::InvalidPathError) { aug.spans("/files/[") }
+
+		aug.set("/augeas/span", "enable")
+		aug.rm("/files/etc")
+		aug.load
+
+		path = "/files/etc/ssh/sshd_config/Protocol"
+		spans = aug.spans("/files/etc/ssh/sshd_config/*")
+		assert_equal(aug.match("/files/etc/ssh/sshd_config/*").size, spans.size)
+		assert_equal(1, spans.map { |s| s[:filename].object_id }.uniq.size)
+		assert spans.first[:filename].frozen?
+
+		span = spans.find { |s| s[:path] == path }
+		assert_equal(aug.span(path)[:filename], span[:filename])
+		assert_equal(29..37, span[:label])
+		assert_equal(38..39, span[:value])
+		assert_equal(29..40, span[:span])
+
+		flat = aug.spans(path, true)
+		assert_equal([[path, span[:filename], 29, 37, 38, 39, 29, 40]], flat)
+	end
+
 	def test_srun
 		aug = aug_create
 
@@ -474,6 +847,42 @@ class TestAugeasFacade < Test::Unit::TestCase
 		assert_equal(-2, aug.srun("quit")[0])
 	end
 
+	def test_srun_stream
+		require 'stringio'
+		aug = aug_create
+		expected = aug.srun("print /files/etc/hosts\n")[1]
+
+		io = StringIO.new
+		assert_equal([1, nil], aug.srun("print /files/etc/hosts\n", io: io))
+		assert_equal(expected, io.string)
+
+		chunks = []
+		r, out = aug.srun("print /files/etc/hosts\n") { |chunk| chunks << chunk }
+		assert_equal([1, nil], [r, out])
+		assert_equal(expected, chunks.join)
+
+		assert_raises(RuntimeError) do
+			aug.srun("print /files/etc/hosts\n") { |chunk| raise "stop" }
+		end
+		assert_equal(1, aug.srun("get /files/etc/hosts/1/ipaddr\n")[0])
+
+		# The handle is locked while the block runs
+		e = assert_raises(Augeas::Error) do
+			aug.srun("print /files/etc/hosts\n") { |chunk| aug.get("/files/etc/hosts/1/ipaddr") }
+		end
+		assert_match(/srun/, e.message)
+		assert_equal("127.0.0.1", aug.get("/files/etc/hosts/1/ipaddr"))
+
+		# The commands still run when passing their output on fails
+		aug.load
+		assert_raises(RuntimeError) do
+			aug.srun("print /files/etc/hosts\nset /files/etc/hosts/1/alias[last()+1] after\n") { |chunk| raise "stop" }
+		end
+		assert(aug.dirty?)
+		assert_equal("after", aug.get("/files/etc/hosts/1/alias[last()]"))
+		assert_raises(ArgumentError) { aug.srun("print /", out: io) }
+	end
+
 	def test_label
 		Augeas::create(:root => "/dev/null") do |aug|
 			assert_equal 'augeas', aug.label('/augeas')
@@ -510,6 +919,141 @@ class TestAugeasFacade < Test::Unit::TestCase
 		end
 	end
 
+	def test_parse_render
+		Augeas::create(:root => "/dev/null") do |aug|
+			tree = aug.parse('Hosts.lns', "127.0.0.1 localhost lo\n")
+			assert_equal([["1", nil, [["ipaddr", "127.0.0.1", []],
+									  ["canonical", "localhost", []],
+									  ["alias", "lo", []]]]], tree)
+			assert_equal([], aug.match('/*[label() != "augeas" and label() != "files"]'))
+			assert_equal([], aug.match('/augeas/text/*'))
+
+			tree[0][2][1][1] = "example.com"
+			assert_equal("127.0.0.1 example.com lo\n",
+						 aug.render('Hosts.lns', tree,
+									original: "127.0.0.1 localhost lo\n"))
+			assert_equal("10.0.0.1\texample.com\n",
+						 aug.render('Hosts.lns',
+									[["1", nil, [["ipaddr", "10.0.0.1"],
+												 ["canonical", "example.com"]]]]))
+
+			assert_raises(Augeas::CommandExecutionError) { aug.parse('Hosts.lns', "not a hosts line\n") }
+			assert_raises(Augeas::CommandExecutionError) { aug.render('Hosts.lns', [["1", nil, []]]) }
+			assert_raises(ArgumentError) { aug.render('Hosts.lns', [[nil, "x"]]) }
+			assert_equal([], aug.match('/*[label() != "augeas" and label() != "files"]'))
+		end
+	end
+
+	def test_import
+		aug = aug_create
+		hosts = [["1", nil, [["ipaddr", "10.0.0.1"], ["canonical", "a.example.com"],
+							 ["alias", "a"]]],
+				 ["2", nil, [["ipaddr", "10.0.0.2"], ["canonical", "b.example.com"]]]]
+		assert_equal(7, aug.import("/files/etc/hosts", hosts, mode: :replace))
+		assert_equal(["/files/etc/hosts/1", "/files/etc/hosts/2"],
+					 aug.match("/files/etc/hosts/*"))
+		assert_equal(["a"], aug.get_all("/files/etc/hosts/1/alias").values)
+		assert_equal("b.example.com", aug.get("/files/etc/hosts/2/canonical"))
+
+		journal = aug.record do
+			assert_equal(3, aug.import("/files/etc/hosts",
+									   [["1", nil, [["alias", "a1"], ["alias", "a2"]]]]))
+		end
+		assert_equal(["a1", "a2"], aug.get_all("/files/etc/hosts/1/alias").values)
+		assert_equal("10.0.0.1", aug.get("/files/etc/hosts/1/ipaddr"))
+
+		assert_equal(2, aug.import("/files/etc/hosts", { "2" => { "ipaddr" => "10.0.0.3" } }))
+		assert_equal("10.0.0.3", aug.get("/files/etc/hosts/2/ipaddr"))
+		assert_equal(["/etc/hosts"], aug.save(:return_changed => true))
+		content = File.read(File::join(TST_ROOT, "etc", "hosts"))
+		assert_match(/^10\.0\.0\.1\s+a\.example\.com\s+a1\s+a2$/, content)
+		assert_match(/^10\.0\.0\.3\s+b\.example\.com$/, content)
+		assert_no_match(/orange/, content)
+
+		assert_equal(2, aug.import("/new/node", { "a" => { "b" => 1 } }))
+		assert_equal("1", aug.get("/new/node/a/b"))
+
+		assert_raise(Augeas::MultipleMatchesError) {
+			aug.import("/files/etc/hosts/*", [["alias", "x"]])
+		}
+		error = assert_raise(Augeas::InvalidPathError) {
+			aug.import("/files/etc/hosts", [["3", nil, [["ipaddr", "x"], ["", "y"]]]])
+		}
+		assert_equal(2, error.index)
+		assert_raise(ArgumentError) { aug.import("/new", [], mode: :bogus) }
+		aug.close
+
+		aug = aug_create
+		assert_equal([], aug.replay(journal))
+		assert_equal(["a1", "a2", "galia"],
+					 aug.get_all("/files/etc/hosts/1/alias").values)
+		aug.close
+	end
+
+	def test_unload
+		aug = aug_create
+		other = Augeas::Facade::create(:root => TST_ROOT, :loadpath => nil, :no_load => true)
+		assert_equal(["/etc/hosts"], aug.unload("/etc/hosts"))
+		assert_equal(["/etc/hosts"], aug.unloaded_files)
+		# Only the handle that unloaded files checks for them
+		assert_equal(Augeas::Facade, other.method(:get).owner)
+		other.close
+		assert(!aug.exists("/augeas/files/etc/hosts"))
+		assert_equal(["/files/etc/ssh/sshd_config"], aug.match("/files/etc/ssh/*"))
+		assert_equal(["/etc/hosts"], aug.unloaded_files)
+
+		assert_equal("127.0.0.1", aug.get("/files/etc/hosts/1/ipaddr"))
+		assert_equal([], aug.unloaded_files)
+		assert(aug.exists("/augeas/files/etc/hosts"))
+
+		aug.set("/files/etc/hosts/1/alias[last()+1]", "piggy")
+		assert_equal(["/etc/ssh/sshd_config"], aug.unload("/etc/*/*"))
+		assert_equal([], aug.unload("/etc/hosts"))
+		aug.save
+		assert_equal(["/etc/hosts"], aug.unload("/etc/hosts"))
+
+		assert_equal("7", aug.get("/files/etc/ssh/sshd_config/Protocol"))
+		assert_equal(["/etc/hosts"], aug.unloaded_files)
+		assert_equal("piggy", aug.get("/files/etc/hosts/1/alias[last()]"))
+
+		# srun may have changed any file
+		aug.srun("set /files/etc/hosts/1/alias[last()+1] other")
+		assert_equal([], aug.unload("/etc/*/*"))
+		aug.load
+		assert_equal([], aug.unloaded_files)
+		aug.close
+	end
+
+	def test_tree_budget
+		aug = aug_create(:tree_budget => { :nodes => 1 })
+		assert_equal({ :nodes => 1 }, aug.tree_budget)
+		assert(aug.unloaded_files.include?("/etc/hosts"))
+
+		assert_equal("127.0.0.1", aug.get("/files/etc/hosts/1/ipaddr"))
+		assert(!aug.unloaded_files.include?("/etc/hosts"))
+		assert_equal("7", aug.get("/files/etc/ssh/sshd_config/Protocol"))
+		assert(aug.unloaded_files.include?("/etc/hosts"))
+		assert(!aug.unloaded_files.include?("/etc/ssh/sshd_config"))
+
+		# Paths that may lead anywhere need every file, but that does not
+		# count as a use of them
+		assert_equal(["/files/etc/hosts"], aug.match("/files/etc/hosts/1/.."))
+		assert_equal([], aug.unloaded_files)
+		aug.get("/files/etc/hosts/1/ipaddr")
+		assert(aug.unloaded_files.include?("/etc/ssh/sshd_config"))
+
+		# Files with unsaved changes stay
+		aug.set("/files/etc/hosts/1/alias[last()+1]", "piggy")
+		aug.get("/files/etc/ssh/sshd_config/Protocol")
+		assert(!aug.unloaded_files.include?("/etc/hosts"))
+
+		aug.tree_budget = nil
+		assert_nil(aug.tree_budget)
+		assert_raise(ArgumentError) { aug.tree_budget = { :bytes => -1 } }
+		assert_raise(ArgumentError) { aug.tree_budget = {} }
+		aug.close
+	end
+
 	def test_context
 		Augeas::create(:root => "/dev/null") do |aug|
 			aug.context = '/augeas'
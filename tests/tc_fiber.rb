@@ -0,0 +1,191 @@
+##
+#  Augeas tests
+#
+#  This library is free software; you can redistribute it and/or
+#  modify it under the terms of the GNU Lesser General Public
+#  License as published by the Free Software Foundation; either
+#  version 2.1 of the License, or (at your option) any later version.
+#
+#  This library is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#  Lesser General Public License for more details.
+#
+#  You should have received a copy of the GNU Lesser General Public
+#  License along with this library; if not, write to the Free Software
+#  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+##
+
+require 'test/unit'
+
+unless defined?(TOPDIR)
+  TOPDIR = File::expand_path(File::join(File::dirname(__FILE__), ".."))
+end
+
+$:.unshift(File::join(TOPDIR, "lib"))
+$:.unshift(File::join(TOPDIR, "ext", "augeas"))
+
+require 'augeas'
+require 'fileutils'
+
+class TestAugeasFiber < Test::Unit::TestCase
+
+	SRC_ROOT = File::expand_path(File::join(TOPDIR, "tests", "root")) + "/."
+	TST_ROOT = File::expand_path(File::join(TOPDIR, "build", "root")) + "/"
+
+	# The smallest Fiber scheduler that supports sleeping, Thread#join and
+	# Mutex; it counts how often a fiber had to wait in #block
+	class Scheduler
+		attr_reader :blocks
+
+		def initialize
+			@ready = []
+			@sleeping = {}
+			@waiting = 0
+			@blocks = 0
+			@lock = Mutex.new
+			@unblocked = []
+			@wake_r, @wake_w = IO.pipe
+		end
+
+		def fiber(&block)
+			fiber = Fiber.new(blocking: false, &block)
+			fiber.resume
+			fiber
+		end
+
+		def kernel_sleep(duration = nil)
+			@sleeping[Fiber.current] = now + (duration || 0)
+			Fiber.yield
+		end
+
+		def block(blocker, timeout = nil)
+			@blocks += 1
+			@waiting += 1
+			begin
+				Fiber.yield
+			ensure
+				@waiting -= 1
+			end
+		end
+
+		# Called from the thread that finishes or releases what +fiber+ waits
+		# for, which may not be ours
+		def unblock(blocker, fiber)
+			@lock.synchronize { @unblocked << fiber }
+			@wake_w.write_nonblock(".", exception: false)
+		end
+
+		def io_wait(io, events, timeout)
+			Fiber.blocking { IO.select([io], [io], nil, timeout) }
+			events
+		end
+
+		def close
+			until @ready.empty? && @sleeping.empty? && @waiting == 0
+				if @ready.empty?
+					timeout = @sleeping.empty? ? nil : [@sleeping.values.min - now, 0].max
+					if IO.select([@wake_r], nil, nil, timeout)
+						@wake_r.read_nonblock(1024, exception: false)
+					end
+				end
+				@ready += @lock.synchronize { @unblocked.slice!(0..-1) }
+				due = @sleeping.select { |_, t| t <= now }.keys
+				due.each { |f| @sleeping.delete(f) }
+				ready, @ready = @ready + due, []
+				ready.each { |f| f.resume if f.alive? }
+			end
+			@wake_r.close
+			@wake_w.close
+		end
+
+		private
+		def now
+			Process.clock_gettime(Process::CLOCK_MONOTONIC)
+		end
+	end
+
+	def setup
+		omit("needs Fiber.set_scheduler") unless Fiber.respond_to?(:set_scheduler)
+		FileUtils::rm_rf(TST_ROOT)
+		FileUtils::mkdir_p(TST_ROOT)
+		FileUtils::cp_r(SRC_ROOT, TST_ROOT)
+	end
+
+	# Run the block with a Scheduler in a thread of its own and return the
+	# scheduler once all fibers are done
+	def with_scheduler
+		scheduler = Scheduler.new
+		Thread.new do
+			Fiber.set_scheduler(scheduler)
+			yield
+		end.join
+		scheduler
+	end
+
+	def test_load_yields_to_other_fibers
+		aug = Augeas::create(:root => TST_ROOT, :loadpath => nil, :no_load => true)
+		ticks = 0
+		ticks_during_load = nil
+		loaded = false
+		result = nil
+		scheduler = with_scheduler do
+			Fiber.schedule do
+				before = ticks
+				aug.load
+				ticks_during_load = ticks - before
+				loaded = true
+				result = aug.match("/files/etc/hosts/*")
+				aug.set("/files/etc/hosts/1/alias[last()+1]", "fiber")
+				aug.save
+			end
+			# Only gets to run while the load is in progress if the load
+			# yields to the scheduler
+			Fiber.schedule do
+				until loaded
+					ticks += 1
+					sleep(0.001)
+				end
+			end
+		end
+		assert(scheduler.blocks >= 2)
+		assert(ticks_during_load > 0)
+		assert(!result.empty?)
+		assert_equal("fiber", aug.get("/files/etc/hosts/1/alias[last()]"))
+		assert(File.read(File::join(TST_ROOT, "etc", "hosts")).include?("fiber"))
+		aug.close
+	end
+
+	def test_fibers_share_handle
+		aug = Augeas::open(TST_ROOT, nil, Augeas::NO_MODL_AUTOLOAD)
+		aug.transform(:lens => "Hosts.lns", :incl => "/etc/hosts")
+		results = []
+		with_scheduler do
+			3.times do
+				Fiber.schedule do
+					aug.load
+					results << aug.match("/files/etc/hosts/*").size
+				end
+			end
+		end
+		assert_equal(3, results.size)
+		assert_equal(1, results.uniq.size)
+		aug.close
+	end
+
+	def test_errors_raise_in_fiber
+		aug = Augeas::create(:root => TST_ROOT, :loadpath => nil)
+		error = nil
+		with_scheduler do
+			Fiber.schedule do
+				begin
+					aug.match("/files/[")
+				rescue Augeas::Error => e
+					error = e
+				end
+			end
+		end
+		assert_kind_of(Augeas::InvalidPathError, error)
+		aug.close
+	end
+end
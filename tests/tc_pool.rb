@@ -0,0 +1,121 @@
+##
+#  Augeas::Pool tests
+#
+#  This library is free software; you can redistribute it and/or
+#  modify it under the terms of the GNU Lesser General Public
+#  License as published by the Free Software Foundation; either
+#  version 2.1 of the License, or (at your option) any later version.
+#
+#  This library is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#  Lesser General Public License for more details.
+#
+#  You should have received a copy of the GNU Lesser General Public
+#  License along with this library; if not, write to the Free Software
+#  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+##
+
+require 'test/unit'
+
+unless defined?(TOPDIR)
+  TOPDIR = File::expand_path(File::join(File::dirname(__FILE__), ".."))
+end
+
+$:.unshift(File::join(TOPDIR, "lib"))
+$:.unshift(File::join(TOPDIR, "ext", "augeas"))
+
+require 'augeas'
+require 'fileutils'
+
+class TestAugeasPool < Test::Unit::TestCase
+
+	SRC_ROOT = File::expand_path(File::join(TOPDIR, "tests", "root")) + "/."
+	TST_ROOT = File::expand_path(File::join(TOPDIR, "build", "pool_root")) + "/"
+
+	def setup
+		FileUtils::rm_rf(TST_ROOT) if File::directory?(TST_ROOT)
+		FileUtils::mkdir_p(TST_ROOT)
+		FileUtils::cp_r(SRC_ROOT, TST_ROOT)
+	end
+
+	def test_checkout_checkin
+		pool = Augeas::Pool.new(:size => 2, :root => TST_ROOT)
+		a = pool.checkout
+		b = pool.checkout
+		assert_not_same(a, b)
+		assert_equal(TST_ROOT, a.get("/augeas/root"))
+		assert_equal(2, pool.stats[:in_use])
+		pool.checkin(a)
+		pool.checkin(b)
+		assert_equal(0, pool.stats[:in_use])
+		assert_equal(2, pool.stats[:checkouts])
+		assert_raises(ArgumentError) { pool.checkin(a) }
+		pool.close
+	end
+
+	def test_timeout
+		pool = Augeas::Pool.new(:size => 1, :root => TST_ROOT)
+		pool.with do |aug|
+			assert_raises(Augeas::Pool::TimeoutError) { pool.checkout(0.05) }
+		end
+		stats = pool.stats
+		assert_equal(1, stats[:timeouts])
+		assert(stats[:wait_time] >= 0.05)
+		assert(stats[:max_wait_time] >= 0.05)
+		pool.close
+	end
+
+	def test_waits_for_checkin
+		pool = Augeas::Pool.new(:size => 1, :root => TST_ROOT)
+		aug = pool.checkout
+		waiter = Thread.new { pool.with(5) { |a| a.get("/augeas/root") } }
+		sleep 0.05
+		pool.checkin(aug)
+		assert_equal(TST_ROOT, waiter.value)
+		assert(pool.stats[:utilisation] > 0)
+		pool.close
+	end
+
+	def test_reset_on_checkin
+		pool = Augeas::Pool.new(:size => 1, :root => TST_ROOT)
+		pool.with do |aug|
+			aug.record
+			aug.context = "/files/etc"
+			aug.defvar("hosts", "/files/etc/hosts")
+			aug.set("/scratch/node", "value")
+			aug.set("/files/etc/hosts/1/ipaddr", "10.0.0.1")
+		end
+		pool.with do |aug|
+			assert(!aug.recording?)
+			assert_not_equal("/files/etc", aug.context)
+			assert_equal([], aug.match("/augeas/variables/*"))
+			assert_equal([], aug.match("/scratch"))
+			assert_equal("127.0.0.1", aug.get("/files/etc/hosts/1/ipaddr"))
+		end
+		pool.close
+	end
+
+	def test_checkin_reloads_changed_files_only
+		pool = Augeas::Pool.new(:size => 1, :root => TST_ROOT)
+		hosts = File::join(TST_ROOT, "etc", "hosts")
+		pool.with do |aug|
+			aug.set("/files/etc/group/root/gid", "42")
+			# Not parsed again on checkin, since the tree of hosts is clean
+			File.write(hosts, File.read(hosts).sub("127.0.0.1", "127.0.0.2"))
+		end
+		pool.with do |aug|
+			assert(!aug.dirty?)
+			assert_equal("0", aug.get("/files/etc/group/root/gid"))
+			assert_equal("127.0.0.1", aug.get("/files/etc/hosts/1/ipaddr"))
+		end
+		pool.close
+	end
+
+	def test_replaces_closed_handle
+		pool = Augeas::Pool.new(:size => 1, :root => TST_ROOT)
+		pool.with { |aug| aug.close }
+		pool.with { |aug| assert_equal(TST_ROOT, aug.get("/augeas/root")) }
+		pool.close
+	end
+end